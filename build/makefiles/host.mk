@@ -0,0 +1,63 @@
+TOOLCHAIN	:= gcc
+
+include $(MKDIR)/toolchain.mk
+include $(MKDIR)/profile.mk
+
+VPATH		+= $(SRCDIR)/host
+VPATH		+= $(SRCDIR)/common
+
+LIBSRCS		+= hostflash.c
+LIBSRCS		+= update.c
+LIBSRCS		+= sha2.c
+LIBSRCS		+= lz4.c
+
+SRCS		+= hostboot.c
+SRCS		+= fragtest.c
+SRCS		+= frag.c
+SRCS		+= $(LIBSRCS)
+
+ifneq ($(filter x86_64 i%86,$(shell uname -m)),)
+DEFS		+= SHA2_X86
+endif
+
+FLAGS		+= -I$(SRCDIR)/common
+FLAGS		+= -I$(SRCDIR)/host
+
+CFLAGS		+= -Wall
+CFLAGS		+= -O2
+
+LIBOBJS		= $(addsuffix .o,$(basename $(LIBSRCS)))
+OBJS		= $(addsuffix .o,$(basename $(SRCS)))
+
+libhostboot.a: $(LIBOBJS)
+	$(AR) rcs $@ $^
+
+hostboot: hostboot.o libhostboot.a
+
+fragtest: fragtest.o frag.o
+
+default: hostboot fragtest
+
+# update benchmark with regression gate (tools/fwtool/upbench.py), e.g.
+# BENCHFLAGS="--bootloader ../simul-unicorn/bootloader"
+bench: hostboot
+	python3 $(TOPDIR)/tools/fwtool/upbench.py run --hostboot ./hostboot $(BENCHFLAGS)
+
+# fragment reassembly test (frag.c against 'zfwtool.py mkfrags')
+fragcheck: fragtest
+	python3 -c "import random; random.seed(1); open('fragtest.up', 'wb').write(random.randbytes(20000))"
+	python3 $(TOPDIR)/tools/fwtool/zfwtool.py mkfrags -f 48 --trials 0 fragtest.up fragtest.frag
+	./fragtest fragtest.up fragtest.frag 48
+	./fragtest -l 0.02 -r 16 fragtest.up fragtest.frag 48
+
+clean:
+	rm -f *.o *.d *.map *.a hostboot fragtest fragtest.up fragtest.frag
+
+.PHONY: clean default bench fragcheck
+
+
+MAKE_DEPS       := $(MAKEFILE_LIST)     # before we include all the *.d files
+
+-include $(OBJS:.o=.d)
+
+$(OBJS): $(MAKE_DEPS)
@@ -0,0 +1,28 @@
+# Build profile: update types supported by the bootloader
+#
+#   plain	plain updates only
+#   lz4		plain and self-contained LZ4 updates (with preset dictionary,
+#		if the target has a dictionary region)
+#   delta	plus LZ4 block-delta updates
+#   full	plus chained updates (default)
+#
+# Decoders of unsupported update types are compiled out, and boottab.uptypes
+# advertises the supported types to the firmware.
+
+PROFILE		?= full
+
+UPTYPES_plain	:= PLAIN
+UPTYPES_lz4	:= $(UPTYPES_plain) LZ4 LZ4DICT
+UPTYPES_delta	:= $(UPTYPES_lz4) LZ4DELTA LZ4DELTAX LZ4DELTA2 LZ4SIGDELTA
+UPTYPES_full	:= $(UPTYPES_delta) CHAIN
+
+UPTYPES		:= $(UPTYPES_$(PROFILE))
+ifeq ($(UPTYPES),)
+    $(error Unknown PROFILE: $(PROFILE))
+endif
+
+UP_LZ4		:= $(filter LZ4%,$(UPTYPES))
+
+empty		:=
+space		:= $(empty) $(empty)
+DEFS		+= UP_UPTYPES="($(subst $(space),|,$(foreach t,$(UPTYPES),UP_UPTYPE($(t)))))"
@@ -1,4 +1,5 @@
 include $(MKDIR)/arm.mk
+include $(MKDIR)/profile.mk
 
 VPATH		+= $(SRCDIR)/arm/stm32lx
 VPATH		+= $(SRCDIR)/common
@@ -10,37 +11,71 @@ SRCS		+= startup.S
 
 SRCS		+= update.c
 SRCS		+= sha2.c
+ifneq ($(UP_LZ4),)
 SRCS		+= lz4.c
+endif
+
+# size of bootloader region (firmware is linked after it)
+BLFLASH_SZ_plain := 8K
+BLFLASH_SZ_lz4	:= 10K
+BLFLASH_SZ	?= $(if $(BLFLASH_SZ_$(PROFILE)),$(BLFLASH_SZ_$(PROFILE)),12K)
 
+# size of preset dictionary region at end of flash (set by board, 0: none),
+# only reserved if the profile supports preset dictionary updates
+BOOT_DICT_SZ	?= 0
+ifeq ($(filter LZ4DICT,$(UPTYPES)),)
+    override BOOT_DICT_SZ := 0
+endif
+DEFS		+= BOOT_DICT_SZ="($(patsubst %K,%*1024,$(BOOT_DICT_SZ)))"
 
-STM32		:= $(shell echo $(MCU) | sed 's/^STM32\(L[01]\)\([0-9][0-9]\)R\?\([8BZ]\)$$/ok t\/\1 v\/\2 s\/\3/')
+
+STM32		:= $(shell echo $(MCU) | sed 's/^STM32\(L[01]\)\([0-9][0-9]\)R\?\([8BCEZ]\)$$/ok t\/\1 v\/\2 s\/\3/')
 ifneq (ok,$(firstword $(STM32)))
     $(error Could not parse MCU: $(MCU))
 endif
 STM32_T		:= $(notdir $(filter t/%,$(STM32)))
 STM32_V		:= $(notdir $(filter v/%,$(STM32)))
 STM32_S		:= $(notdir $(filter s/%,$(STM32)))
+ifeq ($(wildcard $(SRCDIR)/arm/stm32lx/ld/STM32$(STM32_T)xx$(STM32_S).ld),)
+    $(error Unsupported flash size of MCU: $(MCU) (no linker script STM32$(STM32_T)xx$(STM32_S).ld))
+endif
 
 
 DEFS		+= STM32$(STM32_T)
 DEFS		+= STM32$(STM32_T)$(STM32_V)xx
 
-DEFS		+= LZ4_PAGEBUFFER_SZ=128
-DEFS		+= UP_PAGEBUFFER_SZ=128
+ifeq ($(STM32_T),L1)
+CPU		:= cortex-m3
+# density (stm32l1xx.h): 128K Cat.1/2, 256K Cat.3, 512K Cat.5
+DEFS		+= STM32L1XX_$(if $(filter 8 B,$(STM32_S)),MD,$(if $(filter C,$(STM32_S)),MDP,XL))
+else
+CPU		:= cortex-m0plus
+endif
 
-FLAGS		+= -mcpu=cortex-m0plus
+FLAGS		+= -mcpu=$(CPU)
 FLAGS		+= -I$(SRCDIR)/common
+FLAGS		+= -I$(SRCDIR)/arm/stm32lx
 
 CFLAGS		+= -Wall
 CFLAGS		+= -Os
 CFLAGS		+= -I$(SRCDIR)/arm/CMSIS/Device/ST/STM32$(STM32_T)xx/Include
 
-LDFLAGS		+= -mcpu=cortex-m0plus
+LDFLAGS		+= -mcpu=$(CPU)
+LDFLAGS		+= -Wl,--defsym=BLFLASH_SZ=$(BLFLASH_SZ)
+LDFLAGS		+= -Wl,--defsym=BOOT_DICT_SZ=$(BOOT_DICT_SZ)
 LDFLAGS		+= -T$(SRCDIR)/arm/stm32lx/ld/STM32$(STM32_T)xx$(STM32_S).ld
 LDFLAGS		+= -T$(SRCDIR)/arm/stm32lx/ld/STM32$(STM32_T).ld
 
 OBJS		= $(addsuffix .o,$(basename $(SRCS)))
 
+# preset dictionary (binary file created with 'zfwtool.py mkdict') linked into DICTFLASH
+ifneq ($(DICT),)
+OBJS		+= dict.o
+
+dict.o: $(DICT)
+	$(OBJCOPY) -I binary -O elf32-littlearm -B arm --rename-section .data=.dict,alloc,load,readonly,data,contents $< $@
+endif
+
 bootloader: $(OBJS)
 
 bootloader.hex: bootloader
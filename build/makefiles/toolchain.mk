@@ -6,8 +6,9 @@ ifeq ($(TOOLCHAIN),gcc)
     CC		:= $(CROSS_COMPILE)gcc
     AS		:= $(CROSS_COMPILE)as
     LD		:= $(CROSS_COMPILE)gcc
-    HEX		:= $(CROSS_COMPILE)objcopy -O ihex
-    BIN		:= $(CROSS_COMPILE)objcopy -O binary
+    OBJCOPY	:= $(CROSS_COMPILE)objcopy
+    HEX		:= $(OBJCOPY) -O ihex
+    BIN		:= $(OBJCOPY) -O binary
 endif
 
 CDEFS		+= $(DEFS)
@@ -1,4 +1,5 @@
 include $(MKDIR)/arm.mk
+include $(MKDIR)/profile.mk
 
 VPATH		+= $(SRCDIR)/arm/unicorn
 VPATH		+= $(SRCDIR)/common
@@ -8,17 +9,20 @@ SRCS		+= bootloader.c
 
 SRCS		+= update.c
 SRCS		+= sha2.c
+ifneq ($(UP_LZ4),)
 SRCS		+= lz4.c
+endif
 
-DEFS		+= UP_PAGEBUFFER_SZ=128
+CPU		?= cortex-m0plus
 
-FLAGS		+= -mcpu=cortex-m0plus
+FLAGS		+= -mcpu=$(CPU)
 FLAGS		+= -I$(SRCDIR)/common
+FLAGS		+= -I$(SRCDIR)/arm/unicorn
 
 CFLAGS		+= -Wall
 CFLAGS		+= -Os
 
-LDFLAGS		+= -mcpu=cortex-m0plus
+LDFLAGS		+= -mcpu=$(CPU)
 LDFLAGS		+= -T$(SRCDIR)/arm/unicorn/ld/mem.ld
 LDFLAGS		+= -T$(SRCDIR)/arm/unicorn/ld/bootloader.ld
 
@@ -18,7 +18,7 @@ static uint32_t boot_crc32 (void* buf, uint32_t nwords) {
 
     // enable crc peripheral
     RCC->AHBENR |= RCC_AHBENR_CRCEN;
-    // reset crc peripheral, reverse bits on input and output (L0 only)
+    // reset crc peripheral, reverse bits on input and output (L0 only, RBIT on L1)
     CRC->CR = 0
 #if defined(STM32L0)
 	| CRC_CR_REV_IN | CRC_CR_REV_OUT
@@ -28,7 +28,7 @@ static uint32_t boot_crc32 (void* buf, uint32_t nwords) {
     while (nwords-- > 0) {
 	v = *src++;
 #if defined(STM32L1)
-        v = __rbit(v);
+	v = __RBIT(v);
 #endif
 	CRC->DR = v;
     }
@@ -38,7 +38,7 @@ static uint32_t boot_crc32 (void* buf, uint32_t nwords) {
     RCC->AHBENR &= ~RCC_AHBENR_CRCEN;
 
 #if defined(STM32L1)
-    v = __rbit(v);
+    v = __RBIT(v);
 #endif
 
     return ~v;
@@ -155,6 +155,9 @@ typedef void (*wr_fl_hp) (uint32_t*, const uint32_t*);
 typedef struct {
     boot_uphdr* fwup;
     wr_fl_hp wf_func;
+    boot_telemetry* tm;		// telemetry of install
+    uint32_t* phase;		// telemetry phase time
+    uint32_t tick;		// last SysTick value
 } up_ctx;
 
 static void unlock_flash (void) {
@@ -193,26 +196,30 @@ static wr_fl_hp prep_wr_fl_hp (uint32_t* funcbuf) {
     return THUMB_FUNC(funcbuf);
 }
 
-static void fl_write (wr_fl_hp wf_func, uint32_t* dst, const uint32_t* src, uint32_t nwords, bool erase) {
+// (erase and program operations are counted in tm, if not NULL)
+static void fl_write (wr_fl_hp wf_func, uint32_t* dst, const uint32_t* src, uint32_t nwords, bool erase, boot_telemetry* tm) {
     while( nwords > 0 ) {
-	if( erase && (((uintptr_t) dst) & 127) == 0 ) {
+	if( erase && (((uintptr_t) dst) & (FLASH_PAGE_SZ - 1)) == 0 ) {
 	    // erase page
 	    FLASH->PECR |= FLASH_PECR_ERASE;
 	    *dst = 0;
 	    while( FLASH->SR & FLASH_SR_BSY );
 	    check_eop(2);
 	    FLASH->PECR &= ~FLASH_PECR_ERASE;
+	    if( tm ) {
+		tm->erases++;
+	    }
 	}
         if( src ) {
-            if( (((uintptr_t) dst) & 63) == 0 && nwords >= 16 ) {
+            if( (((uintptr_t) dst) & (FLASH_PROG_SZ - 1)) == 0 && nwords >= (FLASH_PROG_SZ >> 2) ) {
                 // write half page
                 FLASH->PECR |= FLASH_PECR_FPRG;
                 wf_func(dst, src);
                 check_eop(3);
                 FLASH->PECR &= ~FLASH_PECR_FPRG;
-                src += 16;
-                dst += 16;
-                nwords -= 16;
+                src += (FLASH_PROG_SZ >> 2);
+                dst += (FLASH_PROG_SZ >> 2);
+                nwords -= (FLASH_PROG_SZ >> 2);
             } else {
                 // write word
                 *dst++ = *src++;
@@ -220,10 +227,13 @@ static void fl_write (wr_fl_hp wf_func, uint32_t* dst, const uint32_t* src, uint
                 check_eop(4);
                 nwords -= 1;
             }
+	    if( tm ) {
+		tm->programs++;
+	    }
         } else {
-            if( nwords > 32 ) {
-                dst += 32;
-                nwords -= 32;
+            if( nwords > (FLASH_PAGE_SZ >> 2) ) {
+                dst += (FLASH_PAGE_SZ >> 2);
+                nwords -= (FLASH_PAGE_SZ >> 2);
             } else {
                 nwords = 0;
             }
@@ -236,7 +246,7 @@ static void write_flash (uint32_t* dst, const uint32_t* src, uint32_t nwords, bo
     wr_fl_hp wf_func = prep_wr_fl_hp(funcbuf);
 
     unlock_flash();
-    fl_write(wf_func, dst, src, nwords, erase);
+    fl_write(wf_func, dst, src, nwords, erase, NULL);
     relock_flash();
 }
 
@@ -246,6 +256,46 @@ static void ee_write (uint32_t* dst, uint32_t val) {
 }
 
 
+// ------------------------------------------------
+// Telemetry
+
+// start SysTick as free-running 24-bit down counter (core clock / 8)
+static uint32_t tm_start (void) {
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_ENABLE_Msk;
+    return SysTick->VAL;
+}
+
+// add ticks elapsed since last call to phase time
+static void tm_tick (uint32_t* ptick, uint32_t* phase) {
+    uint32_t now = SysTick->VAL;
+    *phase += (*ptick - now) & SysTick_LOAD_RELOAD_Msk;
+    *ptick = now;
+}
+
+static void tm_write (const boot_telemetry* tm) {
+    uint32_t* dst = (uint32_t*) BOOT_TELEMETRY_BASE;
+    const uint32_t* src = (const uint32_t*) tm;
+    // unlock EEPROM
+    FLASH->PEKEYR = 0x89ABCDEF; // FLASH_PEKEY1
+    FLASH->PEKEYR = 0x02030405; // FLASH_PEKEY2
+    for (int i = 0; i < sizeof(boot_telemetry) / 4; i++) {
+	// only write changed words to save EEPROM endurance
+	if (dst[i] != src[i]) {
+	    ee_write(&dst[i], src[i]);
+	}
+    }
+    // relock EEPROM
+    FLASH->PECR |= FLASH_PECR_PELOCK;
+}
+
+static const boot_telemetry* fw_telemetry (void) {
+    const boot_telemetry* tm = (const boot_telemetry*) BOOT_TELEMETRY_BASE;
+    return (tm->state == BOOT_TELEM_NONE || tm->state > BOOT_TELEM_FAILED) ? NULL : tm;
+}
+
+
 // ------------------------------------------------
 // Update glue functions
 
@@ -281,18 +331,68 @@ uint32_t up_install_init (void* ctx, uint32_t fwsize, void** pfwdst, uint32_t tm
     return BOOT_OK;
 }
 
+uint32_t up_dict (void* ctx, uint32_t dictcrc, uint32_t dictsize, uint8_t** pdict) {
+#if BOOT_DICT_SZ
+    boot_dicthdr* dh = (boot_dicthdr*) BOOT_DICT_BASE;
+    if (dh->crc != dictcrc || dh->size != dictsize
+	    || dictsize < sizeof(boot_dicthdr) || dictsize > BOOT_DICT_SZ || (dictsize & 3) != 0
+	    || boot_crc32(((unsigned char*) dh) + 8, (dictsize - 8) >> 2) != dictcrc) {
+	// dictionary not present or corrupted
+	return BOOT_E_GENERAL;
+    }
+    *pdict = (uint8_t*) (dh + 1);
+    return BOOT_OK;
+#else
+    return BOOT_E_NOIMPL;
+#endif
+}
+
+uint32_t up_progress_get (void* ctx) {
+    return ((boot_config*) BOOT_CONFIG_BASE)->upprogress;
+}
+
+void up_progress_set (void* ctx, uint32_t progress) {
+    boot_config* cfg = (boot_config*) BOOT_CONFIG_BASE;
+    // unlock EEPROM
+    FLASH->PEKEYR = 0x89ABCDEF; // FLASH_PEKEY1
+    FLASH->PEKEYR = 0x02030405; // FLASH_PEKEY2
+    ee_write(&cfg->upprogress, progress);
+    // relock EEPROM
+    FLASH->PECR |= FLASH_PECR_PELOCK;
+}
+
 void up_flash_wr_page (void* ctx, void* dst, void* src) {
     up_ctx* uc = ctx;
+    uint32_t* d = dst;
+    uint32_t* s = src;
+    int i = 0;
+
+    // skip erase and program if page content is unchanged (e.g. pages already
+    // written before an interrupted install was resumed)
+    while (i < (FLASH_PAGE_SZ >> 2) && d[i] == s[i]) {
+	i++;
+    }
+    if (i == (FLASH_PAGE_SZ >> 2)) {
+	uc->tm->skipped++;
+	return;
+    }
 #if defined(UPDATE_LED_GPIO)
     LED_ON(UPDATE_LED_GPIO);
 #endif
-    fl_write(uc->wf_func, dst, src, FLASH_PAGE_SZ >> 2, true);
+    fl_write(uc->wf_func, dst, src, FLASH_PAGE_SZ >> 2, true, uc->tm);
 #if defined(UPDATE_LED_GPIO)
     LED_OFF(UPDATE_LED_GPIO);
 #endif
+    tm_tick(&uc->tick, uc->phase);
 }
 
 void up_flash_unlock (void* ctx) {
+    up_ctx* uc = ctx;
+    // first flash write ends update check phase
+    if (uc->phase == &uc->tm->t_check) {
+	tm_tick(&uc->tick, uc->phase);
+	uc->phase = &uc->tm->t_install;
+    }
 #if defined(UPDATE_LED_GPIO)
     LED_INIT(UPDATE_LED_GPIO);
 #endif
@@ -310,15 +410,31 @@ void up_flash_lock (void* ctx) {
 // ------------------------------------------------
 // Update functions
 
-static void do_install (boot_uphdr* fwup) {
+static uint32_t do_install (boot_uphdr* fwup, boot_telemetry* tm, uint32_t tick) {
+    const boot_telemetry* prev = (const boot_telemetry*) BOOT_TELEMETRY_BASE;
     uint32_t funcbuf[WR_FL_HP_WORDS];
     up_ctx uc = {
 	.wf_func = prep_wr_fl_hp(funcbuf),
 	.fwup = fwup,
+	.tm = tm,
+	.phase = &tm->t_check,
+	.tick = tick,
     };
-    if (update(&uc, fwup, true) != BOOT_OK) {
+
+    // record install start, previous install was interrupted if still in progress
+    tm->state = BOOT_TELEM_INSTALLING;
+    tm->uptype = fwup->uptype;
+    tm->resumes = (prev->state == BOOT_TELEM_INSTALLING) ? prev->resumes + 1 : 0;
+    tm_write(tm);
+
+    uint32_t rv = update(&uc, fwup, true);
+    tm_tick(&uc.tick, uc.phase);
+    if (rv != BOOT_OK) {
+	tm->state = BOOT_TELEM_FAILED;
+	tm_write(tm);
 	boot_panic(BOOT_PANIC_TYPE_BOOTLOADER, BOOT_PANIC_REASON_UPDATE, 0);
     }
+    return uc.tick;
 }
 
 static bool check_update (boot_uphdr* fwup) {
@@ -355,6 +471,8 @@ static uint32_t set_update (void* ptr, hash32* hash) {
 		ee_write(&cfg->hash.w[i], hash->w[i]);
 	    }
 	}
+	// reset update progress
+	ee_write(&cfg->upprogress, 0);
 	// set update pointer
 	ee_write(&cfg->fwupdate1, (uint32_t) ptr);
 	ee_write(&cfg->fwupdate2, (uint32_t) ptr);
@@ -365,25 +483,43 @@ static uint32_t set_update (void* ptr, hash32* hash) {
 }
 
 
+static uint32_t fw_blksigs (uint32_t blksize, uint32_t* sigs, uint32_t maxblks) {
+    boot_fwhdr* fwh = (boot_fwhdr*) BOOT_FW_BASE;
+    return update_blksigs((uint8_t*) fwh, fwh->size, blksize, sigs, maxblks);
+}
+
+
 // ------------------------------------------------
 // Bootloader main entry point
 
 void* bootloader (void) {
     boot_fwhdr* fwh = (boot_fwhdr*) BOOT_FW_BASE;
     boot_config* cfg = (boot_config*) BOOT_CONFIG_BASE;
+    boot_telemetry tm = { 0 };
+    uint32_t tick = tm_start();
+    bool installed = false;
 
     // check presence and integrity of firmware update
     if (cfg->fwupdate1 == cfg->fwupdate2) {
 	boot_uphdr* fwup = (boot_uphdr*) cfg->fwupdate1;
 	if (fwup != NULL && check_update(fwup)) {
-	    do_install(fwup);
+	    tm_tick(&tick, &tm.t_crc);
+	    tick = do_install(fwup, &tm, tick);
+	    installed = true;
 	}
     }
 
     // verify integrity of current firmware
-    if (fwh->size < sizeof(boot_fwhdr)
-	    || fwh->size > (FLASH_SZ() - (BOOT_FW_BASE - FLASH_BASE))
-	    || boot_crc32(((unsigned char*) fwh) + 8, (fwh->size - 8) >> 2) != fwh->crc) {
+    bool fwok = (fwh->size >= sizeof(boot_fwhdr)
+	    && fwh->size <= (FLASH_SZ() - (BOOT_FW_BASE - FLASH_BASE))
+	    && boot_crc32(((unsigned char*) fwh) + 8, (fwh->size - 8) >> 2) == fwh->crc);
+    if (installed) {
+	tm_tick(&tick, &tm.t_verify);
+	tm.state = fwok ? BOOT_TELEM_DONE : BOOT_TELEM_FAILED;
+	tm_write(&tm);
+    }
+    SysTick->CTRL = 0;
+    if (!fwok) {
 	boot_panic(BOOT_PANIC_TYPE_BOOTLOADER, BOOT_PANIC_REASON_CRC, 0);
     }
 
@@ -408,12 +544,27 @@ void* bootloader (void) {
 //   0x103 - support for self-contained LZ4 updates
 //   0x104 - support for LZ4 block-delta updates
 //   0x105 - wr_flash: allow flash erase-only operation by setting src=NULL
+//   0x109 - support for LZ4 extended-window delta updates
+//   0x10a - support for LZ4 delta updates with v2 block header
+//   0x10b - support for LZ4 updates using preset dictionary
+//   0x10c - support for chained updates
+//   0x10d - added blksigs, support for LZ4 signature-delta updates
+//   0x10e - added telemetry, unchanged pages are not rewritten during install
+//   0x10f - added uptypes (update types supported by build profile)
+//   0x110 - reserved EEPROM area grown to 128 bytes (boot_config and telemetry record)
 
 __attribute__((section(".boot.boottab"))) const boot_boottab boottab = {
-    .version	= 0x108,
+    .version	= 0x110,
     .update	= set_update,
     .panic	= fw_panic,
     .crc32      = boot_crc32,
     .wr_flash   = write_flash,
     .sha256     = sha256,
+    .blksigs    = fw_blksigs,
+    .telemetry  = fw_telemetry,
+#if BOOT_DICT_SZ
+    .uptypes    = UP_UPTYPES,
+#else
+    .uptypes    = UP_UPTYPES & ~UP_UPTYPE(LZ4DICT), // no preset dictionary region
+#endif
 };
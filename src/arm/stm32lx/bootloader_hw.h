@@ -12,9 +12,6 @@
 #include "stm32l0xx.h"
 
 #define FLASH_SZ()		(*((uint16_t*) 0x1FF8007C) << 10)	// flash size register (L0x1 RM0377 28.1.1; L0x2 RM0376 33.1.1)
-#define FLASH_PAGE_SZ		128
-#define ROUND_PAGE_SZ(sz)       (((sz) + (FLASH_PAGE_SZ - 1)) & ~(FLASH_PAGE_SZ - 1))
-#define ISMULT_PAGE_SZ(sz)      (((sz) & (FLASH_PAGE_SZ - 1)) == 0)
 
 #define GPIO_RCC_ENR	RCC->IOPENR
 #define GPIO_RCC_ENB(p)	(((p) == 0) ? RCC_IOPENR_GPIOAEN \
@@ -22,18 +19,33 @@
 	: ((p) == 2) ? RCC_IOPENR_GPIOCEN \
 	: 0)
 
+#define GPIO_BSRR(port)	((port)->BSRR)
+
 
 // ------------------------------------------------
 #elif defined(STM32L1)
 
 #include "stm32l1xx.h"
 
+#if defined(STM32L1XX_MD)
+#define FLASH_SZ()		(*((uint16_t*) 0x1FF8004C) << 10)	// flash size register (Cat.1/2, RM0038 31.1.1)
+#else
+#define FLASH_SZ()		(*((uint16_t*) 0x1FF800CC) << 10)	// flash size register (Cat.3/5, RM0038 31.1.1)
+#endif
+
+#ifndef DATA_EEPROM_BASE
+#define DATA_EEPROM_BASE	0x08080000
+#endif
+
 #define GPIO_RCC_ENR	RCC->AHBENR
 #define GPIO_RCC_ENB(p)	(((p) == 0) ? RCC_AHBENR_GPIOAEN \
 	: ((p) == 1) ? RCC_AHBENR_GPIOBEN \
 	: ((p) == 2) ? RCC_AHBENR_GPIOCEN \
 	: 0)
 
+// 32-bit BSRR is split into BSRRL/BSRRH halves in stm32l1xx.h
+#define GPIO_BSRR(port)	(*((__IO uint32_t*) &(port)->BSRRL))
+
 
 // ------------------------------------------------
 #else
@@ -54,7 +66,7 @@
 #define PIN(gpio)	((gpio) & 0xff)
 
 #define SET_PIN(gpio, state) do { \
-    PORT(gpio)->BSRR |= (1 << (PIN(gpio) + ((state) ? 0 : 16))); \
+    GPIO_BSRR(PORT(gpio)) |= (1 << (PIN(gpio) + ((state) ? 0 : 16))); \
 } while (0)
 
 #define GPIO_ENABLE(p)	do { GPIO_RCC_ENR |= GPIO_RCC_ENB(p); } while (0)
@@ -15,8 +15,23 @@
 extern uint32_t _ebl;
 #define BOOT_FW_BASE	((uint32_t) (&_ebl))
 
+// EEPROM area reserved by bootloader (firmware must not use it):
+//   0x00 boot_config (64 bytes)
+//   0x40 boot_telemetry (40 bytes)
+//   0x68 RFU
 #define BOOT_CONFIG_BASE	DATA_EEPROM_BASE	// XXX
-#define BOOT_CONFIG_SZ		64			// XXX
+#define BOOT_CONFIG_SZ		128			// XXX
+
+#define BOOT_TELEMETRY_OFF	64			// update telemetry record
+#define BOOT_TELEMETRY_BASE	(BOOT_CONFIG_BASE + BOOT_TELEMETRY_OFF)
+
+// Preset dictionary region at end of flash (size 0: no preset dictionary),
+// reserved by the linker script (DICTFLASH, BOOT_DICT_SZ in stm32lx.mk)
+#ifndef BOOT_DICT_SZ
+#define BOOT_DICT_SZ		0
+#endif
+extern uint32_t _dict;
+#define BOOT_DICT_BASE		((uint32_t) (&_dict))
 
 
 // ------------------------------------------------
@@ -26,8 +41,12 @@ typedef struct {
     uint32_t	fwupdate1;	// 0x00 pointer to valid update
     uint32_t	fwupdate2;	// 0x04 pointer to valid update
     hash32	hash;		// 0x08 SHA-256 hash of valid update
+    uint32_t	upprogress;	// 0x28 update progress (number of completed chain links)
 
-    uint8_t	rfu[24];	// 0x28 RFU
+    uint8_t	rfu[20];	// 0x2c RFU
 } boot_config;
 
+_Static_assert(sizeof(boot_config) <= BOOT_TELEMETRY_OFF, "boot_config overlaps telemetry record");
+_Static_assert(BOOT_TELEMETRY_OFF + sizeof(boot_telemetry) <= BOOT_CONFIG_SZ, "telemetry record exceeds reserved EEPROM area");
+
 #endif
@@ -0,0 +1,30 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+#ifndef _flashgeom_h_
+#define _flashgeom_h_
+
+// ------------------------------------------------
+#if defined(STM32L0)
+
+#define FLASH_PAGE_SZ		128	// erase unit (RM0377 3.3.1)
+#define FLASH_PROG_SZ		64	// half-page programming
+#define FLASH_ERASED		0x00
+
+
+// ------------------------------------------------
+#elif defined(STM32L1)
+
+#define FLASH_PAGE_SZ		256	// erase unit (RM0038 3.3.1)
+#define FLASH_PROG_SZ		128	// half-page programming
+#define FLASH_ERASED		0x00
+
+
+// ------------------------------------------------
+#else
+#error "Unsupported MCU"
+#endif
+
+#endif
@@ -23,12 +23,19 @@ extern uint32_t _ebl;
 #define EEPROM_BASE     0x30000000
 #define EEPROM_SIZE     (8 * 1024)
 
-#define FLASH_PAGE_SZ       128
-#define ROUND_PAGE_SZ(sz)   (((sz) + (FLASH_PAGE_SZ - 1)) & ~(FLASH_PAGE_SZ - 1))
-#define ISMULT_PAGE_SZ(sz)  (((sz) & (FLASH_PAGE_SZ - 1)) == 0)
-
 #define FW_BASE         ((uint32_t) (&_ebl))
 #define CONFIG_BASE	EEPROM_BASE
+#define TELEMETRY_BASE  (CONFIG_BASE + 64)      // update telemetry record (after boot_config, within 128 reserved bytes)
+
+#define SYST_CSR        (*(volatile uint32_t*) 0xE000E010)      // SysTick (provided by simulator)
+#define SYST_RVR        (*(volatile uint32_t*) 0xE000E014)
+#define SYST_CVR        (*(volatile uint32_t*) 0xE000E018)
+#define SYST_MAX        0x00FFFFFF
+
+#ifndef DICT_SIZE
+#define DICT_SIZE       0       // preset dictionary region at end of flash
+#endif
+#define DICT_BASE       (FLASH_BASE + FLASH_SIZE - DICT_SIZE)
 
 
 // ------------------------------------------------
@@ -89,12 +96,14 @@ static void svc (uint32_t id, uint32_t p1, uint32_t p2, uint32_t p3) {
 // ------------------------------------------------
 // Flash functions
 
+// not inlined, the simulator hooks this function to apply its flash timing model
+__attribute__((noinline))
 void wr_flash (uint32_t* dst, const uint32_t* src, uint32_t nwords, bool erase) {
     if( ((uintptr_t) dst & 3) == 0 ) {
         while( nwords > 0 ) {
             if( erase && (((uintptr_t) dst) & (FLASH_PAGE_SZ-1)) == 0
                     && (uintptr_t) dst >= FLASH_BASE && (uintptr_t) dst < (FLASH_BASE + FLASH_SIZE) ) {
-                memset(dst, 0, FLASH_PAGE_SZ);
+                memset(dst, FLASH_ERASED, FLASH_PAGE_SZ);
             }
             int wtw;
             if( nwords > (FLASH_PAGE_SZ >> 2)) {
@@ -119,8 +128,52 @@ void wr_flash (uint32_t* dst, const uint32_t* src, uint32_t nwords, bool erase)
 typedef struct {
     boot_uphdr* fwup;
     bool unlocked;
+    boot_telemetry* tm;		// telemetry of install
+    uint32_t* phase;		// telemetry phase time
+    uint32_t tick;		// last SysTick value
 } up_ctx;
 
+static void ee_write (uint32_t* dst, uint32_t val) {
+    if( (uintptr_t) dst >= EEPROM_BASE && (uintptr_t) dst < (EEPROM_BASE + EEPROM_SIZE) ) {
+	*dst = val;
+    }
+}
+
+
+// ------------------------------------------------
+// Telemetry
+
+// start SysTick as free-running 24-bit down counter (core clock / 8)
+static uint32_t tm_start (void) {
+    SYST_RVR = SYST_MAX;
+    SYST_CVR = 0;
+    SYST_CSR = 1;
+    return SYST_CVR;
+}
+
+// add ticks elapsed since last call to phase time
+static void tm_tick (uint32_t* ptick, uint32_t* phase) {
+    uint32_t now = SYST_CVR;
+    *phase += (*ptick - now) & SYST_MAX;
+    *ptick = now;
+}
+
+static void tm_write (const boot_telemetry* tm) {
+    uint32_t* dst = (uint32_t*) TELEMETRY_BASE;
+    const uint32_t* src = (const uint32_t*) tm;
+    for (int i = 0; i < sizeof(boot_telemetry) / 4; i++) {
+	// only write changed words to save EEPROM endurance
+	if (dst[i] != src[i]) {
+	    ee_write(&dst[i], src[i]);
+	}
+    }
+}
+
+static const boot_telemetry* fw_telemetry (void) {
+    const boot_telemetry* tm = (const boot_telemetry*) TELEMETRY_BASE;
+    return (tm->state == BOOT_TELEM_NONE || tm->state > BOOT_TELEM_FAILED) ? NULL : tm;
+}
+
 uint32_t up_install_init (void* ctx, uint32_t fwsize, void** pfwdst, uint32_t tmpsize, void** ptmpdst, boot_fwhdr** pcurrentfw) {
     up_ctx* uc = ctx;
     if (!ISMULT_PAGE_SZ(fwsize) || fwsize > ((uintptr_t) uc->fwup - FW_BASE)) {
@@ -153,15 +206,43 @@ uint32_t up_install_init (void* ctx, uint32_t fwsize, void** pfwdst, uint32_t tm
     return BOOT_OK;
 }
 
+uint32_t up_dict (void* ctx, uint32_t dictcrc, uint32_t dictsize, uint8_t** pdict) {
+#if DICT_SIZE
+    boot_dicthdr* dh = (boot_dicthdr*) DICT_BASE;
+    if( dh->crc != dictcrc || dh->size != dictsize
+            || dictsize < sizeof(boot_dicthdr) || dictsize > DICT_SIZE || (dictsize & 3) != 0
+            || boot_crc32(((unsigned char*) dh) + 8, (dictsize - 8) >> 2) != dictcrc ) {
+        return BOOT_E_GENERAL;
+    }
+    *pdict = (uint8_t*) (dh + 1);
+    return BOOT_OK;
+#else
+    return BOOT_E_NOIMPL;
+#endif
+}
+
 void up_flash_wr_page (void* ctx, void* dst, void* src) {
     up_ctx* uc = ctx;
     if( uc->unlocked ) {
+        // skip erase and program if page content is unchanged (as stm32lx)
+        if( memcmp(dst, src, FLASH_PAGE_SZ) == 0 ) {
+            uc->tm->skipped++;
+            return;
+        }
         wr_flash(dst, src, FLASH_PAGE_SZ >> 2, true);
+        uc->tm->erases++;
+        uc->tm->programs += FLASH_PAGE_SZ / FLASH_PROG_SZ; // half-pages
+        tm_tick(&uc->tick, uc->phase);
     }
 }
 
 void up_flash_unlock (void* ctx) {
     up_ctx* uc = ctx;
+    // first flash write ends update check phase
+    if( uc->phase == &uc->tm->t_check ) {
+        tm_tick(&uc->tick, uc->phase);
+        uc->phase = &uc->tm->t_install;
+    }
     uc->unlocked = true;
 }
 
@@ -170,12 +251,6 @@ void up_flash_lock (void* ctx) {
     uc->unlocked = false;
 }
 
-static void ee_write (uint32_t* dst, uint32_t val) {
-    if( (uintptr_t) dst >= EEPROM_BASE && (uintptr_t) dst < (EEPROM_BASE + EEPROM_SIZE) ) {
-	*dst = val;
-    }
-}
-
 // ------------------------------------------------
 // Update functions
 
@@ -183,17 +258,42 @@ typedef struct {
     uint32_t	fwupdate1;	// 0x00 pointer to valid update
     uint32_t	fwupdate2;	// 0x04 pointer to valid update
     hash32	hash;		// 0x08 SHA-256 hash of valid update
+    uint32_t	upprogress;	// 0x28 update progress (number of completed chain links)
 
-    uint8_t	rfu[24];	// 0x28 RFU
+    uint8_t	rfu[20];	// 0x2c RFU
 } boot_config;
 
-static void do_install (boot_uphdr* fwup) {
+uint32_t up_progress_get (void* ctx) {
+    return ((boot_config*) CONFIG_BASE)->upprogress;
+}
+
+void up_progress_set (void* ctx, uint32_t progress) {
+    ee_write(&((boot_config*) CONFIG_BASE)->upprogress, progress);
+}
+
+static uint32_t do_install (boot_uphdr* fwup, boot_telemetry* tm, uint32_t tick) {
+    const boot_telemetry* prev = (const boot_telemetry*) TELEMETRY_BASE;
     up_ctx uc = {
 	.fwup = fwup,
+	.tm = tm,
+	.phase = &tm->t_check,
+	.tick = tick,
     };
-    if (update(&uc, fwup, true) != BOOT_OK) {
+
+    // record install start, previous install was interrupted if still in progress
+    tm->state = BOOT_TELEM_INSTALLING;
+    tm->uptype = fwup->uptype;
+    tm->resumes = (prev->state == BOOT_TELEM_INSTALLING) ? prev->resumes + 1 : 0;
+    tm_write(tm);
+
+    uint32_t rv = update(&uc, fwup, true);
+    tm_tick(&uc.tick, uc.phase);
+    if (rv != BOOT_OK) {
+	tm->state = BOOT_TELEM_FAILED;
+	tm_write(tm);
 	boot_panic(BOOT_PANIC_REASON_UPDATE);
     }
+    return uc.tick;
 }
 
 static bool check_update (boot_uphdr* fwup) {
@@ -226,6 +326,8 @@ static uint32_t set_update (void* ptr, hash32* hash) {
 		ee_write(&cfg->hash.w[i], hash->w[i]);
 	    }
 	}
+	// reset update progress
+	ee_write(&cfg->upprogress, 0);
 	// set update pointer
 	ee_write(&cfg->fwupdate1, (uint32_t) ptr);
 	ee_write(&cfg->fwupdate2, (uint32_t) ptr);
@@ -234,17 +336,30 @@ static uint32_t set_update (void* ptr, hash32* hash) {
 }
 
 
+static uint32_t fw_blksigs (uint32_t blksize, uint32_t* sigs, uint32_t maxblks) {
+    boot_fwhdr* fwh = (boot_fwhdr*) FW_BASE;
+    return update_blksigs((uint8_t*) fwh, fwh->size, blksize, sigs, maxblks);
+}
+
+
 // ------------------------------------------------
 // Bootloader information table
 
 static const boot_boottab boottab = {
-    .version	= 0x108,
+    .version	= 0x110,
     .update	= set_update,
     .panic	= fw_panic,
     .crc32      = boot_crc32,
     .svc        = svc,
     .wr_flash   = wr_flash,
     .sha256     = sha256,
+    .blksigs    = fw_blksigs,
+    .telemetry  = fw_telemetry,
+#if DICT_SIZE
+    .uptypes    = UP_UPTYPES,
+#else
+    .uptypes    = UP_UPTYPES & ~UP_UPTYPE(LZ4DICT), // no preset dictionary region
+#endif
 };
 
 // ------------------------------------------------
@@ -253,19 +368,31 @@ static const boot_boottab boottab = {
 void* bootloader (void) {
     boot_fwhdr* fwh = (boot_fwhdr*) FW_BASE;
     boot_config* cfg = (boot_config*) CONFIG_BASE;
+    boot_telemetry tm = { 0 };
+    uint32_t tick = tm_start();
+    bool installed = false;
 
     // check presence and integrity of firmware update
     if (cfg->fwupdate1 == cfg->fwupdate2) {
 	boot_uphdr* fwup = (boot_uphdr*) cfg->fwupdate1;
 	if (fwup != NULL && check_update(fwup)) {
-	    do_install(fwup);
+	    tm_tick(&tick, &tm.t_crc);
+	    tick = do_install(fwup, &tm, tick);
+	    installed = true;
 	}
     }
 
     // verify integrity of current firmware
-    if (fwh->size < sizeof(boot_fwhdr)
-	    || fwh->size > (FLASH_SIZE - (FW_BASE - FLASH_BASE))
-	    || boot_crc32(((unsigned char*) fwh) + 8, (fwh->size - 8) >> 2) != fwh->crc) {
+    bool fwok = (fwh->size >= sizeof(boot_fwhdr)
+	    && fwh->size <= (FLASH_SIZE - (FW_BASE - FLASH_BASE))
+	    && boot_crc32(((unsigned char*) fwh) + 8, (fwh->size - 8) >> 2) == fwh->crc);
+    if (installed) {
+	tm_tick(&tick, &tm.t_verify);
+	tm.state = fwok ? BOOT_TELEM_DONE : BOOT_TELEM_FAILED;
+	tm_write(&tm);
+    }
+    SYST_CSR = 0;
+    if (!fwok) {
 	boot_panic(BOOT_PANIC_REASON_CRC);
     }
 
@@ -12,8 +12,9 @@
 extern uint32_t _ebl;
 #define BOOT_FW_BASE	((uint32_t) (&_ebl))
 
+// EEPROM area reserved by bootloader: boot_config at 0x00, boot_telemetry at 0x40
 #define BOOT_CONFIG_BASE        0x30000000
-#define BOOT_CONFIG_SZ		64
+#define BOOT_CONFIG_SZ		128
 
 
 // ------------------------------------------------
@@ -23,8 +24,9 @@ typedef struct {
     uint32_t	fwupdate1;	// 0x00 pointer to valid update
     uint32_t	fwupdate2;	// 0x04 pointer to valid update
     hash32	hash;		// 0x08 SHA-256 hash of valid update
+    uint32_t	upprogress;	// 0x28 update progress (number of completed chain links)
 
-    uint8_t	rfu[24];	// 0x28 RFU
+    uint8_t	rfu[20];	// 0x2c RFU
 } boot_config;
 
 #endif
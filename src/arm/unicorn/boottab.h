@@ -21,6 +21,12 @@ typedef struct {
             uint32_t nwords, bool erase);
     void (*sha256) (uint32_t* hash,                     // SHA-256
             const uint8_t* msg, uint32_t len);
+    uint32_t (*blksigs) (uint32_t blksize,              // block signatures (sha256[0-7]) of installed firmware,
+            uint32_t* sigs, uint32_t maxblks);          // returns number of blocks
+
+    const boot_telemetry* (*telemetry) (void);          // telemetry of last update install (or NULL)
+
+    uint32_t uptypes;                                   // supported update types (bit mask of 1 << BOOT_UPTYPE_*)
 } boot_boottab;
 
 
@@ -0,0 +1,16 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+#ifndef _flashgeom_h_
+#define _flashgeom_h_
+
+// simulated flash, same as STM32L0 (must match tools/fwtool/unisim.py)
+#define FLASH_PAGE_SZ		128
+#define FLASH_PROG_SZ		64
+#ifndef FLASH_ERASED
+#define FLASH_ERASED		0x00	// value of erased flash (must match simulator flash model)
+#endif
+
+#endif
@@ -31,12 +31,31 @@
 #define BOOT_UPTYPE_PLAIN		0	// plain update
 #define BOOT_UPTYPE_LZ4			1	// lz4-compressed self-contained update
 #define BOOT_UPTYPE_LZ4DELTA		2	// lz4-compressed block-delta update
+#define BOOT_UPTYPE_LZ4DELTAX		3	// lz4-compressed block-delta update with extended window
+#define BOOT_UPTYPE_LZ4DELTA2		4	// lz4-compressed block-delta update with v2 block header
+#define BOOT_UPTYPE_LZ4DICT		5	// lz4-compressed self-contained update using preset dictionary
+#define BOOT_UPTYPE_CHAIN		6	// chain of updates applied in sequence (e.g. v1->v2->v3 deltas)
+#define BOOT_UPTYPE_LZ4SIGDELTA		7	// lz4-compressed block-delta update referencing block signatures
+
+
+// Max. number of dictionary segments per delta block (v2 block header)
+#define BOOT_UPDELTA_MAXSEGS		8
+
+// Delta block flags (v2 block header)
+#define BOOT_UPDELTA_F_WINDOW		0x01	// no segments, dictionary is the window centered on the block (as v1)
 
 
 // Magic numbers
 #define BOOT_MAGIC_SIZE			0xff1234ff	// place-holder for firmware size
 
 
+// Telemetry record states
+#define BOOT_TELEM_NONE			0	// no update installed yet
+#define BOOT_TELEM_INSTALLING		1	// install in progress (or interrupted by reset)
+#define BOOT_TELEM_DONE			2	// update installed
+#define BOOT_TELEM_FAILED		3	// install failed
+
+
 #ifndef ASSEMBLY
 
 #include <stddef.h>
@@ -73,6 +92,16 @@ typedef struct {
 _Static_assert(sizeof(boot_fwhdr) == 12, "sizeof(boot_fwhdr) must be 12");
 
 
+// Preset dictionary header
+typedef struct {
+    uint32_t	crc;		// dictionary CRC
+    uint32_t	size;		// dictionary size (in bytes, including this header)
+    /* -- everything below until end (size-8) is included in CRC -- */
+} boot_dicthdr;
+
+_Static_assert(sizeof(boot_dicthdr) == 8, "sizeof(boot_dicthdr) must be 8");
+
+
 // Hardware identifier (EUI-48, native byte order)
 typedef union {
     struct __attribute__((packed)) {
@@ -107,6 +136,14 @@ typedef struct {
 
 _Static_assert(sizeof(boot_uphdr) == 24, "sizeof(boot_uphdr) must be 24");
 
+// Update preset dictionary header
+typedef struct {
+    uint32_t	dictcrc;	// referenced preset dictionary CRC
+    uint32_t	dictsize;	// referenced preset dictionary size
+} boot_updicthdr;
+
+_Static_assert(sizeof(boot_updicthdr) == 8, "sizeof(boot_updicthdr) must be 8");
+
 // Update delta header
 typedef struct {
     uint32_t	refcrc;		// referenced firmware CRC
@@ -128,5 +165,78 @@ typedef struct __attribute__((packed)) {
 
 _Static_assert(sizeof(boot_updeltablk) == 14, "sizeof(boot_updeltablk) must be 14");
 
+// Update delta block with extended window (follows boot_updeltahdr)
+// The dictionary is the entire referenced firmware, rotated to end at block dictend (0 for
+// no rotation) so the data preceding dictend is in reach of 16-bit offsets, the lz4 data
+// uses 24-bit offset escapes for the rest
+typedef struct __attribute__((packed)) {
+    uint32_t    hash[2];        // block hash (sha256[0-7])
+    uint8_t     blkidx;         // block number
+    uint8_t     dictend;        // dictionary rotation (block number)
+    uint16_t    lz4len;         // length of lz4-compressed block data (in bytes, up to block size)
+    uint8_t     lz4data[];      // lz4-compressed block data
+} boot_updeltaxblk;
+
+_Static_assert(sizeof(boot_updeltaxblk) == 12, "sizeof(boot_updeltaxblk) must be 12");
+
+// Update delta dictionary segment
+typedef struct __attribute__((packed)) {
+    uint16_t    dictidx;        // dictionary block number
+    uint16_t    dictlen;        // length of dictionary data (in bytes)
+} boot_updeltaseg;
+
+_Static_assert(sizeof(boot_updeltaseg) == 4, "sizeof(boot_updeltaseg) must be 4");
+
+// Update delta block v2 (follows boot_updeltahdr)
+// The dictionary segments are concatenated in order to form one logical dictionary
+typedef struct __attribute__((packed)) {
+    uint32_t    hash[2];        // block hash (sha256[0-7])
+    uint16_t    blkidx;         // block number
+    uint8_t     nsegs;          // number of dictionary segments (up to BOOT_UPDELTA_MAXSEGS)
+    uint8_t     flags;          // flags (BOOT_UPDELTA_F_*)
+    uint16_t    lz4len;         // length of lz4-compressed block data (in bytes, up to block size)
+    boot_updeltaseg segs[];     // dictionary segments, followed by lz4-compressed block data
+} boot_updeltablk2;
+
+_Static_assert(sizeof(boot_updeltablk2) == 14, "sizeof(boot_updeltablk2) must be 14");
+
+
+// Update signature-delta header (followed by block signatures and v2 delta blocks)
+typedef struct {
+    uint32_t	refsize;	// referenced firmware size
+    uint32_t    blksize;        // block size (multiple of flash page size, e.g. 4096)
+    uint32_t	nsigs;		// number of referenced block signatures
+} boot_upsigdeltahdr;
+
+_Static_assert(sizeof(boot_upsigdeltahdr) == 12, "sizeof(boot_upsigdeltahdr) must be 12");
+
+// Update referenced block signature
+typedef struct {
+    uint32_t    hash[2];        // block hash of referenced firmware (sha256[0-7])
+    uint32_t    blkidx;         // block number
+} boot_upsigblk;
+
+_Static_assert(sizeof(boot_upsigblk) == 12, "sizeof(boot_upsigblk) must be 12");
+
+
+// Update telemetry record (in EEPROM, written by the bootloader when installing an update)
+// Times are SysTick ticks (core clock / 8) spent in each phase of the boot that installed the update.
+// Times and counters cover this final attempt only: the record is written when an install starts
+// and ends, so the work of attempts interrupted by reset is lost and only counted in resumes.
+typedef struct {
+    uint32_t	state;		// 0x00 state (BOOT_TELEM_*)
+    uint32_t	uptype;		// 0x04 update type
+    uint32_t	resumes;	// 0x08 number of times install was resumed after reset
+    uint32_t	t_crc;		// 0x0c update CRC check
+    uint32_t	t_check;	// 0x10 update check (until first flash write)
+    uint32_t	t_install;	// 0x14 install
+    uint32_t	t_verify;	// 0x18 firmware CRC verification
+    uint32_t	erases;		// 0x1c page erases
+    uint32_t	programs;	// 0x20 page programs (half-page or word)
+    uint32_t	skipped;	// 0x24 page writes skipped (content unchanged)
+} boot_telemetry;
+
+_Static_assert(sizeof(boot_telemetry) == 40, "sizeof(boot_telemetry) must be 40");
+
 #endif
 #endif
@@ -0,0 +1,184 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+// Reassembly of fragmented updates
+//
+// Fragments 1..nfrags carry the data uncoded and are stored directly. Parity
+// fragments (n > nfrags) are the XOR of the uncoded fragments selected by
+// row n-nfrags of the LoRaWAN fragmentation parity matrix. Known fragments
+// are eliminated from a parity fragment, which is then reduced by the rows
+// kept so far (Gaussian elimination over GF(2)) and kept with a pivot among
+// the missing fragments. When the rows cover all missing fragments they are
+// solved by back substitution and the recovered fragments are stored.
+
+#include <string.h>
+#include "frag.h"
+
+#define BM_GET(bm, i)	(((bm)[(i) >> 3] >> ((i) & 7)) & 1)
+#define BM_SET(bm, i)	((bm)[(i) >> 3] |= (1 << ((i) & 7)))
+#define BM_CLR(bm, i)	((bm)[(i) >> 3] &= ~(1 << ((i) & 7)))
+
+static uint8_t* row_bits (frag_session* s, int r) {
+    return s->rowbits + r * s->bmsz;
+}
+
+static uint8_t* row_data (frag_session* s, int r) {
+    return s->rowdata + r * s->fragsz;
+}
+
+static void xorbuf (uint8_t* dst, const uint8_t* src, int len) {
+    while (len-- > 0) {
+	*dst++ ^= *src++;
+    }
+}
+
+static uint32_t prbs23 (uint32_t x) {
+    return (x >> 1) | ((((x >> 0) ^ (x >> 5)) & 1) << 22);
+}
+
+// row n (1..) of parity matrix for m fragments
+static void matrix_line (uint8_t* bm, int n, int m) {
+    int pow2 = (m & (m - 1)) == 0;
+    uint32_t x = 1 + 1001 * n;
+    memset(bm, 0, (m + 7) >> 3);
+    for (int nc = 0; nc < (m >> 1); nc++) {
+	int r = 1 << 16;
+	while (r >= m) {
+	    x = prbs23(x);
+	    r = x % (m + pow2);
+	}
+	BM_SET(bm, r);
+    }
+}
+
+static int first_bit (frag_session* s, const uint8_t* bm) {
+    for (int i = 0; i < s->nfrags; i++) {
+	if (BM_GET(bm, i)) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+// reduce row (in slot nrows) by kept rows and keep it if independent
+static int add_row (frag_session* s) {
+    uint8_t* bits = row_bits(s, s->nrows);
+    uint8_t* data = row_data(s, s->nrows);
+    for (int r = 0; r < s->nrows; r++) {
+	if (BM_GET(bits, s->pivot[r])) {
+	    xorbuf(bits, row_bits(s, r), s->bmsz);
+	    xorbuf(data, row_data(s, r), s->fragsz);
+	}
+    }
+    int p = first_bit(s, bits);
+    if (p >= 0) {
+	s->pivot[s->nrows++] = p;
+    }
+    return p >= 0;
+}
+
+static void swapbuf (uint8_t* a, uint8_t* b, int len) {
+    while (len-- > 0) {
+	uint8_t t = *a;
+	*a++ = *b;
+	*b++ = t;
+    }
+}
+
+// remove kept row r (keeping order of remaining rows), moving it to slot nrows
+static void remove_row (frag_session* s, int r) {
+    for (s->nrows--; r < s->nrows; r++) {
+	swapbuf(row_bits(s, r), row_bits(s, r + 1), s->bmsz);
+	swapbuf(row_data(s, r), row_data(s, r + 1), s->fragsz);
+	s->pivot[r] = s->pivot[r + 1];
+    }
+}
+
+// solve kept rows when they cover all missing fragments
+static int solve (frag_session* s) {
+    if (s->nrows < s->nmissing) {
+	return FRAG_OK;
+    }
+    for (int r = s->nrows; r-- > 0; ) {
+	for (int q = r + 1; q < s->nrows; q++) {
+	    if (BM_GET(row_bits(s, r), s->pivot[q])) {
+		xorbuf(row_data(s, r), row_data(s, q), s->fragsz);
+	    }
+	}
+	s->wr(s->ctx, s->pivot[r] * s->fragsz, row_data(s, r), s->fragsz);
+	BM_CLR(s->missing, s->pivot[r]);
+    }
+    s->nrows = s->nmissing = 0;
+    return FRAG_COMPLETE;
+}
+
+void frag_init (frag_session* s, uint16_t nfrags, uint16_t fragsz, uint16_t maxrows, uint8_t* mem,
+	void* ctx, frag_wr wr, frag_rd rd) {
+    s->ctx = ctx;
+    s->wr = wr;
+    s->rd = rd;
+    s->nfrags = s->nmissing = nfrags;
+    s->fragsz = fragsz;
+    s->maxrows = maxrows;
+    s->nrows = 0;
+    s->bmsz = FRAG_BMSZ(nfrags);
+    s->pivot = (uint16_t*) mem;
+    s->missing = mem + 2 * maxrows;
+    s->rowbits = s->missing + s->bmsz;
+    s->rowdata = s->rowbits + s->bmsz * maxrows;
+    s->tmp = s->rowdata + fragsz * maxrows;
+    memset(s->missing, 0, s->bmsz);
+    for (int i = 0; i < nfrags; i++) {
+	BM_SET(s->missing, i);
+    }
+}
+
+// process fragment n (1..nfrags uncoded, >nfrags parity)
+int frag_put (frag_session* s, uint16_t n, const uint8_t* data) {
+    if (n == 0) {
+	return FRAG_E_INDEX;
+    }
+    if (s->nmissing == 0) {
+	return FRAG_COMPLETE;
+    }
+    if (n <= s->nfrags) {
+	int i = n - 1;
+	if (!BM_GET(s->missing, i)) {
+	    return FRAG_OK; // duplicate
+	}
+	s->wr(s->ctx, i * s->fragsz, data, s->fragsz);
+	BM_CLR(s->missing, i);
+	s->nmissing--;
+	// eliminate fragment from kept rows, re-reduce rows which lose their pivot
+	for (int r = 0; r < s->nrows; r++) {
+	    if (BM_GET(row_bits(s, r), i)) {
+		BM_CLR(row_bits(s, r), i);
+		xorbuf(row_data(s, r), data, s->fragsz);
+		if (s->pivot[r] == i) {
+		    remove_row(s, r--);
+		    add_row(s);
+		}
+	    }
+	}
+	return (s->nmissing == 0) ? FRAG_COMPLETE : solve(s);
+    }
+    if (s->nrows == s->maxrows) {
+	return FRAG_E_MEMORY;
+    }
+    // parity fragment: eliminate known fragments
+    uint8_t* bits = row_bits(s, s->nrows);
+    uint8_t* rdata = row_data(s, s->nrows);
+    matrix_line(bits, n - s->nfrags, s->nfrags);
+    memcpy(rdata, data, s->fragsz);
+    for (int i = 0; i < s->nfrags; i++) {
+	if (BM_GET(bits, i) && !BM_GET(s->missing, i)) {
+	    s->rd(s->ctx, i * s->fragsz, s->tmp, s->fragsz);
+	    xorbuf(rdata, s->tmp, s->fragsz);
+	    BM_CLR(bits, i);
+	}
+    }
+    add_row(s);
+    return solve(s);
+}
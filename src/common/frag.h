@@ -0,0 +1,52 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+#ifndef _frag_h_
+#define _frag_h_
+
+#include <stdint.h>
+
+// Reassembly of fragmented updates (LoRaWAN fragmented data block transport
+// parity matrix, see 'zfwtool.py mkfrags'). This code is not used by the
+// bootloader itself, but by the firmware receiving an update.
+
+// Return values
+enum {
+    FRAG_OK,			// fragment processed
+    FRAG_COMPLETE,		// all data has been reassembled
+    FRAG_E_INDEX,		// invalid fragment index
+    FRAG_E_MEMORY,		// too many lost fragments to keep parity fragment
+};
+
+// Storage callbacks (data area of nfrags*fragsz bytes, e.g. update area in flash)
+typedef void (*frag_wr) (void* ctx, uint32_t off, const uint8_t* data, uint32_t len);
+typedef void (*frag_rd) (void* ctx, uint32_t off, uint8_t* data, uint32_t len);
+
+typedef struct {
+    void* ctx;
+    frag_wr wr;
+    frag_rd rd;
+    uint16_t nfrags;		// number of uncoded fragments
+    uint16_t fragsz;		// fragment size (in bytes)
+    uint16_t maxrows;		// max. number of parity fragments kept
+    uint16_t nrows;		// number of parity fragments kept
+    uint16_t nmissing;		// number of uncoded fragments not yet known
+    uint16_t bmsz;		// bitmap size (in bytes)
+    uint8_t* missing;		// bitmap of uncoded fragments not yet known
+    uint8_t* rowbits;		// parity fragment rows (bitmaps over uncoded fragments)
+    uint8_t* rowdata;		// parity fragment rows (data)
+    uint16_t* pivot;		// parity fragment rows (pivot)
+    uint8_t* tmp;		// fragment buffer
+} frag_session;
+
+// memory required for session (16-bit aligned, maxrows should be at least the expected number of lost fragments)
+#define FRAG_BMSZ(nfrags)			(((nfrags) + 7) >> 3)
+#define FRAG_MEMSZ(nfrags, fragsz, maxrows)	(FRAG_BMSZ(nfrags) * (1 + (maxrows)) + (fragsz) * (1 + (maxrows)) + 2 * (maxrows))
+
+void frag_init (frag_session* s, uint16_t nfrags, uint16_t fragsz, uint16_t maxrows, uint8_t* mem,
+	void* ctx, frag_wr wr, frag_rd rd);
+int frag_put (frag_session* s, uint16_t n, const uint8_t* data);
+
+#endif
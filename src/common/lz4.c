@@ -21,26 +21,45 @@
 #endif
 #endif
 
+// word copies into page buffer with unaligned loads (ARMv7-M: LDR, STR)
+#if defined(LZ4_PAGEBUFFER_SZ) && defined(__ARM_FEATURE_UNALIGNED)
+#define LZ4_WORDCOPY
+typedef struct { uint32_t w; } __attribute__((packed, may_alias)) lz4_u32;
+#endif
+
 typedef struct {
     unsigned char* dst;
     int dstlen;
-    unsigned char* dictend;
+    const lz4dict* dict;
+    int ndict;
 #ifdef LZ4_PAGEBUFFER_SZ
     uint32_t pagebuf[LZ4_PAGEBUFFER_SZ / 4];
     void* ctx;
 #endif
 } lz4state;
 
+// get byte at distance d (1..) before end of logical dictionary (segments stitched together)
+static unsigned char dictbyte (lz4state* z, int d) {
+    int i = z->ndict;
+    while (i-- > 0) {
+	if (d <= z->dict[i].len) {
+	    return z->dict[i].ptr[z->dict[i].len - d];
+	}
+	d -= z->dict[i].len;
+    }
+    return 0; // invalid reference - should not happen!
+}
+
 // store byte in output buffer (negative b is match offset, else literal)
 // auto-flush buffer on page boundaries
 static void putbyte (lz4state* z, int b) {
 #ifdef LZ4_PAGEBUFFER_SZ
     int pageoff = z->dstlen & (LZ4_PAGEBUFFER_SZ - 1);
     // check for match reference
-    if (b < 0) { // use referenced byte at distance 1..65535
+    if (b < 0) { // use referenced byte at distance 1..16777215
 	b = (pageoff+b >= 0) ?
 	    ((unsigned char*) z->pagebuf)[pageoff + b] : // referenced byte in page buffer
-	    ((z->dstlen + b < 0) ? z->dictend[z->dstlen + b] : z->dst[z->dstlen + b]); // referenced byte in dict or in previous output
+	    ((z->dstlen + b < 0) ? dictbyte(z, -(z->dstlen + b)) : z->dst[z->dstlen + b]); // referenced byte in dict or in previous output
     }
     // store byte in page buffer
     ((unsigned char*) z->pagebuf)[pageoff] = (unsigned char) b;
@@ -50,23 +69,47 @@ static void putbyte (lz4state* z, int b) {
 	up_flash_wr_page(z->ctx, (z->dst + (z->dstlen & ~(LZ4_PAGEBUFFER_SZ - 1))), z->pagebuf);
     }
 #else
-    z->dst[z->dstlen] = (b < 0) ? ((z->dstlen + b < 0) ? z->dictend[z->dstlen + b] : z->dst[z->dstlen + b]) : (unsigned char) b;
+    z->dst[z->dstlen] = (b < 0) ? ((z->dstlen + b < 0) ? dictbyte(z, -(z->dstlen + b)) : z->dst[z->dstlen + b]) : (unsigned char) b;
 #endif
     z->dstlen++;
 }
 
-// decompress from src to dst optionally using dict, return uncompressed size
+#ifdef LZ4_WORDCOPY
+// copy whole words of a run into page buffer, src is literal data or NULL for a
+// match at distance offset within page buffer (offset >= 4, so every word read
+// has been written before), the last word of a page is left to putbyte for flushing
+static int putwords (lz4state* z, const unsigned char* src, int offset, int len) {
+    int pageoff = z->dstlen & (LZ4_PAGEBUFFER_SZ - 1);
+    if ((pageoff & 3) != 0 || (src == NULL && (offset < 4 || offset > pageoff))) {
+	return 0;
+    }
+    int n = (len < LZ4_PAGEBUFFER_SZ - 4 - pageoff) ? (len & ~3) : (LZ4_PAGEBUFFER_SZ - 4 - pageoff);
+    uint32_t* d = z->pagebuf + (pageoff >> 2);
+    const unsigned char* s = src ? src : (unsigned char*) d - offset;
+    for (int i = 0; i < n; i += 4) {
+	*d++ = ((const lz4_u32*) (s + i))->w;
+    }
+    z->dstlen += n;
+    return n;
+}
+#endif
+
+// decompress from src to dst optionally using dictionary segments, return uncompressed size
+// the segments are concatenated in order to form one logical dictionary
 // depending on configuration the uncompressed data is written directly or
 // buffered to ram, or buffered to flash
-// if buffering is used, the last page will be padded with FF
-int lz4_decompress (void* ctx, unsigned char* src, int srclen, unsigned char* dst, unsigned char* dict, int dictlen) {
+// if buffering is used, the last page will be padded with FLASH_ERASED
+// a match offset of 0 (invalid in standard LZ4) escapes a 24-bit offset,
+// allowing references into dictionaries larger than 64K
+int lz4_decompress_segs (void* ctx, unsigned char* src, int srclen, unsigned char* dst, const lz4dict* dict, int ndict) {
     unsigned char* srcend = src + srclen;
     lz4state z;
 
     // init state
     z.dst = dst;
     z.dstlen = 0;
-    z.dictend = dict + dictlen;
+    z.dict = dict;
+    z.ndict = ndict;
 #ifdef LZ4_PAGEBUFFER_SZ
     z.ctx = ctx;
 #endif
@@ -79,20 +122,40 @@ int lz4_decompress (void* ctx, unsigned char* src, int srclen, unsigned char* ds
 	int l, len = token >> 4;
 	if (len == 15) do { l = *src++; len += l; } while (l == 255);
 	// copy literals
-	while (len--) {
+	while (len > 0) {
+#ifdef LZ4_WORDCOPY
+	    if (len >= 4 && (l = putwords(&z, src, 0, len)) > 0) {
+		src += l;
+		len -= l;
+		continue;
+	    }
+#endif
 	    putbyte(&z, *src++);
+	    len--;
 	}
 	if (src < srcend) { // last sequence is incomplete and stops after the literals
 	    // get offset
 	    int offset = *src++;
 	    offset = (*src++ << 8) | offset; // 16-bit LSB-first
+	    if (offset == 0) { // extended offset
+		offset = *src++;
+		offset |= (*src++ << 8);
+		offset |= (*src++ << 16); // 24-bit LSB-first
+	    }
 	    // get match length
 	    len = token & 0x0F;
 	    if (len == 15) do { l = *src++; len += l; } while(l == 255);
 	    len += 4; // minmatch
 	    // copy matches from output stream or from dict
-	    while (len--) {
+	    while (len > 0) {
+#ifdef LZ4_WORDCOPY
+		if (len >= 4 && (l = putwords(&z, NULL, offset, len)) > 0) {
+		    len -= l;
+		    continue;
+		}
+#endif
 		putbyte(&z, -offset);
+		len--;
 	    }
 	}
     }
@@ -101,12 +164,18 @@ int lz4_decompress (void* ctx, unsigned char* src, int srclen, unsigned char* ds
     int n = z.dstlen;
 #ifdef LZ4_PAGEBUFFER_SZ
     while (z.dstlen & (LZ4_PAGEBUFFER_SZ - 1)) {
-	putbyte(&z, 0xFF);
+	putbyte(&z, FLASH_ERASED);
     }
 #endif
     return n;
 }
 
+// decompress from src to dst optionally using dict, return uncompressed size
+int lz4_decompress (void* ctx, unsigned char* src, int srclen, unsigned char* dst, unsigned char* dict, int dictlen) {
+    lz4dict d = { .ptr = dict, .len = dictlen };
+    return lz4_decompress_segs(ctx, src, srclen, dst, &d, 1);
+}
+
 
 #ifdef LZ4_standalone
 // ------------------------------------------------
@@ -6,6 +6,13 @@
 #ifndef _lz4_h_
 #define _lz4_h_
 
+// dictionary segment
+typedef struct {
+    unsigned char* ptr;		// segment data
+    int len;			// segment length (in bytes)
+} lz4dict;
+
 int lz4_decompress (void* ctx, unsigned char* src, int srclen, unsigned char* dst, unsigned char* dict, int dictlen);
+int lz4_decompress_segs (void* ctx, unsigned char* src, int srclen, unsigned char* dst, const lz4dict* dict, int ndict);
 
 #endif
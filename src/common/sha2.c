@@ -7,12 +7,25 @@
 
 #include "sha2.h"
 
+#ifdef SHA2_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 #define ENDIAN_n2b32(x) __builtin_bswap32(x)
 #else
 #define ENDIAN_n2b32(x) (x)
 #endif
 
+#if defined(__ARM_FEATURE_UNALIGNED) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// ARMv7-M: unaligned word load and byte reversal (LDR, REV)
+typedef struct { uint32_t w; } __attribute__((packed, may_alias)) sha2_u32;
+#define LOAD_BE32(p)	__builtin_bswap32(((const sha2_u32*) (p))->w)
+#else
+#define LOAD_BE32(p)	(((p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+#endif
+
 // ------------------------------------------------
 // SHA-256
 
@@ -25,8 +38,7 @@
 #define SIG0(x)		(ROR(x, 7)  ^ ROR(x, 18) ^ ((x) >> 3))
 #define SIG1(x)		(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
 
-static void sha256_do (uint32_t* state, const uint8_t* block) {
-    static const uint32_t K[64] = {
+static const uint32_t K[64] = {
 	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
 	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 
 	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -43,12 +55,18 @@ static void sha256_do (uint32_t* state, const uint8_t* block) {
 	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 
 	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
 	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
+};
 
+static const uint32_t H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static void sha256_do (uint32_t* state, const uint8_t* block) {
     uint32_t a, b, c, d, e, f, g, h, i, j, t1, t2, w[64];
 
     for (i = 0, j = 0; i < 16; i++, j += 4) {
-	w[i] = (block[j] << 24) | (block[j + 1] << 16) | (block[j + 2] << 8) | (block[j + 3]);
+	w[i] = LOAD_BE32(block + j);
     }
     for ( ; i < 64; i++) {
 	w[i] = SIG1(w[i - 2]) + w[i - 7] + SIG0(w[i - 15]) + w[i - 16];
@@ -86,6 +104,121 @@ static void sha256_do (uint32_t* state, const uint8_t* block) {
     state[7] += h;
 }
 
+#ifdef SHA2_X86
+// ------------------------------------------------
+// x86 kernels (host builds only)
+
+// SHA-NI, single buffer
+__attribute__((target("sha,sse4.1")))
+static void sha256_shani (uint32_t* state, const uint8_t* data, uint32_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xb1); // CDAB
+    __m128i s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1b); // EFGH
+    __m128i s0 = _mm_alignr_epi8(tmp, s1, 8); // ABEF
+    s1 = _mm_blend_epi16(s1, tmp, 0xf0); // CDGH
+
+    while (nblocks--) {
+	__m128i abef = s0, cdgh = s1, m[4];
+	for (int i = 0; i < 16; i++) {
+	    if (i < 4) {
+		m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * i)), mask);
+	    } else {
+		m[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+			    _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)), m[(i + 3) & 3]);
+	    }
+	    __m128i w = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i*) &K[4 * i]));
+	    s1 = _mm_sha256rnds2_epu32(s1, s0, w);
+	    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(w, 0x0e));
+	}
+	s0 = _mm_add_epi32(s0, abef);
+	s1 = _mm_add_epi32(s1, cdgh);
+	data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(s0, 0x1b); // FEBA
+    s1 = _mm_shuffle_epi32(s1, 0xb1); // DCHG
+    _mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(tmp, s1, 0xf0)); // DCBA
+    _mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(s1, tmp, 8)); // HGFE
+}
+
+// AVX2, eight buffers (one block per lane)
+#define VROR(x,n)	_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define VADD(a,b)	_mm256_add_epi32(a, b)
+#define VXOR3(a,b,c)	_mm256_xor_si256(_mm256_xor_si256(a, b), c)
+
+__attribute__((target("avx2")))
+static void sha256_avx2x8 (uint32_t state[8][8], const uint8_t* const* blocks) {
+    __m256i w[64], v[8];
+    for (int i = 0; i < 16; i++) {
+	uint32_t x[8];
+	for (int l = 0; l < 8; l++) {
+	    const uint8_t* b = blocks[l] + 4 * i;
+	    x[l] = (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+	}
+	w[i] = _mm256_loadu_si256((const __m256i*) x);
+    }
+    for (int i = 16; i < 64; i++) {
+	__m256i s0 = VXOR3(VROR(w[i - 15], 7), VROR(w[i - 15], 18), _mm256_srli_epi32(w[i - 15], 3));
+	__m256i s1 = VXOR3(VROR(w[i - 2], 17), VROR(w[i - 2], 19), _mm256_srli_epi32(w[i - 2], 10));
+	w[i] = VADD(VADD(s1, w[i - 7]), VADD(s0, w[i - 16]));
+    }
+    for (int j = 0; j < 8; j++) {
+	v[j] = _mm256_loadu_si256((const __m256i*) state[j]);
+    }
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    for (int i = 0; i < 64; i++) {
+	__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+	__m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+	__m256i t1 = VADD(VADD(h, VXOR3(VROR(e, 6), VROR(e, 11), VROR(e, 25))),
+		VADD(ch, VADD(_mm256_set1_epi32(K[i]), w[i])));
+	__m256i t2 = VADD(VXOR3(VROR(a, 2), VROR(a, 13), VROR(a, 22)), maj);
+	h = g;
+	g = f;
+	f = e;
+	e = VADD(d, t1);
+	d = c;
+	c = b;
+	b = a;
+	a = VADD(t1, t2);
+    }
+    v[0] = VADD(v[0], a); v[1] = VADD(v[1], b); v[2] = VADD(v[2], c); v[3] = VADD(v[3], d);
+    v[4] = VADD(v[4], e); v[5] = VADD(v[5], f); v[6] = VADD(v[6], g); v[7] = VADD(v[7], h);
+    for (int j = 0; j < 8; j++) {
+	_mm256_storeu_si256((__m256i*) state[j], v[j]);
+    }
+}
+
+#undef VROR
+#undef VADD
+#undef VXOR3
+
+static int kernel = -1;
+
+// pad last (partial) block of message, return number of padding blocks (1 or 2)
+static int sha256_pad (uint8_t* pad, const uint8_t* msg, uint32_t len, uint32_t totlen) {
+    uint32_t bitlen = ENDIAN_n2b32(totlen << 3);
+    int n = (len < 56) ? 1 : 2;
+    memset(pad, 0, 64 * n);
+    memcpy(pad, msg, len);
+    pad[len] = 0x80;
+    memcpy(pad + 64 * n - 4, &bitlen, 4);
+    return n;
+}
+
+int sha256_kernel (int k) {
+    unsigned int eax, ebx, ecx, edx;
+    int shani = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29))
+	&& __builtin_cpu_supports("sse4.1");
+    int avx2 = __builtin_cpu_supports("avx2");
+    if (k == SHA2_KERNEL_AUTO) {
+	k = shani ? SHA2_KERNEL_SHANI : avx2 ? SHA2_KERNEL_AVX2 : SHA2_KERNEL_SCALAR;
+    } else if ((k == SHA2_KERNEL_SHANI && !shani) || (k == SHA2_KERNEL_AVX2 && !avx2)) {
+	return -1;
+    }
+    return kernel = k;
+}
+#endif
+
 #undef ROR
 #undef CH
 #undef MAJ
@@ -94,11 +227,25 @@ static void sha256_do (uint32_t* state, const uint8_t* block) {
 #undef SIG0
 #undef SIG1
 
+static void sha256_blocks (uint32_t* state, const uint8_t* data, uint32_t nblocks) {
+#ifdef SHA2_X86
+    if (kernel < 0) {
+	sha256_kernel(SHA2_KERNEL_AUTO);
+    }
+    if (kernel == SHA2_KERNEL_SHANI) {
+	sha256_shani(state, data, nblocks);
+	return;
+    }
+#endif
+    while (nblocks--) {
+	sha256_do(state, data);
+	data += 64;
+    }
+}
+
 void sha256 (uint32_t* hash, const uint8_t* msg, uint32_t len) {
-    uint32_t state[8] = {
-	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
-	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
-    };
+    uint32_t state[8];
+    memcpy(state, H0, sizeof(state));
 
     uint32_t bitlen = len << 3;
     while (1) {
@@ -124,10 +271,72 @@ last:
 		goto last;
 	    }
 	} else {
-	    sha256_do(state, msg);
-	    msg += 64;
-	    len -= 64;
+	    uint32_t n = len >> 6;
+	    sha256_blocks(state, msg, n);
+	    msg += n << 6;
+	    len -= n << 6;
+	}
+    }
+}
+
+void sha256_batch (uint32_t* hashes, const uint8_t* const* msgs, const uint32_t* lens, uint32_t n) {
+#ifdef SHA2_X86
+    if (kernel < 0) {
+	sha256_kernel(SHA2_KERNEL_AUTO);
+    }
+    if (kernel == SHA2_KERNEL_AVX2) {
+	// lanes process messages in lockstep, a lane picks up the next message when done
+	struct {
+	    int job;			// message index (-1 if idle)
+	    uint32_t blk, nfull, nblks;	// current block, full message blocks, total blocks
+	    uint8_t pad[128];		// padding blocks
+	} lane[8];
+	uint32_t state[8][8];		// state[word][lane]
+	const uint8_t* blocks[8];
+	static const uint8_t zero[64];
+	uint32_t next = 0;
+	int active = 0;
+	for (int l = 0; l < 8; l++) {
+	    lane[l].job = -1;
 	}
+	while (1) {
+	    for (int l = 0; l < 8; l++) {
+		if (lane[l].job < 0 && next < n) {
+		    uint32_t len = lens[next];
+		    lane[l].job = next;
+		    lane[l].blk = 0;
+		    lane[l].nfull = len >> 6;
+		    lane[l].nblks = lane[l].nfull + sha256_pad(lane[l].pad, msgs[next] + (len & ~63), len & 63, len);
+		    for (int j = 0; j < 8; j++) {
+			state[j][l] = H0[j];
+		    }
+		    next++;
+		    active++;
+		}
+	    }
+	    if (active == 0) {
+		break;
+	    }
+	    for (int l = 0; l < 8; l++) {
+		blocks[l] = (lane[l].job < 0) ? zero : (lane[l].blk < lane[l].nfull)
+		    ? msgs[lane[l].job] + 64 * lane[l].blk : lane[l].pad + 64 * (lane[l].blk - lane[l].nfull);
+	    }
+	    sha256_avx2x8(state, blocks);
+	    for (int l = 0; l < 8; l++) {
+		if (lane[l].job >= 0 && ++lane[l].blk == lane[l].nblks) {
+		    for (int j = 0; j < 8; j++) {
+			hashes[8 * lane[l].job + j] = ENDIAN_n2b32(state[j][l]);
+		    }
+		    lane[l].job = -1;
+		    active--;
+		}
+	    }
+	}
+	return;
+    }
+#endif
+    for (uint32_t i = 0; i < n; i++) {
+	sha256(hashes + 8 * i, msgs[i], lens[i]);
     }
 }
 
@@ -159,21 +368,53 @@ static int writefully (int fd, unsigned char* buf, size_t bufsz) {
     return 0;
 }
 
-int main (void) {
-    unsigned char buf[128*1024];
-    union {
-        uint8_t bytes[32];
-        uint32_t words[8];
-    } hash;
+// hash each message in a batch together with up to 7 previous messages
+// (different lengths in lanes), the previous digests must not change
+int main (int argc, char** argv) {
+    static unsigned char msgs[8][128*1024];
+    static uint32_t lens[8], digests[8][8];
+    uint32_t hashes[8*8];
+    const uint8_t* bmsgs[8];
+    uint32_t blens[8];
+    int cur = 0, nprev = 0;
+
+#ifdef SHA2_X86
+    // optional kernel selection
+    if (argc > 1) {
+        static const char* names[] = { "auto", "scalar", "shani", "avx2" };
+        int k = 0;
+        while (k < 4 && strcmp(argv[1], names[k]) != 0) {
+            k++;
+        }
+        if (k == 4 || sha256_kernel(k) < 0) {
+            return 1;
+        }
+    }
+#endif
     while( 1 ) {
         uint32_t sz;
         if( readfully(STDIN_FILENO, (unsigned char*) &sz, sizeof(uint32_t)) < 0
-                || sz > sizeof(buf)
-                || readfully(STDIN_FILENO, buf, sz) < 0 ) {
+                || sz > sizeof(msgs[0])
+                || readfully(STDIN_FILENO, msgs[cur], sz) < 0 ) {
             break;
         }
-        sha256(hash.words, buf, sz);
-        writefully(STDOUT_FILENO, hash.bytes, 32);
+        lens[cur] = sz;
+        for( int j = 0; j <= nprev; j++ ) {
+            bmsgs[j] = msgs[(cur - j) & 7];
+            blens[j] = lens[(cur - j) & 7];
+        }
+        sha256_batch(hashes, bmsgs, blens, nprev + 1);
+        for( int j = 1; j <= nprev; j++ ) {
+            if( memcmp(hashes + 8 * j, digests[(cur - j) & 7], 32) != 0 ) {
+                return 1;
+            }
+        }
+        memcpy(digests[cur], hashes, 32);
+        writefully(STDOUT_FILENO, (unsigned char*) hashes, 32);
+        cur = (cur + 1) & 7;
+        if( nprev < 7 ) {
+            nprev++;
+        }
     }
     return 0;
 }
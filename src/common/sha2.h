@@ -10,5 +10,21 @@
 
 void sha256 (uint32_t* hash, const uint8_t* msg, uint32_t len);
 
+// hash n messages (hashes: n*8 words), using the multi-buffer kernel if available
+void sha256_batch (uint32_t* hashes, const uint8_t* const* msgs, const uint32_t* lens, uint32_t n);
+
+#ifdef SHA2_X86
+// kernel selection for host builds (default: best supported by CPU)
+enum {
+    SHA2_KERNEL_AUTO,
+    SHA2_KERNEL_SCALAR,
+    SHA2_KERNEL_SHANI,		// single buffer SHA extensions, used by sha256() and sha256_batch()
+    SHA2_KERNEL_AVX2,		// eight-lane multi-buffer, used by sha256_batch()
+};
+
+// select kernel, return selected kernel or -1 if not supported by CPU
+int sha256_kernel (int k);
+#endif
+
 #endif
 
@@ -3,6 +3,8 @@
 // This file is subject to the terms and conditions defined in file 'LICENSE',
 // which is part of this source code package.
 
+#include <string.h>
+
 #include "bootloader.h"
 #include "update.h"
 #include "sha2.h"
@@ -12,6 +14,8 @@
 #error "UP_PAGEBUFFER_SZ must be defined as a multiple of 4 and a power of 2"
 #endif
 
+#define ERASED_WORD	(FLASH_ERASED * 0x01010101u)
+
 #define PB_WORDS	(UP_PAGEBUFFER_SZ >> 2)
 
 
@@ -28,7 +32,7 @@ static void flashcopy (void* ctx, uint32_t* dst, const uint32_t* src, uint32_t n
 	    buf[i] = *src++;
 	}
 	for (; i < PB_WORDS; i++) {
-	    buf[i] = 0; // pad last page with 0
+	    buf[i] = ERASED_WORD; // pad last page
 	}
 	up_flash_wr_page(ctx, dst, buf);
 	dst += PB_WORDS;
@@ -54,6 +58,7 @@ static uint32_t update_plain (void* ctx, boot_uphdr* fwup, bool install) {
     return BOOT_OK;
 }
 
+#if UP_SUPPORTS(LZ4)
 // process LZ4-compressed self-contained update
 static uint32_t update_lz4 (void* ctx, boot_uphdr* fwup, bool install) {
     uint8_t* dst;
@@ -76,15 +81,111 @@ static uint32_t update_lz4 (void* ctx, boot_uphdr* fwup, bool install) {
 
     return BOOT_OK;
 }
+#endif
+
+#if UP_SUPPORTS(LZ4DICT)
+// process LZ4-compressed self-contained update using preset dictionary
+static uint32_t update_lz4dict (void* ctx, boot_uphdr* fwup, bool install) {
+    boot_updicthdr* dhdr = (boot_updicthdr*) ((uint8_t*) fwup + sizeof(boot_uphdr));
+    uint8_t* src = (uint8_t*) dhdr + sizeof(boot_updicthdr);
+    uint32_t srclen = fwup->size - sizeof(boot_uphdr) - sizeof(boot_updicthdr);
+    uint8_t* dst;
+    uint8_t* dict;
+    uint32_t rv;
+
+    if (fwup->size <= sizeof(boot_uphdr) + sizeof(boot_updicthdr)) {
+	return BOOT_E_SIZE;
+    }
+    uint32_t lz4len = srclen - src[srclen-1]; // strip word padding
+
+    // perform size check and get install address
+    if ((rv = up_install_init(ctx, fwup->fwsize, (void**) &dst, 0, NULL, NULL)) != BOOT_OK) {
+	return rv;
+    }
+
+    // check presence and integrity of referenced dictionary
+    if ((rv = up_dict(ctx, dhdr->dictcrc, dhdr->dictsize, &dict)) != BOOT_OK) {
+	return rv;
+    }
+
+    if (install) {
+	up_flash_unlock(ctx);
+	// uncompress new firmware and replace current firmware at destination
+	lz4_decompress(ctx, src, lz4len, dst, dict, dhdr->dictsize - sizeof(boot_dicthdr));
+	up_flash_lock(ctx);
+    }
+
+    return BOOT_OK;
+}
+#endif
 
-static bool checkhash (const uint8_t* msg, uint32_t len, uint32_t* hash) {
+#if UP_DELTA
+// compare truncated hash (may be unaligned in packed update headers)
+static bool checkhash (const uint8_t* msg, uint32_t len, const void* hash) {
     uint32_t tmp[8];
     sha256(tmp, msg, len);
-    return (tmp[0] == hash[0] && tmp[1] == hash[1]);
+    return memcmp(tmp, hash, 8) == 0;
+}
+
+// install delta block to target address (resumable via temp block)
+static uint32_t install_block (void* ctx, uint8_t* baddr, uint32_t bsz, uint8_t* tmp, const void* hash,
+	uint8_t* lz4data, uint32_t lz4len, const lz4dict* dict, int ndict) {
+    // verify target block
+    if (!checkhash(baddr, bsz, hash)) {
+	up_flash_unlock(ctx);
+	// verify temp block
+	if (!checkhash(tmp, bsz, hash)) {
+	    // uncompress delta to temp block
+	    if ((uint32_t) lz4_decompress_segs(ctx, lz4data, lz4len, tmp, dict, ndict) != bsz) {
+		return BOOT_E_GENERAL; // unrecoverable error - should not happen!
+	    }
+	    // verify temp block
+	    if (!checkhash(tmp, bsz, hash)) {
+		return BOOT_E_GENERAL; // unrecoverable error - should not happen!
+	    }
+	}
+	// copy temp block to target
+	flashcopy(ctx, (uint32_t*) baddr, (uint32_t*) tmp, bsz >> 2);
+	up_flash_lock(ctx);
+    }
+    return BOOT_OK;
+}
+#endif
+
+#if UP_SUPPORTS(LZ4DELTA) || UP_SUPPORTS(LZ4DELTAX) || UP_SUPPORTS(LZ4DELTA2)
+// perform size check of block-delta update, get install address, temp area and current firmware
+// (ref is the expected reference firmware, or NULL for the current firmware)
+static uint32_t delta_init (void* ctx, boot_uphdr* fwup, bool install, const boot_fwhdr* ref,
+	uint8_t** pdst, uint8_t** ptmp, boot_fwhdr** pfwhdr) {
+    boot_updeltahdr* dhdr = (boot_updeltahdr*) ((uint8_t*) fwup + sizeof(boot_uphdr));
+    uint32_t fwsize = fwup->fwsize;
+    uint32_t rv;
+
+    // account for size of expected reference firmware if it is not installed yet
+    if (ref && ref->size > fwsize) {
+	fwsize = ref->size;
+    }
+
+    // perform size check and get install address and temp area
+    if ((rv = up_install_init(ctx, fwsize, (void**) pdst, dhdr->blksize, (void**) ptmp, pfwhdr)) != BOOT_OK) {
+	return rv;
+    }
+
+    // check reference firmware crc and size before installing (will be overwritten during install)
+    if (ref == NULL) {
+	ref = *pfwhdr;
+    }
+    if (!install && (dhdr->refcrc != ref->crc || dhdr->refsize != ref->size)) {
+	return BOOT_E_GENERAL;
+    }
+
+    return BOOT_OK;
 }
+#endif
 
+#if UP_SUPPORTS(LZ4DELTA)
 // process LZ4-compressed block-delta update
-static uint32_t update_lz4delta (void* ctx, boot_uphdr* fwup, bool install) {
+static uint32_t update_lz4delta (void* ctx, boot_uphdr* fwup, bool install, const boot_fwhdr* ref) {
     boot_updeltahdr* dhdr = (boot_updeltahdr*) ((uint8_t*) fwup + sizeof(boot_uphdr));
     uint8_t* src = (uint8_t*) dhdr + sizeof(boot_updeltahdr);
     uint8_t* end = (uint8_t*) fwup + fwup->size;
@@ -94,16 +195,10 @@ static uint32_t update_lz4delta (void* ctx, boot_uphdr* fwup, bool install) {
     boot_fwhdr* fwhdr;
     uint32_t rv;
 
-    // perform size check and get install address and temp area
-    if ((rv = up_install_init(ctx, fwup->fwsize, (void**) &dst, blksize, (void**) &tmp, &fwhdr)) != BOOT_OK) {
+    if ((rv = delta_init(ctx, fwup, install, ref, &dst, &tmp, &fwhdr)) != BOOT_OK) {
 	return rv;
     }
 
-    // check reference firmware crc and size before installing (will be overwritten during install)
-    if (!install && (dhdr->refcrc != fwhdr->crc || dhdr->refsize != fwhdr->size)) {
-	return BOOT_E_GENERAL;
-    }
-
     // process delta blocks
     while (src < end) {
 	boot_updeltablk* b = (boot_updeltablk*) src; // delta block
@@ -112,27 +207,11 @@ static uint32_t update_lz4delta (void* ctx, boot_uphdr* fwup, bool install) {
 	if (boff > fwup->fwsize || doff + b->dictlen > dhdr->refsize) {
 	    return BOOT_E_SIZE;
 	}
-	uint8_t* baddr = dst + boff;
 	uint32_t bsz = (fwup->fwsize - boff < blksize) ? fwup->fwsize - boff : blksize; // current block size (last block might be shorter)
-	if (install) {
-	    // verify target block
-	    if (!checkhash(baddr, bsz, b->hash)) {
-		up_flash_unlock(ctx);
-		// verify temp block
-		if (!checkhash(tmp, bsz, b->hash)) {
-		    // uncompress delta to temp block
-		    if (lz4_decompress(ctx, b->lz4data, b->lz4len, tmp, (uint8_t*) fwhdr + doff, b->dictlen) != bsz) {
-			return BOOT_E_GENERAL; // unrecoverable error - should not happen!
-		    }
-		    // verify temp block
-		    if (!checkhash(tmp, bsz, b->hash)) {
-			return BOOT_E_GENERAL; // unrecoverable error - should not happen!
-		    }
-		}
-		// copy temp block to target
-		flashcopy(ctx, (uint32_t*) baddr, (uint32_t*) tmp, bsz >> 2);
-		up_flash_lock(ctx);
-	    }
+	lz4dict dict = { .ptr = (uint8_t*) fwhdr + doff, .len = b->dictlen };
+	if (install && (rv = install_block(ctx, dst + boff, bsz, tmp, b->hash,
+			b->lz4data, b->lz4len, &dict, 1)) != BOOT_OK) {
+	    return rv;
 	}
 	// advance to next delta block (4-aligned)
 	src += (sizeof(boot_updeltablk) + b->lz4len + 3) & ~0x3;
@@ -140,19 +219,271 @@ static uint32_t update_lz4delta (void* ctx, boot_uphdr* fwup, bool install) {
 
     return BOOT_OK;
 }
+#endif
 
-uint32_t update (void* ctx, boot_uphdr* fwup, bool install) {
-    // Note: The integrity of the update pointed to by fwup has
-    // been verified at this point.
+#if UP_SUPPORTS(LZ4DELTAX)
+// process LZ4-compressed block-delta update with extended window
+// (entire reference firmware is used as dictionary for every block, rotated per block)
+static uint32_t update_lz4deltax (void* ctx, boot_uphdr* fwup, bool install, const boot_fwhdr* ref) {
+    boot_updeltahdr* dhdr = (boot_updeltahdr*) ((uint8_t*) fwup + sizeof(boot_uphdr));
+    uint8_t* src = (uint8_t*) dhdr + sizeof(boot_updeltahdr);
+    uint8_t* end = (uint8_t*) fwup + fwup->size;
+    uint32_t blksize = dhdr->blksize;
+    uint8_t* dst;
+    uint8_t* tmp;
+    boot_fwhdr* fwhdr;
+    uint32_t rv;
+
+    if ((rv = delta_init(ctx, fwup, install, ref, &dst, &tmp, &fwhdr)) != BOOT_OK) {
+	return rv;
+    }
 
+    // process delta blocks
+    while (src < end) {
+	boot_updeltaxblk* b = (boot_updeltaxblk*) src; // delta block
+	uint32_t boff = b->blkidx * blksize;
+	uint32_t doff = b->dictend * blksize;
+	if (boff > fwup->fwsize || doff > dhdr->refsize) {
+	    return BOOT_E_SIZE;
+	}
+	uint32_t bsz = (fwup->fwsize - boff < blksize) ? fwup->fwsize - boff : blksize; // current block size (last block might be shorter)
+	// reference firmware rotated to end at dictend
+	lz4dict dict[2] = {
+	    { .ptr = (uint8_t*) fwhdr + doff, .len = dhdr->refsize - doff },
+	    { .ptr = (uint8_t*) fwhdr, .len = doff },
+	};
+	if (install && (rv = install_block(ctx, dst + boff, bsz, tmp, b->hash,
+			b->lz4data, b->lz4len, dict, 2)) != BOOT_OK) {
+	    return rv;
+	}
+	// advance to next delta block (4-aligned)
+	src += (sizeof(boot_updeltaxblk) + b->lz4len + 3) & ~0x3;
+    }
+
+    return BOOT_OK;
+}
+#endif
+
+#if UP_SUPPORTS(LZ4DELTA2) || UP_SUPPORTS(LZ4SIGDELTA)
+// process v2 delta blocks from src to end
+// (window: centered dictionary window of the entire reference firmware may be used)
+static uint32_t delta2_blocks (void* ctx, uint8_t* src, uint8_t* end, uint32_t fwsize, uint32_t blksize, uint32_t refsize,
+	uint8_t* dst, uint8_t* tmp, boot_fwhdr* fwhdr, bool install, bool window) {
+    uint32_t rv;
+
+    while (src < end) {
+	boot_updeltablk2* b = (boot_updeltablk2*) src; // delta block
+	lz4dict dict[BOOT_UPDELTA_MAXSEGS];
+	uint32_t nsegs = b->nsegs;
+	uint32_t boff = b->blkidx * blksize;
+	if (boff > fwsize || nsegs > BOOT_UPDELTA_MAXSEGS) {
+	    return BOOT_E_SIZE;
+	}
+	if (b->flags & BOOT_UPDELTA_F_WINDOW) {
+	    // same window as v1 delta update: up to 64K-blksize, centered on block, within reference firmware
+	    if (!window || nsegs != 0 || blksize >= 0x10000) {
+		return BOOT_E_GENERAL;
+	    }
+	    uint32_t dlen = (refsize < 0x10000 - blksize) ? refsize : 0x10000 - blksize;
+	    uint32_t half = ((dlen + blksize - 1) / blksize - 1) / 2;
+	    uint32_t didx = (b->blkidx > half) ? b->blkidx - half : 0;
+	    uint32_t maxidx = (refsize - dlen + blksize - 1) / blksize;
+	    if (didx > maxidx) {
+		didx = maxidx;
+	    }
+	    dict[0].ptr = (uint8_t*) fwhdr + didx * blksize;
+	    dict[0].len = (refsize - didx * blksize < dlen) ? refsize - didx * blksize : dlen;
+	    nsegs = 1;
+	}
+	for (int i = 0; i < b->nsegs; i++) {
+	    uint32_t doff = b->segs[i].dictidx * blksize;
+	    if (doff + b->segs[i].dictlen > refsize) {
+		return BOOT_E_SIZE;
+	    }
+	    dict[i].ptr = (uint8_t*) fwhdr + doff;
+	    dict[i].len = b->segs[i].dictlen;
+	}
+	uint32_t bsz = (fwsize - boff < blksize) ? fwsize - boff : blksize; // current block size (last block might be shorter)
+	if (install && (rv = install_block(ctx, dst + boff, bsz, tmp, b->hash,
+			(uint8_t*) (b->segs + b->nsegs), b->lz4len, dict, nsegs)) != BOOT_OK) {
+	    return rv;
+	}
+	// advance to next delta block (4-aligned)
+	src += (sizeof(boot_updeltablk2) + b->nsegs * sizeof(boot_updeltaseg) + b->lz4len + 3) & ~0x3;
+    }
+
+    return BOOT_OK;
+}
+#endif
+
+#if UP_SUPPORTS(LZ4DELTA2)
+// process LZ4-compressed block-delta update with v2 block header
+// (16-bit block numbers, multiple dictionary segments per block)
+static uint32_t update_lz4delta2 (void* ctx, boot_uphdr* fwup, bool install, const boot_fwhdr* ref) {
+    boot_updeltahdr* dhdr = (boot_updeltahdr*) ((uint8_t*) fwup + sizeof(boot_uphdr));
+    uint8_t* src = (uint8_t*) dhdr + sizeof(boot_updeltahdr);
+    uint8_t* end = (uint8_t*) fwup + fwup->size;
+    uint8_t* dst;
+    uint8_t* tmp;
+    boot_fwhdr* fwhdr;
+    uint32_t rv;
+
+    if ((rv = delta_init(ctx, fwup, install, ref, &dst, &tmp, &fwhdr)) != BOOT_OK) {
+	return rv;
+    }
+
+    return delta2_blocks(ctx, src, end, fwup->fwsize, dhdr->blksize, dhdr->refsize, dst, tmp, fwhdr, install, true);
+}
+#endif
+
+#if UP_SUPPORTS(LZ4SIGDELTA)
+// process LZ4-compressed block-delta update referencing block signatures of the current firmware
+// (instead of the CRC of the entire firmware, only the blocks the update depends on are verified)
+static uint32_t update_lz4sigdelta (void* ctx, boot_uphdr* fwup, bool install, const boot_fwhdr* ref) {
+    boot_upsigdeltahdr* shdr = (boot_upsigdeltahdr*) ((uint8_t*) fwup + sizeof(boot_uphdr));
+    boot_upsigblk* sigs = (boot_upsigblk*) ((uint8_t*) shdr + sizeof(boot_upsigdeltahdr));
+    uint8_t* end = (uint8_t*) fwup + fwup->size;
+    uint32_t blksize = shdr->blksize;
+    uint8_t* dst;
+    uint8_t* tmp;
+    boot_fwhdr* fwhdr;
+    uint32_t rv;
+
+    // block signatures can only be verified against the current firmware
+    if (ref != NULL) {
+	return BOOT_E_GENERAL;
+    }
+    if (shdr->nsigs > (uint32_t) (end - (uint8_t*) sigs) / sizeof(boot_upsigblk)) {
+	return BOOT_E_SIZE;
+    }
+    uint8_t* src = (uint8_t*) (sigs + shdr->nsigs);
+
+    // perform size check and get install address and temp area
+    if ((rv = up_install_init(ctx, fwup->fwsize, (void**) &dst, blksize, (void**) &tmp, &fwhdr)) != BOOT_OK) {
+	return rv;
+    }
+
+    // check referenced blocks of current firmware before installing (will be overwritten during install)
+    if (!install) {
+	if (shdr->refsize != fwhdr->size) {
+	    return BOOT_E_GENERAL;
+	}
+	for (uint32_t i = 0; i < shdr->nsigs; i++) {
+	    uint32_t boff = sigs[i].blkidx * blksize;
+	    if (boff >= shdr->refsize) {
+		return BOOT_E_SIZE;
+	    }
+	    uint32_t bsz = (shdr->refsize - boff < blksize) ? shdr->refsize - boff : blksize;
+	    if (!checkhash((uint8_t*) fwhdr + boff, bsz, sigs[i].hash)) {
+		return BOOT_E_GENERAL;
+	    }
+	}
+    }
+
+    // (window would include unverified blocks)
+    return delta2_blocks(ctx, src, end, fwup->fwsize, blksize, shdr->refsize, dst, tmp, fwhdr, install, false);
+}
+#endif
+
+// process single update (ref is the expected reference firmware, or NULL for the current firmware)
+static uint32_t update_link (void* ctx, boot_uphdr* fwup, bool install, const boot_fwhdr* ref) {
     switch (fwup->uptype) {
 	case BOOT_UPTYPE_PLAIN:
 	    return update_plain(ctx, fwup, install);
+#if UP_SUPPORTS(LZ4)
 	case BOOT_UPTYPE_LZ4:
 	    return update_lz4(ctx, fwup, install);
+#endif
+#if UP_SUPPORTS(LZ4DELTA)
 	case BOOT_UPTYPE_LZ4DELTA:
-	    return update_lz4delta(ctx, fwup, install);
+	    return update_lz4delta(ctx, fwup, install, ref);
+#endif
+#if UP_SUPPORTS(LZ4DELTAX)
+	case BOOT_UPTYPE_LZ4DELTAX:
+	    return update_lz4deltax(ctx, fwup, install, ref);
+#endif
+#if UP_SUPPORTS(LZ4DELTA2)
+	case BOOT_UPTYPE_LZ4DELTA2:
+	    return update_lz4delta2(ctx, fwup, install, ref);
+#endif
+#if UP_SUPPORTS(LZ4DICT)
+	case BOOT_UPTYPE_LZ4DICT:
+	    return update_lz4dict(ctx, fwup, install);
+#endif
+#if UP_SUPPORTS(LZ4SIGDELTA)
+	case BOOT_UPTYPE_LZ4SIGDELTA:
+	    return update_lz4sigdelta(ctx, fwup, install, ref);
+#endif
 	default:
 	    return BOOT_E_NOIMPL;
     }
 }
+
+#if UP_SUPPORTS(CHAIN)
+// process chain of updates, each link referencing the output of the previous link
+// (progress is tracked across resets, completed links are skipped)
+static uint32_t update_chain (void* ctx, boot_uphdr* fwup, bool install) {
+    uint8_t* src = (uint8_t*) fwup + sizeof(boot_uphdr);
+    uint8_t* end = (uint8_t*) fwup + fwup->size;
+    uint32_t progress = install ? up_progress_get(ctx) : 0;
+    boot_fwhdr ref; // output of previous link
+    uint32_t i, rv;
+
+    for (i = 0; src < end; i++) {
+	boot_uphdr* link = (boot_uphdr*) src;
+	if (link->size < sizeof(boot_uphdr) || (link->size & 3) != 0 || link->size > (uint32_t) (end - src)
+		|| link->uptype == BOOT_UPTYPE_CHAIN) {
+	    return BOOT_E_SIZE;
+	}
+	if (i >= progress) {
+	    // first link references current firmware
+	    if ((rv = update_link(ctx, link, install, (i == 0) ? NULL : &ref)) != BOOT_OK) {
+		return rv;
+	    }
+	    if (install) {
+		up_progress_set(ctx, i + 1);
+	    }
+	}
+	ref.crc = link->fwcrc;
+	ref.size = link->fwsize;
+	src += link->size;
+    }
+
+    // output of last link must match update
+    if (i == 0 || ref.crc != fwup->fwcrc || ref.size != fwup->fwsize) {
+	return BOOT_E_GENERAL;
+    }
+    return BOOT_OK;
+}
+#endif
+
+// calculate block signatures (sha256[0-7]) of firmware, return number of blocks
+// (signatures are stored for up to maxblks blocks)
+uint32_t update_blksigs (const uint8_t* fw, uint32_t fwsize, uint32_t blksize, uint32_t* sigs, uint32_t maxblks) {
+    uint32_t n;
+    if (blksize == 0) {
+	return 0;
+    }
+    for (n = 0; n * blksize < fwsize; n++) {
+	if (n < maxblks) {
+	    uint32_t tmp[8];
+	    uint32_t boff = n * blksize;
+	    sha256(tmp, fw + boff, (fwsize - boff < blksize) ? fwsize - boff : blksize);
+	    sigs[2*n] = tmp[0];
+	    sigs[2*n+1] = tmp[1];
+	}
+    }
+    return n;
+}
+
+uint32_t update (void* ctx, boot_uphdr* fwup, bool install) {
+    // Note: The integrity of the update pointed to by fwup has
+    // been verified at this point.
+
+#if UP_SUPPORTS(CHAIN)
+    if (fwup->uptype == BOOT_UPTYPE_CHAIN) {
+	return update_chain(ctx, fwup, install);
+    }
+#endif
+    return update_link(ctx, fwup, install, NULL);
+}
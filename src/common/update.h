@@ -8,12 +8,54 @@
 
 #include "bootloader.h"
 
+// Flash geometry of target (flashgeom.h in target source directory):
+//   FLASH_PAGE_SZ	erase unit, written by up_flash_wr_page() (power of 2)
+//   FLASH_PROG_SZ	program unit of fast programming (e.g. half-page)
+//   FLASH_ERASED	value of erased bytes
+#include "flashgeom.h"
+
+#if ((FLASH_PAGE_SZ & (FLASH_PAGE_SZ - 1)) != 0) || ((FLASH_PAGE_SZ % FLASH_PROG_SZ) != 0)
+#error "FLASH_PAGE_SZ must be a power of 2 and a multiple of FLASH_PROG_SZ"
+#endif
+
+#define ROUND_PAGE_SZ(sz)	(((sz) + (FLASH_PAGE_SZ - 1)) & ~(FLASH_PAGE_SZ - 1))
+#define ISMULT_PAGE_SZ(sz)	(((sz) & (FLASH_PAGE_SZ - 1)) == 0)
+
+// page buffers of update and LZ4 code hold one flash page
+#ifndef UP_PAGEBUFFER_SZ
+#define UP_PAGEBUFFER_SZ	FLASH_PAGE_SZ
+#endif
+#ifndef LZ4_PAGEBUFFER_SZ
+#define LZ4_PAGEBUFFER_SZ	FLASH_PAGE_SZ
+#endif
+
+// Update types supported by build (mask of UP_UPTYPE(t), set by build profile)
+#define UP_UPTYPE(t)		(1 << BOOT_UPTYPE_##t)
+#ifndef UP_UPTYPES
+#define UP_UPTYPES		(UP_UPTYPE(PLAIN) | UP_UPTYPE(LZ4) | UP_UPTYPE(LZ4DELTA) | UP_UPTYPE(LZ4DELTAX) \
+				| UP_UPTYPE(LZ4DELTA2) | UP_UPTYPE(LZ4DICT) | UP_UPTYPE(CHAIN) | UP_UPTYPE(LZ4SIGDELTA))
+#endif
+#define UP_SUPPORTS(t)		((UP_UPTYPES & UP_UPTYPE(t)) != 0)
+
+// block-delta updates
+#define UP_DELTA		(UP_SUPPORTS(LZ4DELTA) || UP_SUPPORTS(LZ4DELTAX) || UP_SUPPORTS(LZ4DELTA2) || UP_SUPPORTS(LZ4SIGDELTA))
+// LZ4-compressed updates (need LZ4 decoder)
+#define UP_LZ4			(UP_DELTA || UP_SUPPORTS(LZ4) || UP_SUPPORTS(LZ4DICT))
+
+#if !UP_SUPPORTS(PLAIN)
+#error "plain updates must be supported by every build profile"
+#endif
+
 uint32_t update (void* ctx, boot_uphdr* fwup, bool install);
+uint32_t update_blksigs (const uint8_t* fw, uint32_t fwsize, uint32_t blksize, uint32_t* sigs, uint32_t maxblks);
 
 // glue functions
 extern uint32_t up_install_init (void* ctx, uint32_t fwsize, void** pfwdst, uint32_t tmpsize, void** ptmpdst, boot_fwhdr** pcurrentfw);
 extern void up_flash_wr_page (void* ctx, void* dst, void* src);
 extern void up_flash_unlock (void* ctx);
 extern void up_flash_lock (void* ctx);
+extern uint32_t up_dict (void* ctx, uint32_t dictcrc, uint32_t dictsize, uint8_t** pdict);
+extern uint32_t up_progress_get (void* ctx);
+extern void up_progress_set (void* ctx, uint32_t progress);
 
 #endif
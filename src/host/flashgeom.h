@@ -0,0 +1,20 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+#ifndef _flashgeom_h_
+#define _flashgeom_h_
+
+// flash image, defaults to STM32L0 geometry (override with -D to model other parts)
+#ifndef FLASH_PAGE_SZ
+#define FLASH_PAGE_SZ		128
+#endif
+#ifndef FLASH_PROG_SZ
+#define FLASH_PROG_SZ		64
+#endif
+#ifndef FLASH_ERASED
+#define FLASH_ERASED		0x00
+#endif
+
+#endif
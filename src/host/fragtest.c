@@ -0,0 +1,157 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+// Reassemble fragmented updates with frag.c
+//
+// The fragment file is created from the update file with 'zfwtool.py mkfrags'
+// (FragIndexAndN and fragment data per record). In every trial, fragments are
+// dropped at the given loss rate and the remaining ones are passed to
+// frag_put(). Whenever reassembly completes, the data must match the update.
+// A trial without loss must complete, and with loss at least one trial must
+// recover lost fragments from parity fragments.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frag.h"
+
+static void usage (const char* prog) {
+    fprintf(stderr, "usage: %s [-l LOSS] [-t TRIALS] [-s SEED] [-r MAXROWS] UPFILE FRAGFILE FRAGSZ\n"
+	    "  -l LOSS      fragment loss rate (default 0.1)\n"
+	    "  -t TRIALS    number of trials with loss (default 100)\n"
+	    "  -s SEED      random seed (default 1)\n"
+	    "  -r MAXROWS   max. number of parity fragments kept (default: all)\n", prog);
+    exit(2);
+}
+
+static uint8_t* readfile (const char* fn, uint32_t* psize) {
+    FILE* f = fopen(fn, "rb");
+    uint8_t* buf = NULL;
+    long sz;
+    if (f == NULL) {
+	perror(fn);
+	return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (sz = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0
+	    && (buf = malloc(sz)) != NULL && fread(buf, 1, sz, f) == (size_t) sz) {
+	*psize = sz;
+    } else {
+	fprintf(stderr, "%s: cannot read file\n", fn);
+	free(buf);
+	buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+// storage callbacks (data area in memory)
+static void wr (void* ctx, uint32_t off, const uint8_t* data, uint32_t len) {
+    memcpy((uint8_t*) ctx + off, data, len);
+}
+
+static void rd (void* ctx, uint32_t off, uint8_t* data, uint32_t len) {
+    memcpy(data, (uint8_t*) ctx + off, len);
+}
+
+// run one trial, return FRAG_COMPLETE, FRAG_OK (incomplete) or FRAG_E_INDEX;
+// set *plost if uncoded fragments were lost before completion
+static int trial (const uint8_t* frags, uint32_t nrec, uint32_t fragsz, uint32_t nfrags, uint32_t maxrows,
+	double loss, uint8_t* mem, uint8_t* out, int* plost) {
+    frag_session s;
+    frag_init(&s, nfrags, fragsz, maxrows, mem, out, wr, rd);
+    *plost = 0;
+    for (uint32_t i = 0; i < nrec; i++) {
+	const uint8_t* rec = frags + i * (2 + fragsz);
+	uint16_t idx = (rec[0] | (rec[1] << 8)) & 0x3fff; // FragIndexAndN (session 0)
+	if (loss > 0 && rand() < loss * ((double) RAND_MAX + 1)) {
+	    *plost |= (idx <= nfrags);
+	    continue;
+	}
+	switch (frag_put(&s, idx, rec + 2)) {
+	    case FRAG_OK:
+	    case FRAG_E_MEMORY: // parity fragment dropped
+		break;
+	    case FRAG_COMPLETE:
+		return FRAG_COMPLETE;
+	    default:
+		printf("fragment %u: invalid index\n", idx);
+		return FRAG_E_INDEX;
+	}
+    }
+    return FRAG_OK;
+}
+
+int main (int argc, char** argv) {
+    double loss = 0.1;
+    int ntrials = 100, c;
+    unsigned seed = 1;
+    uint32_t maxrows = 0;
+    uint32_t upsize, fragfsize;
+
+    while ((c = getopt(argc, argv, "l:t:s:r:")) != -1) {
+	switch (c) {
+	    case 'l': loss = strtod(optarg, NULL); break;
+	    case 't': ntrials = strtol(optarg, NULL, 0); break;
+	    case 's': seed = strtoul(optarg, NULL, 0); break;
+	    case 'r': maxrows = strtoul(optarg, NULL, 0); break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (argc - optind != 3) {
+	usage(argv[0]);
+    }
+    uint32_t fragsz = strtoul(argv[optind + 2], NULL, 0);
+    uint8_t* up = readfile(argv[optind], &upsize);
+    uint8_t* frags = readfile(argv[optind + 1], &fragfsize);
+    if (up == NULL || frags == NULL) {
+	return 1;
+    }
+    uint32_t nfrags = (upsize + fragsz - 1) / fragsz;
+    uint32_t nrec = fragfsize / (2 + fragsz);
+    if (fragsz == 0 || fragfsize % (2 + fragsz) != 0 || nrec < nfrags || nrec >= (1 << 14)) {
+	fprintf(stderr, "fragment file does not match update and fragment size\n");
+	return 1;
+    }
+    if (maxrows == 0 || maxrows > nrec - nfrags) {
+	maxrows = nrec - nfrags;
+    }
+    uint8_t* mem = malloc(FRAG_MEMSZ(nfrags, fragsz, maxrows));
+    uint8_t* out = malloc(nfrags * fragsz);
+    if (mem == NULL || out == NULL) {
+	fprintf(stderr, "out of memory\n");
+	return 1;
+    }
+    srand(seed);
+
+    int failed = 0, ok = 0, recovered = 0, lost;
+    for (int t = 0; t <= ntrials; t++) {
+	// first trial without loss
+	memset(out, 0, nfrags * fragsz);
+	int rv = trial(frags, nrec, fragsz, nfrags, maxrows, t ? loss : 0, mem, out, &lost);
+	if (rv == FRAG_COMPLETE && memcmp(out, up, upsize) == 0) {
+	    ok += (t > 0);
+	    recovered += lost;
+	} else if (rv != FRAG_OK || t == 0) {
+	    printf("trial %d: %s\n", t, (rv == FRAG_OK) ? "incomplete without loss" : "reassembly failed");
+	    failed++;
+	}
+    }
+    printf("update size %u, %u fragments of %u bytes, %u parity fragments (%u kept)\n",
+	    upsize, nfrags, fragsz, nrec - nfrags, maxrows);
+    printf("reassembled in %d of %d trials at %.0f%% loss, %d with lost fragments recovered\n",
+	    ok, ntrials, loss * 100, recovered);
+    if (ntrials && loss > 0 && recovered == 0) {
+	printf("no lost fragment recovered from parity\n");
+	failed++;
+    }
+
+    free(mem);
+    free(out);
+    free(up);
+    free(frags);
+    return failed ? 1 : 0;
+}
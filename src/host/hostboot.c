@@ -0,0 +1,187 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+// Apply an update to a flash image file with the bootloader update code
+//
+// The flash image contains the current firmware at offset 0 and the update
+// (and optionally a preset dictionary) at the given offsets. The installed
+// firmware is written back to the image unless -n is given. Page writes are
+// counted to compare update types and to check flash wear in CI.
+//
+// With -c or -e, a power-loss campaign is run on a private copy of the image:
+// power is cut before every Nth page write (or every progress write) during
+// installation, then the device is rebooted and must complete the update with
+// the same result as an uninterrupted install. Page write cuts are repeated with
+// the interrupted page left erased and half-programmed (torn writes), and are
+// reported per cut mode. The extra page writes (each an erase and program) and
+// time of every resume are reported.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hostflash.h"
+
+static void usage (const char* prog) {
+    fprintf(stderr, "usage: %s [-n] [-c STEP|-e] [-d DICTOFF] [-p PROGRESS] FLASHFILE UPOFF\n"
+	    "  -n           dry run, do not write back flash image\n"
+	    "  -c STEP      power-loss campaign, cut power at every STEP-th page write\n"
+	    "               (before erase, after erase and after first program step)\n"
+	    "  -e           power-loss campaign, cut power before every progress write\n"
+	    "  -d DICTOFF   offset of preset dictionary in flash image\n"
+	    "  -p PROGRESS  resume interrupted update at given progress\n", prog);
+    exit(2);
+}
+
+static double elapsed (struct timespec* t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static const char* cutmodes[HOSTFLASH_CUT_MODES] = {
+    [HOSTFLASH_CUT_BEFORE] = "before",
+    [HOSTFLASH_CUT_ERASED] = "erased",
+    [HOSTFLASH_CUT_HALF]   = "half",
+};
+
+static int campaign (hostflash* hf, uint32_t upoff, uint32_t dictoff, uint32_t step, bool eeprom) {
+    uint32_t progress = hf->progress, rv;
+    uint8_t* pristine = malloc(hf->size);
+    uint8_t* final = malloc(hf->size);
+    uint32_t nmodes = eeprom ? 1 : HOSTFLASH_CUT_MODES;
+    struct timespec t0;
+    int failed = 0;
+    int n[HOSTFLASH_CUT_MODES] = { 0 }, nfailed[HOSTFLASH_CUT_MODES] = { 0 };
+    int maxextra[HOSTFLASH_CUT_MODES] = { 0 }, sumextra[HOSTFLASH_CUT_MODES] = { 0 };
+
+    if (pristine == NULL || final == NULL) {
+	fprintf(stderr, "out of memory\n");
+	failed = 1;
+	goto done;
+    }
+    memcpy(pristine, hf->flash, hf->size);
+
+    // reference: uninterrupted install
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((rv = hostflash_install(hf, upoff, dictoff)) != BOOT_OK) {
+	printf("install failed: %u\n", rv);
+	failed = 1;
+	goto done;
+    }
+    double basetime = elapsed(&t0);
+    uint32_t basewrites = hf->nwrites, baseprogress = hf->nprogress;
+    uint32_t fwsize = ((boot_fwhdr*) hf->flash)->size;
+    memcpy(final, hf->flash, hf->size);
+    printf("install:      %u page writes, %u progress writes, %.3f ms\n", basewrites, baseprogress, basetime);
+    printf("%8s %8s %8s %8s %8s %8s %10s  %s\n", "cut", "mode", "before", "resume", "extra", "eeprom", "extra ms", "result");
+
+    for (uint32_t k = 1; ; k++) {
+	for (uint32_t m = 0; m < nmodes; m++) {
+	    memcpy(hf->flash, pristine, hf->size);
+	    hf->progress = progress;
+	    hostflash_reset(hf);
+	    if (eeprom) {
+		hf->cutprogress = k;
+	    } else {
+		hf->cutwrites = k * step;
+		hf->cutmode = m;
+	    }
+	    clock_gettime(CLOCK_MONOTONIC, &t0);
+	    rv = hostflash_install(hf, upoff, dictoff);
+	    hf->cutwrites = hf->cutprogress = hf->cutmode = 0;
+	    if (rv != HOSTFLASH_POWERLOSS) {
+		goto summary; // cut point beyond end of install
+	    }
+	    uint32_t before = hf->nwrites, beforeprogress = hf->nprogress;
+
+	    // reboot, bootloader resumes install
+	    hostflash_reset(hf);
+	    rv = hostflash_boot(hf, upoff, dictoff);
+	    double t = elapsed(&t0);
+	    bool ok = (rv == BOOT_OK && ((boot_fwhdr*) hf->flash)->crc == hf->fwup->fwcrc
+		    && memcmp(hf->flash, final, fwsize) == 0);
+	    int extra = before + hf->nwrites - basewrites;
+	    printf("%8u %8s %8u %8u %8d %8d %10.3f  %s\n", eeprom ? k : k * step, eeprom ? "eeprom" : cutmodes[m],
+		    before, hf->nwrites, extra, (int) (beforeprogress + hf->nprogress - baseprogress),
+		    t - basetime, ok ? "ok" : "FAILED");
+	    if (!ok) {
+		nfailed[m]++;
+		failed++;
+	    }
+	    if (n[m] == 0 || extra > maxextra[m]) {
+		maxextra[m] = extra;
+	    }
+	    sumextra[m] += extra;
+	    n[m]++;
+	}
+    }
+ summary:
+    for (uint32_t m = 0; m < nmodes; m++) {
+	const char* mode = eeprom ? "eeprom" : cutmodes[m];
+	printf("cuts %-8s %d (%d failed)", mode, n[m], nfailed[m]);
+	if (n[m]) {
+	    printf(", extra writes %.1f avg, %d max", (double) sumextra[m] / n[m], maxextra[m]);
+	}
+	printf("\n");
+    }
+ done:
+    free(pristine);
+    free(final);
+    return failed ? 1 : 0;
+}
+
+int main (int argc, char** argv) {
+    hostflash hf;
+    bool persist = true, eeprom = false;
+    uint32_t dictoff = 0, progress = 0, step = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "nc:ed:p:")) != -1) {
+	switch (c) {
+	    case 'n': persist = false; break;
+	    case 'c': step = strtoul(optarg, NULL, 0); persist = false; break;
+	    case 'e': eeprom = true; persist = false; break;
+	    case 'd': dictoff = strtoul(optarg, NULL, 0); break;
+	    case 'p': progress = strtoul(optarg, NULL, 0); break;
+	    default: usage(argv[0]);
+	}
+    }
+    if (argc - optind != 2 || (step && eeprom)) {
+	usage(argv[0]);
+    }
+    if (hostflash_open(&hf, argv[optind], persist) != 0) {
+	perror(argv[optind]);
+	return 1;
+    }
+    hf.progress = progress;
+    uint32_t upoff = strtoul(argv[optind + 1], NULL, 0);
+
+    if (step || eeprom) {
+	int rc = campaign(&hf, upoff, dictoff, step, eeprom);
+	hostflash_close(&hf);
+	return rc;
+    }
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint32_t rv = hostflash_install(&hf, upoff, dictoff);
+    double t = elapsed(&t0);
+
+    uint32_t maxwr, npages = hostflash_pages(&hf, &maxwr);
+    printf("result:       %u\n", rv);
+    printf("page writes:  %u (%u pages, max %u per page)\n", hf.nwrites, npages, maxwr);
+    printf("skipped:      %u\n", hf.nskipped);
+    printf("locked:       %u\n", hf.nlocked);
+    printf("time:         %.3f ms\n", t);
+    if (rv == BOOT_OK) {
+	printf("firmware:     %u bytes, crc %08x\n", ((boot_fwhdr*) hf.flash)->size, ((boot_fwhdr*) hf.flash)->crc);
+    }
+
+    hostflash_close(&hf);
+    return (rv == BOOT_OK) ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+// Update glue functions for host builds: flash is a memory-mapped image
+// file, every page write is counted.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "update.h"
+#include "hostflash.h"
+
+
+// ------------------------------------------------
+// Flash image
+
+int hostflash_open (hostflash* hf, const char* fn, bool persist) {
+    struct stat st;
+    int fd;
+
+    memset(hf, 0, sizeof(*hf));
+    if ((fd = open(fn, persist ? O_RDWR : O_RDONLY)) < 0) {
+	return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || (st.st_size & (FLASH_PAGE_SZ - 1)) != 0 || st.st_size > UINT32_MAX) {
+	close(fd);
+	return -1;
+    }
+    hf->size = st.st_size;
+    hf->flash = mmap(NULL, hf->size, PROT_READ | PROT_WRITE, persist ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (hf->flash == MAP_FAILED) {
+	hf->flash = NULL;
+	return -1;
+    }
+    if ((hf->pgwrites = calloc(hf->size / FLASH_PAGE_SZ, sizeof(uint32_t))) == NULL) {
+	hostflash_close(hf);
+	return -1;
+    }
+    return 0;
+}
+
+void hostflash_close (hostflash* hf) {
+    if (hf->flash) {
+	munmap(hf->flash, hf->size);
+	hf->flash = NULL;
+    }
+    free(hf->pgwrites);
+    hf->pgwrites = NULL;
+}
+
+void hostflash_reset (hostflash* hf) {
+    memset(hf->pgwrites, 0, (hf->size / FLASH_PAGE_SZ) * sizeof(uint32_t));
+    hf->nwrites = hf->nlocked = hf->nskipped = hf->nprogress = 0;
+}
+
+uint32_t hostflash_pages (const hostflash* hf, uint32_t* maxwrites) {
+    uint32_t n = 0, max = 0;
+    for (uint32_t i = 0; i < hf->size / FLASH_PAGE_SZ; i++) {
+	if (hf->pgwrites[i]) {
+	    n++;
+	}
+	if (hf->pgwrites[i] > max) {
+	    max = hf->pgwrites[i];
+	}
+    }
+    if (maxwrites) {
+	*maxwrites = max;
+    }
+    return n;
+}
+
+uint32_t hostflash_crc32 (const void* buf, uint32_t len) {
+    static uint32_t tab[256];
+    const uint8_t* p = buf;
+    uint32_t crc = ~0;
+    if (tab[1] == 0) {
+	for (uint32_t i = 0; i < 256; i++) {
+	    uint32_t c = i;
+	    for (int k = 0; k < 8; k++) {
+		c = (c & 1) ? (c >> 1) ^ 0xedb88320 : (c >> 1);
+	    }
+	    tab[i] = c;
+	}
+    }
+    while (len--) {
+	crc = tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+// ------------------------------------------------
+// Update glue functions
+
+uint32_t up_install_init (void* ctx, uint32_t fwsize, void** pfwdst, uint32_t tmpsize, void** ptmpdst, boot_fwhdr** pcurrentfw) {
+    hostflash* hf = ctx;
+    uint32_t upoff = (uint8_t*) hf->fwup - hf->flash;
+    if ((fwsize & (FLASH_PAGE_SZ - 1)) != 0 || fwsize > upoff) {
+	// new firmware is not multiple of page size or would overwrite update
+	return BOOT_E_SIZE;
+    }
+
+    // assume dependency on current firmware when temp storage is requested
+    if (tmpsize) {
+	boot_fwhdr* fwhdr = (boot_fwhdr*) hf->flash;
+	uint32_t fwmax = (fwsize > fwhdr->size) ? fwsize : fwhdr->size;
+	if ((tmpsize & (FLASH_PAGE_SZ - 1)) != 0 || fwmax + tmpsize > upoff) {
+	    return BOOT_E_SIZE;
+	}
+    }
+
+    *pfwdst = hf->flash;
+    if (tmpsize && ptmpdst) {
+	*ptmpdst = (uint8_t*) hf->fwup - tmpsize;
+    }
+    if (pcurrentfw) {
+	*pcurrentfw = (boot_fwhdr*) hf->flash;
+    }
+    return BOOT_OK;
+}
+
+uint32_t up_dict (void* ctx, uint32_t dictcrc, uint32_t dictsize, uint8_t** pdict) {
+    hostflash* hf = ctx;
+    boot_dicthdr* dh = hf->dict;
+    if (dh == NULL) {
+	return BOOT_E_NOIMPL;
+    }
+    if (dh->crc != dictcrc || dh->size != dictsize
+	    || dictsize < sizeof(boot_dicthdr) || dictsize > hf->size - ((uint8_t*) dh - hf->flash) || (dictsize & 3) != 0
+	    || hostflash_crc32(((unsigned char*) dh) + 8, dictsize - 8) != dictcrc) {
+	return BOOT_E_GENERAL;
+    }
+    *pdict = (uint8_t*) (dh + 1);
+    return BOOT_OK;
+}
+
+void up_flash_wr_page (void* ctx, void* dst, void* src) {
+    hostflash* hf = ctx;
+    uint32_t off = (uint8_t*) dst - hf->flash;
+    if (!hf->unlocked) {
+	hf->nlocked++;
+	return;
+    }
+    if ((off & (FLASH_PAGE_SZ - 1)) != 0 || off >= hf->size) {
+	abort(); // update code must only write whole pages within flash
+    }
+    // like the bootloader, skip erase and program if page content is unchanged
+    // (compared with the flash content, so a torn page is rewritten unless it holds the new data)
+    if (memcmp(dst, src, FLASH_PAGE_SZ) == 0) {
+	hf->nskipped++;
+	return;
+    }
+    if (hf->cutwrites && hf->nwrites + 1 == hf->cutwrites) {
+	if (hf->cutmode != HOSTFLASH_CUT_BEFORE) {
+	    // torn page write: page erased, first program step possibly done
+	    uint8_t buf[FLASH_PAGE_SZ];
+	    uint32_t n = (hf->cutmode == HOSTFLASH_CUT_HALF) ? FLASH_PROG_SZ : 0;
+	    memcpy(buf, src, n);
+	    memset(dst, FLASH_ERASED, FLASH_PAGE_SZ);
+	    memcpy(dst, buf, n);
+	    hf->pgwrites[off / FLASH_PAGE_SZ]++;
+	    hf->nwrites++;
+	}
+	longjmp(*hf->powerloss, 1);
+    }
+    memmove(dst, src, FLASH_PAGE_SZ);
+    hf->pgwrites[off / FLASH_PAGE_SZ]++;
+    hf->nwrites++;
+}
+
+void up_flash_unlock (void* ctx) {
+    ((hostflash*) ctx)->unlocked = true;
+}
+
+void up_flash_lock (void* ctx) {
+    ((hostflash*) ctx)->unlocked = false;
+}
+
+uint32_t up_progress_get (void* ctx) {
+    return ((hostflash*) ctx)->progress;
+}
+
+void up_progress_set (void* ctx, uint32_t progress) {
+    hostflash* hf = ctx;
+    if (hf->cutprogress && hf->nprogress + 1 == hf->cutprogress) {
+	longjmp(*hf->powerloss, 1);
+    }
+    hf->progress = progress;
+    hf->nprogress++;
+}
+
+
+// ------------------------------------------------
+// Installation
+
+static bool check_update (hostflash* hf, uint32_t upoff) {
+    boot_uphdr* fwup = (boot_uphdr*) (hf->flash + upoff);
+    return ( (upoff & 3) == 0
+	     && sizeof(boot_uphdr) <= hf->size - upoff
+	     && fwup->size >= sizeof(boot_uphdr)
+	     && (fwup->size & 3) == 0
+	     && fwup->size <= hf->size - upoff
+	     && hostflash_crc32(((unsigned char*) fwup) + 8, fwup->size - 8) == fwup->crc );
+}
+
+static bool check_firmware (hostflash* hf) {
+    boot_fwhdr* fwh = (boot_fwhdr*) hf->flash;
+    return ( fwh->size >= sizeof(boot_fwhdr)
+	     && (fwh->size & 3) == 0
+	     && fwh->size <= hf->size
+	     && hostflash_crc32(((unsigned char*) fwh) + 8, fwh->size - 8) == fwh->crc );
+}
+
+static uint32_t set_update (hostflash* hf, uint32_t upoff, uint32_t dictoff) {
+    if (upoff >= hf->size || dictoff >= hf->size || (dictoff & 3) != 0) {
+	return BOOT_E_SIZE;
+    }
+    hf->fwup = (boot_uphdr*) (hf->flash + upoff);
+    hf->dict = dictoff ? (boot_dicthdr*) (hf->flash + dictoff) : NULL;
+    return check_update(hf, upoff) ? BOOT_OK : BOOT_E_SIZE;
+}
+
+uint32_t hostflash_boot (hostflash* hf, uint32_t upoff, uint32_t dictoff) {
+    jmp_buf jb;
+    uint32_t rv;
+    if ((rv = set_update(hf, upoff, dictoff)) != BOOT_OK) {
+	return rv;
+    }
+    hf->powerloss = &jb;
+    if (setjmp(jb)) {
+	// power loss, flash is locked again after reset
+	hf->unlocked = false;
+	return HOSTFLASH_POWERLOSS;
+    }
+    if ((rv = update(hf, hf->fwup, true)) != BOOT_OK) {
+	return rv;
+    }
+    return check_firmware(hf) ? BOOT_OK : BOOT_E_GENERAL;
+}
+
+uint32_t hostflash_install (hostflash* hf, uint32_t upoff, uint32_t dictoff) {
+    uint32_t rv;
+    // check (firmware calling boottab update), then install (bootloader)
+    if ((rv = set_update(hf, upoff, dictoff)) != BOOT_OK
+	    || (rv = update(hf, hf->fwup, false)) != BOOT_OK) {
+	return rv;
+    }
+    return hostflash_boot(hf, upoff, dictoff);
+}
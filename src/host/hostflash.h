@@ -0,0 +1,69 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+#ifndef _hostflash_h_
+#define _hostflash_h_
+
+#include <setjmp.h>
+
+#include "bootloader.h"
+#include "flashgeom.h"
+
+#define HOSTFLASH_POWERLOSS	0xffffffff	// install interrupted by simulated power loss
+
+// state of the page write interrupted by a power cut (cutwrites)
+enum {
+    HOSTFLASH_CUT_BEFORE,	// before erase, page unchanged
+    HOSTFLASH_CUT_ERASED,	// after erase, page erased
+    HOSTFLASH_CUT_HALF,		// after first program step, rest of page erased
+    HOSTFLASH_CUT_MODES
+};
+
+// Simulated flash backed by a memory-mapped flash image file. The firmware
+// starts at the beginning of the image (offset 0). An instance is passed as
+// context to update() and receives the glue function calls.
+typedef struct {
+    uint8_t* flash;		// mapped flash image
+    uint32_t size;		// flash image size (multiple of page size)
+    boot_uphdr* fwup;		// update in flash image
+    boot_dicthdr* dict;		// preset dictionary in flash image (or NULL)
+    bool unlocked;		// flash unlocked for writing
+    uint32_t progress;		// update progress (chain links completed)
+    uint32_t* pgwrites;		// write count per page
+    uint32_t nwrites;		// total page writes
+    uint32_t nlocked;		// page writes while locked (ignored)
+    uint32_t nskipped;		// page writes skipped (content unchanged)
+    uint32_t nprogress;		// progress writes (EEPROM)
+    uint32_t cutwrites;		// cut power at this page write (0 = never)
+    uint32_t cutprogress;	// cut power before this progress write (0 = never)
+    uint32_t cutmode;		// page state when power is cut at cutwrites (HOSTFLASH_CUT_*)
+    jmp_buf* powerloss;		// power loss jump target
+} hostflash;
+
+// map flash image file (changes are written back if persist is set), return 0 on success
+int hostflash_open (hostflash* hf, const char* fn, bool persist);
+void hostflash_close (hostflash* hf);
+
+// reset write accounting
+void hostflash_reset (hostflash* hf);
+
+// number of pages written at least once, max. writes of a single page
+uint32_t hostflash_pages (const hostflash* hf, uint32_t* maxwrites);
+
+// CRC-32 as calculated by the bootloader
+uint32_t hostflash_crc32 (const void* buf, uint32_t len);
+
+// install update at offset upoff (dictionary at dictoff, 0 for none) like the
+// bootloader does at boot, then verify the installed firmware; returns BOOT_OK,
+// the update error code (BOOT_E_GENERAL on CRC mismatch) or HOSTFLASH_POWERLOSS
+// if power was cut as configured by cutwrites/cutmode or cutprogress
+uint32_t hostflash_boot (hostflash* hf, uint32_t upoff, uint32_t dictoff);
+
+// check and install update at offset upoff (dictionary at dictoff, 0 for none)
+// like the bootloader does at boot, then verify the installed firmware;
+// returns BOOT_OK or the update error code (BOOT_E_GENERAL on CRC mismatch)
+uint32_t hostflash_install (hostflash* hf, uint32_t upoff, uint32_t dictoff);
+
+#endif
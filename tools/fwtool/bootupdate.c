@@ -0,0 +1,302 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+// Python binding of the bootloader update code (update.c, lz4.c, sha2.c)
+//
+// Updates are checked and installed into an in-memory flash image exactly as
+// the bootloader does it (page buffering and padding, in-place delta block
+// order, temp block), so zfwtool.py can verify updates with the code that
+// runs on the device. The LZ4 encoder of mkupdate (lz4enc.c) is exported for
+// extended-window delta updates. Build with 'python3 setup.py build_ext --inplace'.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootloader.h"
+#include "update.h"
+#include "sha2.h"
+#include "lz4enc.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "bootupdate only supports little-endian hosts and targets"
+#endif
+
+
+// ------------------------------------------------
+// Glue functions for simulated flash
+
+typedef struct {
+    uint8_t* flash;
+    boot_uphdr* fwup;
+    const boot_dicthdr* dict;
+    uint32_t dictsize;
+} up_ctx;
+
+uint32_t up_install_init (void* ctx, uint32_t fwsize, void** pfwdst, uint32_t tmpsize, void** ptmpdst, boot_fwhdr** pcurrentfw) {
+    up_ctx* uc = ctx;
+    if ((fwsize & (FLASH_PAGE_SZ - 1)) != 0 || fwsize > (uint8_t*) uc->fwup - uc->flash) {
+	return BOOT_E_SIZE;
+    }
+    if (tmpsize) {
+	boot_fwhdr* fwhdr = (boot_fwhdr*) uc->flash;
+	uint32_t fwmax = (fwsize > fwhdr->size) ? fwsize : fwhdr->size;
+	if ((tmpsize & (FLASH_PAGE_SZ - 1)) != 0 || fwmax + tmpsize > (uint8_t*) uc->fwup - uc->flash) {
+	    return BOOT_E_SIZE;
+	}
+    }
+    *pfwdst = uc->flash;
+    if (tmpsize && ptmpdst) {
+	*ptmpdst = (uint8_t*) uc->fwup - tmpsize;
+    }
+    if (pcurrentfw) {
+	*pcurrentfw = (boot_fwhdr*) uc->flash;
+    }
+    return BOOT_OK;
+}
+
+void up_flash_wr_page (void* ctx, void* dst, void* src) {
+    memcpy(dst, src, FLASH_PAGE_SZ);
+}
+
+void up_flash_unlock (void* ctx) {
+}
+
+void up_flash_lock (void* ctx) {
+}
+
+uint32_t up_dict (void* ctx, uint32_t dictcrc, uint32_t dictsize, uint8_t** pdict) {
+    up_ctx* uc = ctx;
+    if (uc->dict == NULL) {
+	return BOOT_E_NOIMPL;
+    }
+    if (uc->dict->crc != dictcrc || uc->dict->size != dictsize || dictsize != uc->dictsize
+	    || dictsize < sizeof(boot_dicthdr) || (dictsize & 3) != 0) {
+	return BOOT_E_GENERAL;
+    }
+    *pdict = (uint8_t*) (uc->dict + 1);
+    return BOOT_OK;
+}
+
+uint32_t up_progress_get (void* ctx) {
+    return 0;
+}
+
+void up_progress_set (void* ctx, uint32_t progress) {
+}
+
+
+// ------------------------------------------------
+// Module functions
+
+PyDoc_STRVAR(install_doc,
+"install(update, ref=None, dict=None, tmpsize=0) -> bytes\n\n"
+"Check and install update on top of reference firmware (or erased flash) using\n"
+"the bootloader update code, and return the installed firmware (fwsize bytes).\n"
+"dict is the preset dictionary (with header), tmpsize the temp block size.\n"
+"Raises ValueError with the bootloader return code if check or install fail.");
+
+static PyObject* install (PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "update", "ref", "dict", "tmpsize", NULL };
+    Py_buffer up, ref = { 0 }, dict = { 0 };
+    unsigned int tmpsize = 0;
+    PyObject* rv = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|z*z*I", kwlist, &up, &ref, &dict, &tmpsize)) {
+	return NULL;
+    }
+    if (up.len < (Py_ssize_t) sizeof(boot_uphdr) || up.len > UINT32_MAX
+	    || (ref.buf && (ref.len < (Py_ssize_t) sizeof(boot_fwhdr) || ref.len > UINT32_MAX))) {
+	PyErr_SetString(PyExc_ValueError, "invalid update or reference size");
+	goto done;
+    }
+
+    // flash layout: firmware, temp block, update (page-aligned)
+    boot_uphdr uphdr;
+    memcpy(&uphdr, up.buf, sizeof(uphdr));
+    uint32_t fwmax = (ref.buf && ref.len > uphdr.fwsize) ? ref.len : uphdr.fwsize;
+    uint32_t upsz = (up.len + FLASH_PAGE_SZ - 1) & ~(FLASH_PAGE_SZ - 1);
+    uint32_t flashsz = ((fwmax + FLASH_PAGE_SZ - 1) & ~(FLASH_PAGE_SZ - 1)) + ((tmpsize + FLASH_PAGE_SZ - 1) & ~(FLASH_PAGE_SZ - 1)) + upsz;
+    uint8_t* flash = aligned_alloc(FLASH_PAGE_SZ, flashsz);
+    if (flash == NULL) {
+	PyErr_NoMemory();
+	goto done;
+    }
+    memset(flash, 0xff, flashsz);
+    if (ref.buf) {
+	memcpy(flash, ref.buf, ref.len);
+    }
+    up_ctx uc = {
+	.flash = flash,
+	.fwup = (boot_uphdr*) (flash + flashsz - upsz),
+	.dict = dict.buf,
+	.dictsize = dict.len,
+    };
+    memcpy(uc.fwup, up.buf, up.len);
+
+    uint32_t res;
+    Py_BEGIN_ALLOW_THREADS
+    if ((res = update(&uc, uc.fwup, false)) == BOOT_OK) {
+	res = update(&uc, uc.fwup, true);
+    }
+    Py_END_ALLOW_THREADS
+    if (res != BOOT_OK) {
+	PyErr_Format(PyExc_ValueError, "update failed (bootloader error %u)", res);
+    } else {
+	rv = PyBytes_FromStringAndSize((char*) flash, uphdr.fwsize);
+    }
+    free(flash);
+
+ done:
+    PyBuffer_Release(&up);
+    if (ref.obj) {
+	PyBuffer_Release(&ref);
+    }
+    if (dict.obj) {
+	PyBuffer_Release(&dict);
+    }
+    return rv;
+}
+
+PyDoc_STRVAR(blksigs_doc,
+"blksigs(fw, blksize) -> bytes\n\n"
+"Return block signatures (sha256[0-7] per block) of firmware as calculated by the bootloader.");
+
+static PyObject* blksigs (PyObject* self, PyObject* args) {
+    Py_buffer fw;
+    unsigned int blksize;
+    PyObject* rv = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*I", &fw, &blksize)) {
+	return NULL;
+    }
+    if (blksize == 0 || fw.len > UINT32_MAX) {
+	PyErr_SetString(PyExc_ValueError, "invalid block size or firmware size");
+    } else {
+	uint32_t nblks = (fw.len + blksize - 1) / blksize;
+	uint32_t* sigs = malloc(nblks * 8 + 8);
+	if (sigs == NULL) {
+	    PyErr_NoMemory();
+	} else {
+	    nblks = update_blksigs(fw.buf, fw.len, blksize, sigs, nblks);
+	    rv = PyBytes_FromStringAndSize((char*) sigs, nblks * 8);
+	    free(sigs);
+	}
+    }
+    PyBuffer_Release(&fw);
+    return rv;
+}
+
+PyDoc_STRVAR(blockhashes_doc,
+"blockhashes(data, blksize) -> list\n\n"
+"Return SHA-256 digests of all blocks of data (multi-buffer kernel on x86 hosts).");
+
+static PyObject* blockhashes (PyObject* self, PyObject* args) {
+    Py_buffer data;
+    unsigned int blksize;
+    PyObject* rv = NULL;
+
+    if (!PyArg_ParseTuple(args, "y*I", &data, &blksize)) {
+	return NULL;
+    }
+    if (blksize == 0 || data.len > UINT32_MAX) {
+	PyErr_SetString(PyExc_ValueError, "invalid block size or data size");
+	goto done;
+    }
+    uint32_t n = (data.len + blksize - 1) / blksize;
+    const uint8_t** msgs = malloc(n * sizeof(uint8_t*) + 1);
+    uint32_t* lens = malloc(n * sizeof(uint32_t) + 1);
+    uint32_t* hashes = malloc(n * 32 + 1);
+    if (msgs == NULL || lens == NULL || hashes == NULL) {
+	PyErr_NoMemory();
+    } else {
+	for (uint32_t i = 0; i < n; i++) {
+	    msgs[i] = (const uint8_t*) data.buf + i * blksize;
+	    lens[i] = (data.len - i * blksize < blksize) ? data.len - i * blksize : blksize;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	sha256_batch(hashes, msgs, lens, n);
+	Py_END_ALLOW_THREADS
+	if ((rv = PyList_New(n)) != NULL) {
+	    for (uint32_t i = 0; i < n; i++) {
+		PyObject* h = PyBytes_FromStringAndSize((char*) (hashes + 8 * i), 32);
+		if (h == NULL) {
+		    Py_CLEAR(rv);
+		    break;
+		}
+		PyList_SET_ITEM(rv, i, h);
+	    }
+	}
+    }
+    free(msgs);
+    free(lens);
+    free(hashes);
+
+ done:
+    PyBuffer_Release(&data);
+    return rv;
+}
+
+PyDoc_STRVAR(lz4compress_doc,
+"lz4compress(data, dict=b'', depth=64, ext=False) -> bytes\n\n"
+"Compress data with the optimal LZ4 parser of mkupdate using dict as prefix.\n"
+"With ext, matches may reach into the entire dictionary with escaped 24-bit\n"
+"offsets (extended-window delta updates).");
+
+static PyObject* lz4compress (PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "data", "dict", "depth", "ext", NULL };
+    Py_buffer data, dict = { 0 };
+    int depth = 64, ext = 0;
+    PyObject* rv = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|y*ip", kwlist, &data, &dict, &depth, &ext)) {
+	return NULL;
+    }
+    if (data.len > INT32_MAX / 2 || dict.len > INT32_MAX / 2 || depth <= 0) {
+	PyErr_SetString(PyExc_ValueError, "invalid data size, dictionary size or depth");
+	goto done;
+    }
+    int cap = LZ4_COMPRESSBOUND(data.len);
+    unsigned char* out = malloc(cap);
+    if (out == NULL) {
+	PyErr_NoMemory();
+	goto done;
+    }
+    int n;
+    Py_BEGIN_ALLOW_THREADS
+    n = (ext ? lz4_compress_ext : lz4_compress_opt)(data.buf, data.len, dict.buf, dict.len, out, cap, depth, 0);
+    Py_END_ALLOW_THREADS
+    if (n < 0) {
+	PyErr_NoMemory();
+    } else {
+	rv = PyBytes_FromStringAndSize((char*) out, n);
+    }
+    free(out);
+
+ done:
+    PyBuffer_Release(&data);
+    if (dict.obj) {
+	PyBuffer_Release(&dict);
+    }
+    return rv;
+}
+
+static PyMethodDef methods[] = {
+    { "install", (PyCFunction) (void (*)(void)) install, METH_VARARGS | METH_KEYWORDS, install_doc },
+    { "blksigs", blksigs, METH_VARARGS, blksigs_doc },
+    { "blockhashes", blockhashes, METH_VARARGS, blockhashes_doc },
+    { "lz4compress", (PyCFunction) (void (*)(void)) lz4compress, METH_VARARGS | METH_KEYWORDS, lz4compress_doc },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT, "bootupdate", "Bootloader update code for firmware update verification", -1, methods
+};
+
+PyMODINIT_FUNC PyInit_bootupdate (void) {
+    return PyModule_Create(&module);
+}
@@ -0,0 +1,55 @@
+# Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+#
+# This file is subject to the terms and conditions defined in file 'LICENSE',
+# which is part of this source code package.
+
+# LZ4 block format with extended (24-bit) match offsets
+#
+# A match offset of 0 is invalid in standard LZ4. This variant uses it as an
+# escape: the 16-bit zero offset is followed by a 24-bit LSB-first offset.
+# Streams that do not contain any far matches are plain LZ4 blocks. Such
+# streams are created by the optimal parser of mkupdate (lz4enc.c), which is
+# available as bootupdate.lz4compress(ext=True).
+
+from typing import Optional
+
+MINMATCH     = 4
+
+def decompress(src:bytes, dict:bytes=b'', maxsize:Optional[int]=None) -> bytes:
+    """Decompress src using dict (reference implementation of lz4_decompress)."""
+    out = bytearray(dict)
+    start = len(dict)
+    i, n = 0, len(src)
+    while i < n:
+        token = src[i]; i += 1
+        llen = token >> 4
+        if llen == 15:
+            while True:
+                l = src[i]; i += 1
+                llen += l
+                if l != 255:
+                    break
+        out += src[i:i+llen]
+        i += llen
+        if i < n:
+            offset = src[i] | (src[i+1] << 8)
+            i += 2
+            if offset == 0:
+                offset = src[i] | (src[i+1] << 8) | (src[i+2] << 16)
+                i += 3
+            mlen = token & 15
+            if mlen == 15:
+                while True:
+                    l = src[i]; i += 1
+                    mlen += l
+                    if l != 255:
+                        break
+            mlen += MINMATCH
+            p = len(out) - offset
+            if p < 0:
+                raise ValueError('invalid match offset')
+            for j in range(mlen):
+                out.append(out[p + j])
+        if maxsize is not None and len(out) - start > maxsize:
+            raise ValueError('output exceeds maximum size')
+    return bytes(out[start:])
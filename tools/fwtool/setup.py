@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+
+# Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+#
+# This file is subject to the terms and conditions defined in file 'LICENSE',
+# which is part of this source code package.
+
+# Build the bootupdate extension used by zfwtool.py for update verification:
+#   python3 setup.py build_ext --inplace
+
+import os
+import platform
+from setuptools import setup, Extension
+
+# SHA-NI and AVX2 multi-buffer SHA-256 kernels on x86 hosts
+X86 = [('SHA2_X86', None)] if platform.machine().lower() in ('x86_64', 'amd64', 'i386', 'i686') else []
+
+# absolute path keeps object files within build directory
+COMMON = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'src', 'common')) + os.sep
+# LZ4 encoder of native update encoder (lz4enc.c)
+MKUPDATE = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'mkupdate')) + os.sep
+# flash geometry of host builds (flashgeom.h)
+HOST = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'src', 'host')) + os.sep
+
+setup(
+    name='bootupdate',
+    ext_modules=[
+        Extension('bootupdate',
+            sources=['bootupdate.c'] + [COMMON + f for f in ['update.c', 'lz4.c', 'sha2.c']] + [MKUPDATE + 'lz4enc.c'],
+            include_dirs=[COMMON, HOST, MKUPDATE],
+            define_macros=X86,
+            extra_compile_args=['-std=gnu11'])
+    ])
@@ -0,0 +1,401 @@
+#!/usr/bin/env python3
+
+# Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+#
+# This file is subject to the terms and conditions defined in file 'LICENSE',
+# which is part of this source code package.
+
+# Execution harness for the simul-unicorn bootloader (build/boards/simul-unicorn)
+#
+# The bootloader, a firmware and optionally an update are loaded into the
+# memory map of src/arm/unicorn/ld/mem.ld, boot_config is set up in EEPROM and
+# the bootloader is executed until it jumps to the firmware entry point or
+# panics via supervisor call. Instructions are counted per phase (check,
+# install, verify) to get reproducible performance numbers for update types.
+#
+# Flash erase and program operations are taken from calls to wr_flash() and
+# timed with a flash model (zfwtool.FlashModel, STM32L0 defaults), erases are
+# counted per page to find wear hotspots (e.g. the temp block of delta updates).
+# SysTick is simulated from the estimated cycle count (instructions and flash
+# time), so the telemetry record written by the bootloader can be checked.
+# RAM is painted before execution to report the peak stack usage.
+#
+# With --profile, a shadow call stack is kept from function entries (ELF
+# function symbols) and return addresses, and instructions are attributed to
+# functions (exclusive and inclusive) and to call stacks. The call stacks can
+# be written in collapsed format for flame graphs (flamegraph.pl, speedscope).
+# Inlined functions are attributed to their caller.
+
+from typing import Any,Dict,IO,List,Optional,Tuple
+
+import bisect
+import click
+import struct
+
+from hashlib import sha256
+from unicorn import Uc,UcError,UC_ARCH_ARM,UC_MODE_THUMB,UC_MODE_MCLASS,UC_HOOK_BLOCK,UC_HOOK_INTR,UC_HOOK_MEM_READ,UC_HOOK_MEM_WRITE,UC_HOOK_MEM_INVALID,UC_MEM_WRITE
+from unicorn.arm_const import UC_ARM_REG_SP,UC_ARM_REG_LR,UC_ARM_REG_PC,UC_ARM_REG_R0,UC_ARM_REG_R1,UC_ARM_REG_R2,UC_ARM_REG_R3
+from unicorn.arm_const import UC_CPU_ARM_CORTEX_M0,UC_CPU_ARM_CORTEX_M3
+
+from zfwtool import FlashModel,Firmware,ZFWArchive
+
+class Bootloader:
+    """Bootloader image (ELF with symbols, or raw binary at flash base)."""
+
+    def __init__(self, data:bytes, base:int) -> None:
+        self.symbols:Dict[str,int] = {}
+        self.functions:List[Tuple[int,int,str]] = []   # start, size, name
+        self.segments:List[Tuple[int,bytes]] = []
+        if data[:4] == b'\x7fELF':
+            self._loadelf(data)
+        else:
+            self.segments.append((base, data))
+
+    def _loadelf(self, data:bytes) -> None:
+        if data[4] != 1 or data[5] != 1:
+            raise ValueError('bootloader must be a 32-bit little-endian ELF file')
+        (phoff, shoff) = struct.unpack_from('<II', data, 28)
+        (phentsize, phnum, shentsize, shnum) = struct.unpack_from('<HHHH', data, 42)
+        for i in range(phnum):
+            (ptype, off, _, paddr, filesz) = struct.unpack_from('<IIIII', data, phoff + i * phentsize)
+            if ptype == 1 and filesz: # PT_LOAD
+                self.segments.append((paddr, data[off:off+filesz]))
+        shdrs = [struct.unpack_from('<IIIIIIIIII', data, shoff + i * shentsize) for i in range(shnum)]
+        for (_, shtype, _, _, off, size, link, _, _, entsize) in shdrs:
+            if shtype == 2: # SHT_SYMTAB
+                stroff = shdrs[link][4]
+                for soff in range(off, off + size, entsize):
+                    (name, value, fsize, info) = struct.unpack_from('<IIIB', data, soff)
+                    if (info & 0xf) == 2: # STT_FUNC
+                        end = data.index(b'\0', stroff + name)
+                        self.symbols[data[stroff+name:end].decode()] = value & ~1
+                        self.functions.append((value & ~1, fsize, data[stroff+name:end].decode()))
+        self.functions.sort()
+
+class Profiler:
+    """Per-function and per-call-stack instruction counts from a shadow call stack."""
+
+    def __init__(self, bl:Bootloader) -> None:
+        self.starts = [f[0] for f in bl.functions]
+        self.functions = bl.functions
+        self.entries = { f[0]: f[2] for f in bl.functions }
+        self.stack:List[Tuple[str,int]] = []            # function, return address
+        self.exclusive:Dict[str,int] = {}
+        self.inclusive:Dict[str,int] = {}
+        self.stacks:Dict[Tuple[str,...],int] = {}
+        self.names:Dict[int,str] = {}
+
+    def function(self, addr:int) -> str:
+        name = self.names.get(addr)
+        if name is None:
+            i = bisect.bisect_right(self.starts, addr) - 1
+            name = '?'
+            if i >= 0:
+                (start, size, fname) = self.functions[i]
+                if addr < start + max(size, 2):
+                    name = fname
+            self.names[addr] = name
+        return name
+
+    def block(self, uc:Uc, addr:int, n:int) -> None:
+        stack = self.stack
+        # return to caller
+        while stack and stack[-1][1] == addr:
+            stack.pop()
+        name = self.entries.get(addr)
+        if name is not None:
+            # call (or branch back to start of current function)
+            ret = uc.reg_read(UC_ARM_REG_LR) & ~1
+            if not (stack and stack[-1] == (name, ret)):
+                stack.append((name, ret))
+        else:
+            name = self.function(addr)
+            if not stack or stack[-1][0] != name:
+                # not reached by call (tail call, unknown code): unwind to function or restart stack
+                while stack and stack[-1][0] != name:
+                    stack.pop()
+                if not stack:
+                    stack.append((name, 0))
+        self.exclusive[name] = self.exclusive.get(name, 0) + n
+        frames = tuple(f[0] for f in stack)
+        for f in set(frames):
+            self.inclusive[f] = self.inclusive.get(f, 0) + n
+        self.stacks[frames] = self.stacks.get(frames, 0) + n
+
+    def collapsed(self) -> str:
+        return ''.join('%s %d\n' % (';'.join(k), v) for (k, v) in sorted(self.stacks.items()))
+
+class Simulator:
+    RAM_BASE    = 0x10000000
+    RAM_SIZE    = 16 * 1024
+    FLASH_BASE  = 0x20000000
+    FLASH_SIZE  = 128 * 1024
+    EEPROM_BASE = 0x30000000
+    EEPROM_SIZE = 8 * 1024
+    SCS_BASE    = 0xE000E000
+    SYST_CVR    = SCS_BASE + 0x18
+    TELEMETRY   = EEPROM_BASE + 64    # within 128 bytes reserved by bootloader
+    BL_SIZE     = 4 * 1024
+    FW_BASE     = FLASH_BASE + BL_SIZE
+    PAGE_SZ     = 128
+    STACK_PAINT = 0xa5
+
+    BOOT_SVC_PANIC = 0
+    PANIC_TYPES = { 0: 'exception', 1: 'bootloader', 2: 'firmware' }
+    PANIC_REASONS = { 0: 'firmware returned', 1: 'firmware CRC', 2: 'flash write', 3: 'update' }
+
+    PHASES = ['check', 'install', 'verify']
+
+    # Cortex-M0 (ARMv6-M) also runs Cortex-M0+ builds and traps Thumb-2 instructions
+    CPUS = { 'm0': UC_CPU_ARM_CORTEX_M0, 'm3': UC_CPU_ARM_CORTEX_M3 }
+
+    TELEM_STATES = { 0: 'none', 1: 'installing', 2: 'done', 3: 'failed' }
+    TELEM_FIELDS = ['state', 'uptype', 'resumes', 't_crc', 't_check', 't_install', 't_verify', 'erases', 'programs', 'skipped']
+
+    def __init__(self, bl:Bootloader, model:Optional[FlashModel]=None, halfpage:bool=True, cpi:float=1.0,
+            profiler:Optional[Profiler]=None, cpu:str='m0') -> None:
+        self.bl = bl
+        self.profiler = profiler
+        self.model = model or FlashModel()
+        self.halfpage = halfpage
+        self.cpi = cpi
+        self.systick = 0
+        self.uc = Uc(UC_ARCH_ARM, UC_MODE_THUMB | UC_MODE_MCLASS)
+        self.uc.ctl_set_cpu_model(Simulator.CPUS[cpu])
+        self.uc.mem_map(Simulator.RAM_BASE, Simulator.RAM_SIZE)
+        self.uc.mem_map(Simulator.FLASH_BASE, Simulator.FLASH_SIZE)
+        self.uc.mem_map(Simulator.EEPROM_BASE, Simulator.EEPROM_SIZE)
+        self.uc.mem_map(Simulator.SCS_BASE, 0x1000)
+        self.uc.mem_write(Simulator.RAM_BASE, bytes([Simulator.STACK_PAINT]) * Simulator.RAM_SIZE)
+        self.uc.mem_write(Simulator.FLASH_BASE, bytes([self.model.ERASED]) * Simulator.FLASH_SIZE)
+        for (addr, data) in bl.segments:
+            self.uc.mem_write(addr, data)
+        self.blocks:Dict[Tuple[int,int],int] = {}
+        self.insns = dict.fromkeys(Simulator.PHASES, 0)
+        self.erases:Dict[int,int] = {}     # erase count per page
+        self.halfpages = 0
+        self.words = 0
+        self.flashtime = dict.fromkeys(Simulator.PHASES, 0.0)
+        self.lastpage:Optional[int] = None
+        self.phase = 'check'
+        self.upret:Optional[int] = None
+        self.result:Optional[str] = None
+
+    def load(self, addr:int, data:bytes) -> None:
+        if addr < Simulator.FW_BASE or addr + len(data) > Simulator.FLASH_BASE + Simulator.FLASH_SIZE:
+            raise ValueError('data at 0x%08x (%d bytes) does not fit into firmware flash' % (addr, len(data)))
+        self.uc.mem_write(addr, bytes(data))
+
+    def set_update(self, addr:int, hash:bytes=bytes(32), progress:int=0) -> None:
+        # boot_config: fwupdate1, fwupdate2, hash, upprogress
+        self.uc.mem_write(Simulator.EEPROM_BASE, struct.pack('<II32sI', addr, addr, hash, progress))
+
+    def flash(self) -> bytes:
+        return bytes(self.uc.mem_read(Simulator.FLASH_BASE, Simulator.FLASH_SIZE))
+
+    def eeprom(self) -> bytes:
+        return bytes(self.uc.mem_read(Simulator.EEPROM_BASE, Simulator.EEPROM_SIZE))
+
+    def telemetry(self) -> Dict[str,int]:
+        return dict(zip(Simulator.TELEM_FIELDS, struct.unpack('<10I', self.uc.mem_read(Simulator.TELEMETRY, 40))))
+
+    def stack(self) -> int:
+        # RAM is painted before execution, the bootloader has no .data/.bss and only uses the stack
+        ram = self.uc.mem_read(Simulator.RAM_BASE, Simulator.RAM_SIZE)
+        return Simulator.RAM_SIZE - next((i for (i, b) in enumerate(ram) if b != Simulator.STACK_PAINT), Simulator.RAM_SIZE)
+
+    def cycles(self) -> int:
+        return int(sum(self.insns.values()) * self.cpi + sum(self.flashtime.values()) * self.model.clock)
+
+    @staticmethod
+    def _thumb_insns(code:bytes) -> int:
+        n = off = 0
+        while off + 2 <= len(code):
+            hw = code[off] | (code[off+1] << 8)
+            off += 4 if (hw >> 11) in (0x1d, 0x1e, 0x1f) else 2
+            n += 1
+        return n
+
+    def _flash_op(self, dst:int, src:int, nwords:int, erase:bool) -> None:
+        # same page-wise loop as wr_flash()
+        m = self.model
+        t = 0.0
+        while nwords > 0:
+            if (erase and (dst & (m.PAGE_SZ - 1)) == 0
+                    and dst >= Simulator.FLASH_BASE and dst < Simulator.FLASH_BASE + Simulator.FLASH_SIZE):
+                page = (dst - Simulator.FLASH_BASE) // m.PAGE_SZ
+                self.erases[page] = self.erases.get(page, 0) + 1
+                t += m.T_ERASE
+            n = min(nwords, m.PAGE_SZ >> 2)
+            if src:
+                hpw = m.HALFPAGE_SZ >> 2
+                hp = n // hpw if self.halfpage and (dst & (m.HALFPAGE_SZ - 1)) == 0 else 0
+                self.halfpages += hp
+                self.words += n - hp * hpw
+                t += hp * m.T_HALFPAGE + (n - hp * hpw) * m.T_WORD
+                src += n << 2
+            dst += n << 2
+            nwords -= n
+        self.flashtime[self.phase] += t
+
+    def _hook_block(self, uc:Uc, addr:int, size:int, _:Any) -> None:
+        if addr >= Simulator.FW_BASE and addr < Simulator.FLASH_BASE + Simulator.FLASH_SIZE:
+            self.result = 'entry 0x%08x' % addr
+            uc.emu_stop()
+            return
+        if addr == self.bl.symbols.get('wr_flash') and (uc.reg_read(UC_ARM_REG_R0) & 3) == 0:
+            (dst, src, nwords, erase) = [uc.reg_read(r) for r in (UC_ARM_REG_R0, UC_ARM_REG_R1, UC_ARM_REG_R2, UC_ARM_REG_R3)]
+            self._flash_op(dst, src, nwords, (erase & 0xff) != 0)
+        if self.phase == 'check' and addr == self.bl.symbols.get('update'):
+            self.phase = 'install'
+            self.upret = uc.reg_read(UC_ARM_REG_LR) & ~1
+        elif self.phase == 'install' and addr == self.upret:
+            self.phase = 'verify'
+        n = self.blocks.get((addr, size))
+        if n is None:
+            n = self.blocks[(addr, size)] = Simulator._thumb_insns(bytes(uc.mem_read(addr, size)))
+        self.insns[self.phase] += n
+        if self.profiler:
+            self.profiler.block(uc, addr, n)
+        if self.maxinsns and sum(self.insns.values()) > self.maxinsns:
+            self.result = 'timeout'
+            uc.emu_stop()
+
+    def _hook_write(self, uc:Uc, access:int, addr:int, size:int, value:int, _:Any) -> None:
+        if 'wr_flash' in self.bl.symbols:
+            return
+        # no symbols: install phase starts with first flash write, every page written is erased and programmed
+        if self.phase == 'check':
+            self.phase = 'install'
+        page = (addr - Simulator.FLASH_BASE) // Simulator.PAGE_SZ
+        if page != self.lastpage:
+            self.lastpage = page
+            self._flash_op(Simulator.FLASH_BASE + page * Simulator.PAGE_SZ, 1, Simulator.PAGE_SZ >> 2, True)
+
+    def _hook_systick(self, uc:Uc, access:int, addr:int, size:int, value:int, _:Any) -> None:
+        # 24-bit down counter at core clock / 8, cleared by any write
+        if access == UC_MEM_WRITE:
+            self.systick = self.cycles()
+        else:
+            uc.mem_write(Simulator.SYST_CVR, struct.pack('<I', (0xffffff - (self.cycles() - self.systick) // 8) & 0xffffff))
+
+    def _hook_intr(self, uc:Uc, intno:int, _:Any) -> None:
+        (sid, p1, p2, p3) = [uc.reg_read(r) for r in (UC_ARM_REG_R0, UC_ARM_REG_R1, UC_ARM_REG_R2, UC_ARM_REG_R3)]
+        if intno == 2 and sid == Simulator.BOOT_SVC_PANIC:
+            self.result = 'panic %s/%s (addr 0x%08x)' % (Simulator.PANIC_TYPES.get(p1, p1),
+                    Simulator.PANIC_REASONS.get(p2, p2) if p1 == 1 else p2, p3)
+        else:
+            self.result = 'exception %d (r0=0x%08x)' % (intno, sid)
+        uc.emu_stop()
+
+    def _hook_invalid(self, uc:Uc, access:int, addr:int, size:int, value:int, _:Any) -> bool:
+        self.result = 'invalid memory access at 0x%08x (pc 0x%08x)' % (addr, uc.reg_read(UC_ARM_REG_PC))
+        return False
+
+    def run(self, maxinsns:int=0) -> str:
+        self.maxinsns = maxinsns
+        self.uc.hook_add(UC_HOOK_BLOCK, self._hook_block)
+        self.uc.hook_add(UC_HOOK_MEM_WRITE, self._hook_write, begin=Simulator.FLASH_BASE, end=Simulator.FLASH_BASE + Simulator.FLASH_SIZE - 1)
+        self.uc.hook_add(UC_HOOK_MEM_READ | UC_HOOK_MEM_WRITE, self._hook_systick, begin=Simulator.SYST_CVR, end=Simulator.SYST_CVR + 3)
+        self.uc.hook_add(UC_HOOK_INTR, self._hook_intr)
+        self.uc.hook_add(UC_HOOK_MEM_INVALID, self._hook_invalid)
+        (sp, pc) = struct.unpack('<II', self.uc.mem_read(Simulator.FLASH_BASE, 8))
+        self.uc.reg_write(UC_ARM_REG_SP, sp)
+        try:
+            self.uc.emu_start(pc | 1, 0xffffffff)
+        except UcError as e:
+            if self.result is None:
+                self.result = 'error: %s (pc 0x%08x)' % (e, self.uc.reg_read(UC_ARM_REG_PC))
+        return self.result or 'stopped'
+
+
+@click.command(help='Run the simul-unicorn bootloader, where BOOTLOADER is the bootloader (ELF or binary) and ZFWFILE the installed firmware')
+@click.argument('BOOTLOADER', type=click.File(mode='rb'))
+@click.argument('ZFWFILE', type=click.File(mode='rb'))
+@click.option('-u', '--update', 'upfile', type=click.File(mode='rb'), help='update to install')
+@click.option('--upaddr', type=lambda x: int(x, 0), help='update address (default: end of flash)')
+@click.option('--progress', type=int, default=0, help='update progress in boot_config (completed chain links)')
+@click.option('--max-insns', type=int, default=10**9, help='instruction limit')
+@click.option('--cpu', type=click.Choice(sorted(Simulator.CPUS)), default='m0', help='CPU model (m3 for builds with CPU=cortex-m3)')
+@click.option('--flash-out', type=click.File(mode='wb'), help='dump flash after execution')
+@click.option('--eeprom-out', type=click.File(mode='wb'), help='dump EEPROM after execution')
+@click.option('--clock', type=float, default=32, help='CPU clock in MHz')
+@click.option('--cpi', type=float, default=1.0, help='average CPU cycles per instruction')
+@click.option('--t-erase', type=float, default=FlashModel.T_ERASE * 1e3, help='page erase time in ms')
+@click.option('--t-halfpage', type=float, default=FlashModel.T_HALFPAGE * 1e3, help='half-page program time in ms')
+@click.option('--t-word', type=float, default=FlashModel.T_WORD * 1e3, help='word program time in ms')
+@click.option('--word-program', is_flag=True, help='program words only (no half-page programming)')
+@click.option('--erased', type=lambda x: int(x, 0), default=FlashModel.ERASED, help='value of erased flash (must match FLASH_ERASED of bootloader)')
+@click.option('--hotspots', type=int, default=5, help='number of most erased pages to list')
+@click.option('--profile', is_flag=True, help='profile instructions per function (requires ELF symbols)')
+@click.option('--top', type=int, default=20, help='number of functions to list when profiling')
+@click.option('--collapsed', type=click.File(mode='w'), help='write collapsed call stacks for flame graphs (implies --profile)')
+def run(bootloader:IO, zfwfile:IO, upfile:Optional[IO], upaddr:Optional[int], progress:int, max_insns:int,
+        flash_out:Optional[IO], eeprom_out:Optional[IO], **kwargs:Any) -> None:
+    model = FlashModel(clock=kwargs['clock'] * 1e6)
+    model.T_ERASE = kwargs['t_erase'] * 1e-3
+    model.T_HALFPAGE = kwargs['t_halfpage'] * 1e-3
+    model.T_WORD = kwargs['t_word'] * 1e-3
+    model.ERASED = kwargs['erased']
+    bl = Bootloader(bootloader.read(), Simulator.FLASH_BASE)
+    profiler = None
+    if kwargs['profile'] or kwargs['collapsed']:
+        if not bl.functions:
+            raise click.UsageError('profiling requires a bootloader ELF file with symbols')
+        profiler = Profiler(bl)
+    sim = Simulator(bl, model, not kwargs['word_program'], kwargs['cpi'], profiler, kwargs['cpu'])
+    fw = ZFWArchive.fromfile(zfwfile).fw
+    sim.load(Simulator.FW_BASE if fw.base is None else fw.base, fw.fw)
+    if upfile:
+        upd = upfile.read()
+        if upaddr is None:
+            upaddr = (Simulator.FLASH_BASE + Simulator.FLASH_SIZE - len(upd)) & ~(Simulator.PAGE_SZ - 1)
+        sim.load(upaddr, upd)
+        sim.set_update(upaddr, sha256(upd[:struct.unpack_from('<I', upd, 4)[0]]).digest(), progress)
+
+    result = sim.run(max_insns)
+
+    def region(page:int) -> str:
+        addr = Simulator.FLASH_BASE + page * Simulator.PAGE_SZ
+        if upfile and addr >= upaddr:
+            return 'update'
+        fwend = Simulator.FW_BASE + max(fw.size, struct.unpack_from('<I', upd, 12)[0] if upfile else 0)
+        return 'firmware' if addr < fwend else 'temp'
+
+    print('Result:        %s' % result)
+    print('%-14s %-8s %12s %10s %10s' % ('', 'phase', 'insns', 'cpu[ms]', 'flash[ms]'))
+    for p in Simulator.PHASES + ['total']:
+        insns = sum(sim.insns.values()) if p == 'total' else sim.insns[p]
+        ft = sum(sim.flashtime.values()) if p == 'total' else sim.flashtime[p]
+        print('%-14s %-8s %12d %10.1f %10.1f' % ('Phases:', p, insns, insns * sim.cpi / model.clock * 1e3, ft * 1e3))
+    print('Page erases:   %d (%d pages, max %d per page)' % (sum(sim.erases.values()), len(sim.erases),
+        max(sim.erases.values(), default=0)))
+    print('Programs:      %d half-pages, %d words' % (sim.halfpages, sim.words))
+    print('Stack:         %d bytes' % sim.stack())
+    for (page, n) in sorted(sim.erases.items(), key=lambda x: (-x[1], x[0]))[:kwargs['hotspots']]:
+        print('Hotspot:       0x%08x %5d erases (%s)' % (Simulator.FLASH_BASE + page * Simulator.PAGE_SZ, n, region(page)))
+    tm = sim.telemetry()
+    if tm['state']:
+        print('Telemetry:     %s, uptype %d, %d resumes, %d erases, %d programs, %d skipped' % (
+            Simulator.TELEM_STATES.get(tm['state'], tm['state']), tm['uptype'], tm['resumes'], tm['erases'], tm['programs'], tm['skipped']))
+        print('Telemetry:     ticks crc %d, check %d, install %d, verify %d' % (tm['t_crc'], tm['t_check'], tm['t_install'], tm['t_verify']))
+    if profiler:
+        total = sum(sim.insns.values()) or 1
+        print('%-24s %12s %7s %12s %7s' % ('function', 'exclusive', '%', 'inclusive', '%'))
+        for (name, n) in sorted(profiler.exclusive.items(), key=lambda x: -x[1])[:kwargs['top']]:
+            print('%-24s %12d %6.1f%% %12d %6.1f%%' % (name, n, n * 100 / total,
+                profiler.inclusive[name], profiler.inclusive[name] * 100 / total))
+        if kwargs['collapsed']:
+            kwargs['collapsed'].write(profiler.collapsed())
+    if flash_out:
+        flash_out.write(sim.flash())
+    if eeprom_out:
+        eeprom_out.write(sim.eeprom())
+
+@click.group()
+def cli() -> None:
+    pass
+cli.add_command(run)
+
+if __name__ == '__main__':
+    cli()
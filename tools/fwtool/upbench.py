@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+
+# Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+#
+# This file is subject to the terms and conditions defined in file 'LICENSE',
+# which is part of this source code package.
+
+# End-to-end update benchmark with regression gate
+#
+# For every firmware pair of the corpus (bench/corpus.json), updates of all
+# listed types and block sizes are created and installed with the host
+# installer (build/boards/host/hostboot), and optionally executed with the
+# simul-unicorn bootloader (unisim.py). Update size, page writes, instructions,
+# flash erases and programs and peak stack usage are compared against a stored
+# baseline (bench/baseline.json); the run fails if a metric exceeds its
+# baseline by more than the threshold.
+#
+# Corpus pairs are either ZFW archives (paths relative to the corpus file) or
+# synthetic firmware generated from a seed: functions built from a skewed set
+# of code idioms and address literals referencing other functions, so that
+# moving or inserting code shifts addresses throughout the image like a real
+# rebuild does. The reference firmware is modified by one of these changes:
+#   patch    modify a few functions in place
+#   insert   insert new functions in the middle
+#   move     move a function to the end (link order change)
+#   rotate   move the functions of the first quarter to the end (code moved far)
+#   shuffle  reorder eight groups of functions (object files relinked in another order)
+#   grow     append new functions
+#   rebuild  unrelated firmware from the same idioms
+
+from typing import Any,Dict,IO,List,Optional,Tuple,Union
+
+import bisect
+import click
+import json
+import os
+import random
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+
+from hashlib import sha256
+
+from zfwtool import Firmware,Update,ZFWArchive
+
+BENCHDIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'bench')
+HOSTBOOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'build', 'boards', 'host', 'hostboot')
+
+PAGE_SZ = 128
+FW_BASE = 0x20001000    # firmware base address of simul-unicorn (src/arm/unicorn/ld/mem.ld)
+
+METRICS = ['upbytes', 'writes', 'skipped', 'insns', 'erases', 'programs', 'stack']
+
+class Func:
+    def __init__(self, chunks:List[Union[bytes,'Func']]) -> None:
+        self.chunks = chunks
+
+    def __len__(self) -> int:
+        return sum(4 if isinstance(c, Func) else len(c) for c in self.chunks)
+
+class Synth:
+    """Deterministic generator of firmware-like code."""
+
+    def __init__(self, seed:int, nidioms:int=512) -> None:
+        self.rnd = random.Random(seed)
+        idioms = random.Random(0) # same code idioms for all firmware
+        self.idioms = [bytes(idioms.getrandbits(8) for _ in range(idioms.choice((2, 2, 4, 4, 6, 8))))
+                for _ in range(nidioms)]
+        self.cumw:List[float] = []
+        for i in range(nidioms):
+            self.cumw.append((self.cumw[-1] if self.cumw else 0) + 1 / (i + 1))
+
+    def function(self, funcs:List[Func]) -> Func:
+        rnd = self.rnd
+        n = int(rnd.paretovariate(1.5) * 64)
+        chunks:List[Union[bytes,Func]] = []
+        body = bytearray()
+        size = 0
+        while size < min(n, 4096):
+            r = rnd.random()
+            if r < 0.04 and funcs:
+                chunks.append(bytes(body))
+                chunks.append(rnd.choice(funcs)) # address literal
+                body = bytearray()
+                size += 4
+            elif r < 0.08:
+                body += rnd.getrandbits(32).to_bytes(4, 'little') # constant
+                size += 4
+            else:
+                idiom = self.idioms[bisect.bisect(self.cumw, rnd.random() * self.cumw[-1])]
+                body += idiom
+                size += len(idiom)
+        body += bytes(-size & 3)
+        chunks.append(bytes(body))
+        return Func(chunks)
+
+    def functions(self, size:int, funcs:Optional[List[Func]]=None) -> List[Func]:
+        funcs = funcs or []
+        new:List[Func] = []
+        while sum(len(f) for f in new) < size:
+            new.append(self.function(funcs + new))
+        return new
+
+    def modify(self, f:Func, n:int) -> None:
+        for _ in range(n):
+            i = self.rnd.randrange(len(f.chunks))
+            c = f.chunks[i]
+            if isinstance(c, bytes) and len(c) >= 4:
+                off = self.rnd.randrange(len(c) // 4) * 4
+                f.chunks[i] = c[:off] + self.rnd.getrandbits(32).to_bytes(4, 'little') + c[off+4:]
+
+    @staticmethod
+    def firmware(funcs:List[Func], base:int=FW_BASE) -> Firmware:
+        addr:Dict[int,int] = {}
+        off = 12 # crc, size, entrypoint
+        for f in funcs:
+            addr[id(f)] = base + off
+            off += len(f)
+        fw = bytearray(struct.pack('<III', 0, 0, base + 12 + 1))
+        for f in funcs:
+            for c in f.chunks:
+                # referenced functions that were removed resolve to the entry point
+                fw += struct.pack('<I', addr.get(id(c), base + 12) | 1) if isinstance(c, Func) else c
+        fw += bytes(-len(fw) & (PAGE_SZ - 1))
+        fw = Firmware(fw, be=False)
+        fw.patch()
+        return fw
+
+def synthetic(spec:Dict[str,Any]) -> Tuple[Firmware,Firmware]:
+    s = Synth(spec['seed'])
+    size = spec['size']
+    funcs = s.functions(size - 12)
+    ref = Synth.firmware(funcs)
+    change = spec['change']
+    funcs = list(funcs)
+    if change == 'patch':
+        for f in s.rnd.sample(funcs, 3):
+            s.modify(f, 4)
+    elif change == 'insert':
+        i = len(funcs) // 2
+        funcs[i:i] = s.functions(size // 32, funcs)
+    elif change == 'move':
+        f = max(funcs[:len(funcs) // 4], key=len)
+        funcs.remove(f)
+        funcs.append(f)
+    elif change == 'rotate':
+        # code moved far: functions covering the first quarter are moved to the end
+        n = acc = 0
+        while acc < size // 4:
+            acc += len(funcs[n])
+            n += 1
+        funcs = funcs[n:] + funcs[:n]
+    elif change == 'shuffle':
+        # rearranged code: the functions form eight groups (object files) linked in another order
+        groups = [funcs[i * len(funcs) // 8 : (i + 1) * len(funcs) // 8] for i in range(8)]
+        s.rnd.shuffle(groups)
+        funcs = [f for g in groups for f in g]
+    elif change == 'grow':
+        funcs += s.functions(size // 16, funcs)
+    elif change == 'rebuild':
+        funcs = Synth(spec['seed'] + 1000).functions(size - 12)
+    else:
+        raise ValueError('unknown change: %s' % change)
+    return ref, Synth.firmware(funcs)
+
+def corpus(fn:str) -> Tuple[List[str],List[Tuple[str,Firmware,Firmware]]]:
+    with open(fn) as f:
+        c = json.load(f)
+    pairs = []
+    for p in c['pairs']:
+        if 'ref' in p:
+            d = os.path.dirname(fn)
+            ref = ZFWArchive.fromfile(open(os.path.join(d, p['ref']), 'rb')).fw
+            fw = ZFWArchive.fromfile(open(os.path.join(d, p['fw']), 'rb')).fw
+        else:
+            ref, fw = synthetic(p)
+        pairs.append((p['name'], ref, fw))
+    return c['updates'], pairs
+
+def create(kind:str, fw:Firmware, ref:Firmware) -> Update:
+    m = re.fullmatch(r'(plain|lz4|delta|deltax|delta2)(?:/(\d+))?', kind)
+    if m is None:
+        raise ValueError('unknown update type: %s' % kind)
+    blksz = int(m.group(2) or 4096)
+    if m.group(1) == 'plain':
+        return Update.createPlain(fw)
+    if m.group(1) == 'lz4':
+        return Update.createCompressed(fw)
+    if m.group(1) == 'delta':
+        return Update.createDelta(fw, ref, blksz)
+    if m.group(1) == 'deltax':
+        return Update.createDeltaX(fw, ref, blksz)
+    return Update.createDelta2(fw, ref, blksz)
+
+def hostinstall(hostboot:str, up:Update, fw:Firmware, ref:Firmware) -> Dict[str,int]:
+    upd = up.tobytes()
+    upoff = (max(fw.size, ref.size) + up.scratch() + PAGE_SZ - 1) & ~(PAGE_SZ - 1)
+    img = bytearray(b'\xff' * ((upoff + len(upd) + PAGE_SZ - 1) & ~(PAGE_SZ - 1)))
+    img[:ref.size] = ref.fw
+    img[upoff:upoff + len(upd)] = upd
+    with tempfile.NamedTemporaryFile(suffix='.bin') as f:
+        f.write(img)
+        f.flush()
+        p = subprocess.run([hostboot, '-n', f.name, '0x%x' % upoff], stdout=subprocess.PIPE, universal_newlines=True)
+    out = dict(re.findall(r'^(\w[\w ]*):\s+(.*)$', p.stdout, re.M))
+    m = re.match(r'\d+ bytes, crc ([0-9a-f]+)', out.get('firmware', ''))
+    if p.returncode != 0 or m is None or int(m.group(1), 16) != fw.crc:
+        raise RuntimeError('host install failed: %s' % p.stdout.strip())
+    return { 'writes': int(out['page writes'].split()[0]), 'skipped': int(out['skipped']) }
+
+def siminstall(bl:Any, cpu:str, up:Update, fw:Firmware, ref:Firmware) -> Optional[Dict[str,int]]:
+    from unisim import Simulator
+    upd = up.tobytes()
+    upaddr = (Simulator.FLASH_BASE + Simulator.FLASH_SIZE - len(upd)) & ~(Simulator.PAGE_SZ - 1)
+    if Simulator.FW_BASE + max(fw.size, ref.size) + up.scratch() > upaddr:
+        return None # does not fit into simulated flash
+    sim = Simulator(bl, cpu=cpu)
+    sim.load(Simulator.FW_BASE, ref.fw)
+    sim.load(upaddr, upd)
+    sim.set_update(upaddr, sha256(upd).digest())
+    result = sim.run(10**9)
+    if not result.startswith('entry') or sim.flash()[Simulator.BL_SIZE:Simulator.BL_SIZE + fw.size] != fw.fw:
+        raise RuntimeError('simulated install failed: %s' % result)
+    return { 'insns': sum(sim.insns.values()), 'erases': sum(sim.erases.values()),
+            'programs': sim.halfpages + sim.words, 'stack': sim.stack() }
+
+def compare(results:Dict[str,Dict[str,int]], baseline:Dict[str,Dict[str,int]], threshold:float) -> Tuple[List[str],List[str]]:
+    regressions = []
+    improvements = []
+    for (case, r) in results.items():
+        b = baseline.get(case)
+        if b is None:
+            continue
+        for m in METRICS:
+            if m not in r or m not in b:
+                continue
+            if r[m] > b[m] * (1 + threshold / 100):
+                regressions.append('%s: %s %d -> %d' % (case, m, b[m], r[m]))
+            elif r[m] < b[m] * (1 - threshold / 100):
+                improvements.append('%s: %s %d -> %d' % (case, m, b[m], r[m]))
+    return regressions, improvements
+
+@click.command(help='Run the update benchmark and compare the results against the baseline')
+@click.option('-c', '--corpus', 'corpusfile', type=click.Path(exists=True, dir_okay=False), default=os.path.join(BENCHDIR, 'corpus.json'), help='corpus file')
+@click.option('-b', '--baseline', 'baselinefile', type=click.Path(dir_okay=False), default=os.path.join(BENCHDIR, 'baseline.json'), help='baseline file')
+@click.option('--hostboot', type=click.Path(exists=True, dir_okay=False), default=HOSTBOOT, help='host installer')
+@click.option('--bootloader', type=click.File(mode='rb'), help='also execute updates with this simul-unicorn bootloader (ELF)')
+@click.option('--cpu', type=click.Choice(['m0', 'm3']), default='m0', help='CPU model of simulator')
+@click.option('-t', '--threshold', type=float, default=2.0, help='regression threshold in percent')
+@click.option('-k', '--filter', 'pattern', help='only run cases matching this regular expression')
+@click.option('-o', '--output', type=click.File(mode='w'), help='write results to this file')
+@click.option('--update-baseline', is_flag=True, help='write results to the baseline file instead of comparing')
+def run(corpusfile:str, baselinefile:str, hostboot:str, bootloader:Optional[IO], cpu:str, threshold:float, pattern:Optional[str],
+        output:Optional[IO], update_baseline:bool) -> None:
+    bl = None
+    if bootloader:
+        from unisim import Bootloader,Simulator
+        bl = Bootloader(bootloader.read(), Simulator.FLASH_BASE)
+    (kinds, pairs) = corpus(corpusfile)
+    results:Dict[str,Dict[str,int]] = {}
+    print('%-28s %9s %6s %7s %7s %10s %7s %8s %6s' % ('case', 'upbytes', 'ratio', 'writes', 'skipped',
+        'insns', 'erases', 'programs', 'stack'))
+    for (name, ref, fw) in pairs:
+        for kind in kinds:
+            case = '%s:%s' % (name, kind)
+            if pattern and not re.search(pattern, case):
+                continue
+            up = create(kind, fw, ref)
+            r = { 'upbytes': len(up.tobytes()) }
+            r.update(hostinstall(hostboot, up, fw, ref))
+            if bl:
+                r.update(siminstall(bl, cpu, up, fw, ref) or {})
+            results[case] = r
+            print('%-28s %9d %5d%% %7d %7d %10s %7s %8s %6s' % (case, r['upbytes'], r['upbytes'] * 100 // fw.size,
+                r['writes'], r['skipped'], *[str(r[m]) if m in r else '-' for m in ('insns', 'erases', 'programs', 'stack')]))
+    if output:
+        json.dump(results, output, indent=1, sort_keys=True)
+    if update_baseline:
+        baseline = {}
+        if pattern and os.path.exists(baselinefile):
+            with open(baselinefile) as f:
+                baseline = json.load(f)
+        baseline.update(results)
+        with open(baselinefile, 'w') as f:
+            json.dump(baseline, f, indent=1, sort_keys=True)
+            f.write('\n')
+        print('baseline written: %s (%d cases)' % (baselinefile, len(baseline)))
+        return
+    if not os.path.exists(baselinefile):
+        raise click.ClickException('no baseline: %s (use --update-baseline)' % baselinefile)
+    with open(baselinefile) as f:
+        baseline = json.load(f)
+    (regressions, improvements) = compare(results, baseline, threshold)
+    for s in improvements:
+        print('improved:  %s' % s)
+    for s in regressions:
+        print('REGRESSED: %s' % s)
+    missing = [c for c in results if c not in baseline]
+    if missing:
+        print('not in baseline: %s' % ', '.join(missing))
+    print('%d cases, %d regressions, %d improvements (threshold %.1f%%)' % (len(results), len(regressions), len(improvements), threshold))
+    if regressions:
+        sys.exit(1)
+
+@click.group()
+def cli() -> None:
+    pass
+cli.add_command(run)
+
+if __name__ == '__main__':
+    cli()
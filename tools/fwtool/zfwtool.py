@@ -5,13 +5,19 @@
 # This file is subject to the terms and conditions defined in file 'LICENSE',
 # which is part of this source code package.
 
-from typing import Any,BinaryIO,Callable,Dict,IO,List,Optional,Union
+from typing import Any,BinaryIO,Callable,Dict,IO,List,Optional,Tuple,Union
 
 import click
+import heapq
 import io
 import json
 import lz4.block
+import lz4ext
+import math
+import os
+import random
 import struct
+import tempfile
 import zipfile
 
 from Crypto.Hash import SHA256
@@ -23,6 +29,17 @@ from contextlib import contextmanager
 from hashlib import sha256
 from intelhex import IntelHex
 
+try:
+    import bootupdate # bootloader update code, build with 'python3 setup.py build_ext --inplace'
+except ImportError:
+    bootupdate = None
+
+def blockhashes(data:bytes, blksz:int) -> List[bytes]:
+    """Return SHA-256 digests of all blocks of data."""
+    if bootupdate:
+        return bootupdate.blockhashes(bytes(data), blksz)
+    return [sha256(data[off:off+blksz]).digest() for off in range(0, len(data), blksz)]
+
 class PatchSpec:
     def __init__(self, off:int, val:Any, fmt:str) -> None:
         self.off = off
@@ -40,13 +57,28 @@ class IntParam(click.ParamType):
     name = 'number'
 
     def convert(self, value:Optional[str], param:Optional[click.Parameter], ctx:Optional[click.Context]) -> Any:
-        if value is None:
-            return None
+        if value is None or isinstance(value, int):
+            return value
         try:
             return int(value, 0)
         except:
             self.fail('%s is not a valid integer' % value)
 
+class UptypesParam(click.ParamType):
+    name = 'profile[+dict]|mask'
+
+    def convert(self, value:Optional[str], param:Optional[click.Parameter], ctx:Optional[click.Context]) -> Any:
+        if value is None or isinstance(value, int):
+            return value
+        profile, plus, opt = value.partition('+')
+        if profile in Update.PROFILES and opt == ('dict' if plus else '') and not (plus and profile == 'plain'):
+            return Update.PROFILES[profile] | ((1 << Update.TYPE_LZ4DICT) if plus else 0)
+        try:
+            return int(value, 0)
+        except:
+            self.fail('%s is not a build profile (%s, +dict with preset dictionary region) or integer mask'
+                    % (value, ', '.join(Update.PROFILES)))
+
 class Firmware:
     SIZE_MAGIC = 0xff1234ff
 
@@ -144,26 +176,58 @@ class Firmware:
                 (',base=0x%08x' % self.base) if self.base is not None else '')
 
 class ZFWArchive:
-    META_RESERVED = ['baseaddr']
+    META_RESERVED = ['baseaddr', 'zfwversion']
+    INDEX_BLKSZS = [1024, 2048, 4096, 8192]
 
     def __init__(self, fw:Firmware, meta:Optional[Dict[str,Any]]=None) -> None:
         self.fw = fw
         #self.meta:Dict[str,Any] = meta or {}
         self.meta = meta or {}
+        self.index:Dict[int,List[bytes]] = {}  # per-block SHA-256 by block size (v2)
+        self.lz4update:Optional[bytes] = None  # precompressed LZ4 update (v2)
 
     @staticmethod
     def _filter_reserved(d:Dict[str,Any]) -> Dict[str,Any]:
         return dict((k,v) for k,v in d.items() if k not in ZFWArchive.META_RESERVED)
 
+    def mkindex(self, blkszs:List[int]=INDEX_BLKSZS, lz4:bool=True) -> None:
+        """Add block digest index and precompressed LZ4 update (archive v2)."""
+        fw = self.fw.fw
+        self.index = { bs: blockhashes(fw, bs) for bs in blkszs }
+        if lz4:
+            self.lz4update = Update.createCompressed(self.fw).tobytes()
+
+    def blockhashes(self, blksz:int) -> List[bytes]:
+        """Return SHA-256 of firmware blocks (from index if available)."""
+        if blksz not in self.index:
+            fw = self.fw.fw
+            self.index[blksz] = blockhashes(fw, blksz)
+        return self.index[blksz]
+
+    def diff(self, other:'ZFWArchive', blksz:int) -> List[int]:
+        """Return numbers of blocks that differ from other archive."""
+        a = self.blockhashes(blksz)
+        b = other.blockhashes(blksz)
+        return [i for i in range(len(a)) if i >= len(b) or a[i] != b[i]]
+
     def write(self, outfile:Union[str,IO]) -> None:
         info = ZFWArchive._filter_reserved(self.meta)
         if self.fw.base is not None:
             info['baseaddr'] = self.fw.base
+        if self.index or self.lz4update:
+            info['zfwversion'] = 2
         with zipfile.ZipFile(outfile, 'w') as zfw:
             with zfw.open('firmware.bin', 'w') as f:
                 self.fw.tofile(f)
             with zfw.open('info.json', 'w') as f:
                 json.dump(info, io.TextIOWrapper(f))
+            if self.index:
+                with zfw.open('index.json', 'w') as f:
+                    json.dump({ 'crc': self.fw.crc, 'size': self.fw.size,
+                        'blocks': { str(bs): [h.hex() for h in hs] for bs, hs in self.index.items() } }, io.TextIOWrapper(f))
+            if self.lz4update:
+                with zfw.open('update-lz4.bin', 'w') as f:
+                    f.write(self.lz4update)
 
     @staticmethod
     def fromfile(infile:Union[str,IO]) -> 'ZFWArchive':
@@ -172,12 +236,374 @@ class ZFWArchive:
                 info = json.load(io.TextIOWrapper(f))
             with zfw.open('firmware.bin', 'r') as f:
                 fw = Firmware(f, base=info.get('baseaddr'))
-        return ZFWArchive(fw, ZFWArchive._filter_reserved(info))
+            zfa = ZFWArchive(fw, ZFWArchive._filter_reserved(info))
+            names = zfw.namelist()
+            # optional v2 entries, ignored if they do not match the firmware
+            if 'index.json' in names:
+                with zfw.open('index.json', 'r') as f:
+                    index = json.load(io.TextIOWrapper(f))
+                if index.get('crc') == fw.crc and index.get('size') == fw.size:
+                    zfa.index = { int(bs): [bytes.fromhex(h) for h in hs] for bs, hs in index['blocks'].items() }
+            if 'update-lz4.bin' in names:
+                with zfw.open('update-lz4.bin', 'r') as f:
+                    upd = f.read()
+                up = Update.fromfile(upd)
+                if up.fwcrc == fw.crc and up.fwsize == fw.size and up.uptype == Update.TYPE_LZ4:
+                    zfa.lz4update = upd
+        return zfa
+
+class Dictionary:
+    """Preset dictionary trained from a firmware corpus (same header format as firmware)."""
+    MAXSIZE = 64*1024 # LZ4 window
+
+    @staticmethod
+    def train(fws:List[Firmware], size:int, k:int=256, d:int=8, step:int=16) -> Firmware:
+        """Select segments of k bytes covering the d-byte sequences most common across the corpus."""
+        size = min(size, Dictionary.MAXSIZE) & ~3
+        freq:Dict[bytes,int] = {}
+        for fw in fws:
+            for dm in set(bytes(fw.fw[i:i+d]) for i in range(len(fw.fw) - d + 1)):
+                freq[dm] = freq.get(dm, 0) + 1
+        def score(fw:Firmware, off:int, covered:set) -> int:
+            return sum(freq[dm] for dm in set(bytes(fw.fw[i:i+d]) for i in range(off, off + k - d + 1)) if dm not in covered)
+        # lazy greedy selection (scores can only decrease as sequences get covered)
+        covered:set = set()
+        heap = [(-score(fw, off, covered), n, off) for n, fw in enumerate(fws) for off in range(0, len(fw.fw) - k + 1, step)]
+        heapq.heapify(heap)
+        segs:List[bytes] = []
+        while heap and len(segs) * k < size:
+            (negsc, n, off) = heapq.heappop(heap)
+            sc = score(fws[n], off, covered)
+            if sc == 0:
+                continue
+            if heap and sc < -heap[0][0]:
+                heapq.heappush(heap, (-sc, n, off))
+                continue
+            seg = bytes(fws[n].fw[off:off+k])
+            covered.update(seg[i:i+d] for i in range(k - d + 1))
+            segs.append(seg)
+        # most valuable segments last (closest to the data, stays in window)
+        data = b''.join(reversed(segs))[-size:]
+        dict = Firmware(struct.pack('<II', 0, Firmware.SIZE_MAGIC) + data)
+        dict.patch()
+        return dict
+
+class RefIndex:
+    """Index of 8-byte sequences in the (partially updated) reference firmware."""
+    KEYLEN = 8
+    MAXHITS = 32 # ignore uninformative sequences (e.g. fill patterns)
+
+    def __init__(self, state:bytearray, reflen:int, populate:bool=True) -> None:
+        self.state = state
+        self.reflen = reflen
+        self.idx:Dict[bytes,List[int]] = {}
+        if populate:
+            self.insert(0, reflen)
+
+    def insert(self, start:int, end:int) -> None:
+        state = self.state
+        for p in range(max(0, start - RefIndex.KEYLEN + 1), min(end, self.reflen - RefIndex.KEYLEN + 1)):
+            self.idx.setdefault(bytes(state[p:p+RefIndex.KEYLEN]), []).append(p)
+
+    def votes(self, data:bytes, blksz:int) -> Dict[int,int]:
+        v:Dict[int,int] = {}
+        for i in range(0, len(data) - RefIndex.KEYLEN + 1, 4):
+            k = data[i:i+RefIndex.KEYLEN]
+            hits = self.idx.get(k)
+            if hits and len(hits) <= RefIndex.MAXHITS:
+                for p in hits:
+                    if self.state[p:p+RefIndex.KEYLEN] == k: # skip stale entries
+                        v[p // blksz] = v.get(p // blksz, 0) + 1
+        return v
+
+    def segments(self, data:bytes, blksz:int, budget:int, maxsegs:int, avail:Optional[set]=None) -> List[Tuple[int,int]]:
+        chosen:List[int] = []
+        v = self.votes(data, blksz)
+        if avail is not None:
+            v = { b: n for b, n in v.items() if b in avail }
+        for blk in sorted(v, key=lambda b: (-v[b], b)):
+            if (len(chosen) + 1) * blksz > budget:
+                break
+            if len(RefIndex._runs(sorted(chosen + [blk]))) <= maxsegs:
+                chosen.append(blk)
+        return [(idx, min(n * blksz, self.reflen - idx * blksz)) for idx, n in RefIndex._runs(sorted(chosen))]
+
+    @staticmethod
+    def _runs(blks:List[int]) -> List[Tuple[int,int]]:
+        runs:List[Tuple[int,int]] = []
+        for b in blks:
+            if runs and runs[-1][0] + runs[-1][1] == b:
+                runs[-1] = (runs[-1][0], runs[-1][1] + 1)
+            else:
+                runs.append((b, 1))
+        return runs
+
+class BlockSignatures:
+    """Block signatures (sha256[0-7]) of the firmware installed on a device."""
+
+    def __init__(self, fwsize:int, blksz:int, sigs:List[bytes]) -> None:
+        if blksz <= 0 or len(sigs) != (fwsize + blksz - 1) // blksz:
+            raise ValueError('invalid block signatures')
+        self.fwsize = fwsize
+        self.blksz = blksz
+        self.sigs = sigs
+
+    def blocksize(self, blkidx:int) -> int:
+        return min(self.blksz, self.fwsize - blkidx * self.blksz)
+
+    def tobytes(self) -> bytes:
+        return struct.pack('<II', self.fwsize, self.blksz) + b''.join(self.sigs)
+
+    def tofile(self, outfile:Union[str,IO]) -> None:
+        if isinstance(outfile, str):
+            outfile = open(outfile, 'wb')
+        outfile.write(self.tobytes())
+
+    def resolve(self, known:List[Firmware]) -> Dict[int,bytes]:
+        """Find contents of device blocks in known firmware builds (at any word-aligned offset)."""
+        blocks:Dict[int,bytes] = {}
+        for kfw in known:
+            # fast path: block at same position
+            for blkidx, sig in enumerate(self.sigs):
+                b = bytes(kfw.fw[blkidx*self.blksz : blkidx*self.blksz + self.blocksize(blkidx)])
+                if blkidx not in blocks and len(b) == self.blocksize(blkidx) and sha256(b).digest()[:8] == sig:
+                    blocks[blkidx] = b
+        for kfw in known:
+            # slow path: moved blocks
+            for bsz in sorted(set(self.blocksize(i) for i in range(len(self.sigs)) if i not in blocks)):
+                wanted:Dict[bytes,List[int]] = {}
+                for i, sig in enumerate(self.sigs):
+                    if i not in blocks and self.blocksize(i) == bsz:
+                        wanted.setdefault(sig, []).append(i)
+                for off in range(0, len(kfw.fw) - bsz + 1, 4):
+                    b = bytes(kfw.fw[off:off+bsz])
+                    for i in wanted.pop(sha256(b).digest()[:8], []):
+                        blocks[i] = b
+                    if not wanted:
+                        break
+        return blocks
+
+    @staticmethod
+    def create(fw:Firmware, blksz:int) -> 'BlockSignatures':
+        return BlockSignatures(fw.size, blksz, [h[:8] for h in blockhashes(fw.fw[:fw.size], blksz)])
+
+    @staticmethod
+    def fromfile(sigf:Union[bytes,str,BinaryIO]) -> 'BlockSignatures':
+        if isinstance(sigf, str):
+            with open(sigf, 'rb') as f:
+                sigd = f.read()
+        elif isinstance(sigf, bytes):
+            sigd = sigf
+        else:
+            sigd = sigf.read()
+        if len(sigd) < 8 or (len(sigd) & 7) != 0:
+            raise ValueError('invalid block signature file length')
+        (fwsize, blksz) = struct.unpack_from('<II', sigd)
+        return BlockSignatures(fwsize, blksz, [sigd[off:off+8] for off in range(8, len(sigd), 8)])
+
+class Fragments:
+    """Update split into fixed-size fragments with parity fragments (LoRaWAN fragmentation parity matrix)."""
+    DATARATES = [(12, 51), (11, 51), (10, 51), (9, 115), (8, 222), (7, 222)] # EU868 DR0-5 (SF, max. payload)
+    HDR_SZ = 3          # FragDataBlock command header (CID, FragIndexAndN)
+    MAC_SZ = 13         # LoRaWAN frame overhead (MHDR, FHDR, FPort, MIC)
+    DECODE_MARGIN = 2   # extra fragments needed by random parity code (failure probability ~2^-margin)
+
+    def __init__(self, data:bytes, fragsz:int, nparity:int) -> None:
+        self.fragsz = fragsz
+        self.nfrags = (len(data) + fragsz - 1) // fragsz
+        self.nparity = nparity
+        self.data = bytes(data) + bytes(self.nfrags * fragsz - len(data))
+
+    @staticmethod
+    def matrix_line(n:int, m:int) -> int:
+        """Return row n (1..) of parity matrix for m fragments as bit mask."""
+        pow2 = 1 if (m & (m - 1)) == 0 else 0
+        x = 1 + 1001 * n
+        line = 0
+        for nc in range(m >> 1):
+            r = 1 << 16
+            while r >= m:
+                x = (x >> 1) | ((((x >> 0) ^ (x >> 5)) & 1) << 22)
+                r = x % (m + pow2)
+            line |= 1 << r
+        return line
+
+    def fragment(self, n:int) -> bytes:
+        """Return fragment n (1..nfrags uncoded, nfrags+1.. parity)."""
+        if n <= self.nfrags:
+            return self.data[(n-1)*self.fragsz : n*self.fragsz]
+        line = Fragments.matrix_line(n - self.nfrags, self.nfrags)
+        acc = 0
+        for i in range(self.nfrags):
+            if line & (1 << i):
+                acc ^= int.from_bytes(self.data[i*self.fragsz : (i+1)*self.fragsz], 'little')
+        return acc.to_bytes(self.fragsz, 'little')
+
+    def tobytes(self) -> bytes:
+        # fragments with FragIndexAndN (fragmentation session 0)
+        return b''.join(struct.pack('<H', n) + self.fragment(n) for n in range(1, self.nfrags + self.nparity + 1))
+
+    @staticmethod
+    def reassemble(nfrags:int, fragsz:int, frags:List[Tuple[int,bytes]]) -> Optional[bytes]:
+        """Reassemble data from received fragments (as frag_put() in frag.c), or None if incomplete."""
+        known:Dict[int,int] = {}
+        for n, d in frags:
+            if n <= nfrags:
+                known[n-1] = int.from_bytes(d, 'little')
+        rows:Dict[int,Tuple[int,int]] = {} # pivot -> (mask, data)
+        for n, d in frags:
+            if n > nfrags:
+                mask = Fragments.matrix_line(n - nfrags, nfrags)
+                val = int.from_bytes(d, 'little')
+                for i in range(nfrags):
+                    if mask & (1 << i) and i in known:
+                        mask &= ~(1 << i)
+                        val ^= known[i]
+                while mask:
+                    p = (mask & -mask).bit_length() - 1
+                    if p not in rows:
+                        rows[p] = (mask, val)
+                        break
+                    mask ^= rows[p][0]
+                    val ^= rows[p][1]
+        missing = [i for i in range(nfrags) if i not in known]
+        if any(i not in rows for i in missing):
+            return None
+        for p in sorted(rows, reverse=True):
+            mask, val = rows[p]
+            for q in sorted(rows):
+                if q > p and mask & (1 << q):
+                    val ^= known[q]
+            known[p] = val
+        return b''.join(known[i].to_bytes(fragsz, 'little') for i in range(nfrags))
+
+    @staticmethod
+    def tune(nfrags:int, loss:float, target:float) -> int:
+        """Return number of parity fragments needed to reassemble with given probability at given loss rate."""
+        for nparity in range(0, 4 * nfrags + 16):
+            total = nfrags + nparity
+            need = nfrags + (Fragments.DECODE_MARGIN if nparity else 0)
+            # probability of receiving at least need of total fragments
+            p = sum(math.comb(total, k) * (1 - loss)**k * loss**(total - k) for k in range(need, total + 1))
+            if p >= target:
+                return nparity
+        raise ValueError('loss rate too high')
+
+    @staticmethod
+    def airtime(sf:int, paylen:int, bw:float=125e3, cr:int=1, preamble:int=8, crc:bool=False) -> float:
+        """Return LoRa time on air in seconds (explicit header, downlink without CRC by default)."""
+        tsym = (1 << sf) / bw
+        de = 1 if sf >= 11 and bw == 125e3 else 0
+        nsym = 8 + max(math.ceil((8*paylen - 4*sf + 28 + 16*int(crc)) / (4 * (sf - 2*de))) * (cr + 4), 0)
+        return (preamble + 4.25) * tsym + nsym * tsym
+
+class BlockCache:
+    """Persistent content-addressed cache of compressed blocks, keyed by block hash,
+    dictionary hash and encoder settings. Safe for concurrent use by several processes."""
+
+    def __init__(self, path:str) -> None:
+        self.path = path
+        self.hits = 0
+        self.misses = 0
+        os.makedirs(path, exist_ok=True)
+
+    @staticmethod
+    def key(settings:str, data:bytes, dict:bytes) -> str:
+        return sha256(settings.encode() + sha256(data).digest() + sha256(dict).digest()).hexdigest()
+
+    def compress(self, settings:str, data:bytes, dict:bytes, fn:Callable[[],bytes]) -> bytes:
+        key = BlockCache.key(settings, data, dict)
+        fn_ = os.path.join(self.path, key[:2], key)
+        try:
+            with open(fn_, 'rb') as f:
+                enc = f.read()
+            self.hits += 1
+            return enc
+        except FileNotFoundError:
+            pass
+        enc = fn()
+        self.misses += 1
+        os.makedirs(os.path.dirname(fn_), exist_ok=True)
+        fd, tmp = tempfile.mkstemp(dir=os.path.dirname(fn_))
+        with os.fdopen(fd, 'wb') as f:
+            f.write(enc)
+        os.replace(tmp, fn_) # atomic
+        return enc
+
+class FlashModel:
+    """Flash and CPU cost model of the bootloader install process (defaults: STM32L0, typical values)."""
+    PAGE_SZ     = 128       # erase unit
+    HALFPAGE_SZ = 64        # program unit
+    ERASED      = 0x00      # value of erased flash
+    T_ERASE     = 3.2e-3    # page erase time [s]
+    T_HALFPAGE  = 3.2e-3    # half-page program time [s]
+    T_WORD      = 3.2e-3    # word program time [s]
+    CPB_SHA256  = 100       # CPU cycles per byte for SHA-256 (sha2.c on Cortex-M0+)
+    CPB_LZ4     = 40        # CPU cycles per output byte for LZ4 decompression (lz4.c, page-buffered)
+    CPB_CRC     = 3         # CPU cycles per byte for CRC-32 (CRC peripheral)
+    CPB_COPY    = 2         # CPU cycles per byte for flash-to-buffer copies
+
+    def __init__(self, clock:float=32e6, vdd:float=3.0, run_current:float=110e-6, flash_current:float=3e-3) -> None:
+        self.clock = clock                  # CPU clock [Hz]
+        self.vdd = vdd                      # supply voltage [V]
+        self.run_current = run_current      # run current per MHz [A/MHz]
+        self.flash_current = flash_current  # additional current during erase/program [A]
+
+class InstallCost:
+    """Flash operations and CPU work of installing an update."""
+
+    def __init__(self) -> None:
+        self.erases = 0
+        self.halfpages = 0
+        self.shacalls = 0
+        self.shabytes = 0
+        self.lz4bytes = 0
+        self.crcbytes = 0
+        self.copybytes = 0
+        self.tempsize = 0
+
+    def write(self, nbytes:int) -> None:
+        # up_flash_wr_page() erases and programs entire pages
+        npages = (nbytes + FlashModel.PAGE_SZ - 1) // FlashModel.PAGE_SZ
+        self.erases += npages
+        self.halfpages += npages * (FlashModel.PAGE_SZ // FlashModel.HALFPAGE_SZ)
+
+    def sha256(self, nbytes:int) -> None:
+        self.shacalls += 1
+        self.shabytes += nbytes
+
+    def flashtime(self, m:FlashModel) -> float:
+        return self.erases * m.T_ERASE + self.halfpages * m.T_HALFPAGE
+
+    def cputime(self, m:FlashModel) -> float:
+        return (self.shabytes * m.CPB_SHA256 + self.lz4bytes * m.CPB_LZ4
+                + self.crcbytes * m.CPB_CRC + self.copybytes * m.CPB_COPY) / m.clock
+
+    def energy(self, m:FlashModel) -> float:
+        irun = m.run_current * m.clock / 1e6
+        return m.vdd * ((irun + m.flash_current) * self.flashtime(m) + irun * self.cputime(m))
 
 class Update:
     TYPE_PLAIN    = 0
     TYPE_LZ4      = 1
     TYPE_LZ4DELTA = 2
+    TYPE_LZ4DELTAX = 3
+    TYPE_LZ4DELTA2 = 4
+    TYPE_LZ4DICT   = 5
+    TYPE_CHAIN     = 6
+    TYPE_LZ4SIGDELTA = 7
+
+    DELTA_MAXSEGS = 8
+    DELTA_F_WINDOW = 0x01 # v2 block without segments, dictionary is the centered window (as v1)
+
+    # update types supported by bootloader build profiles (boottab uptypes, see build/makefiles/profile.mk),
+    # preset dictionary updates (TYPE_LZ4DICT) only if the build has a dictionary region
+    PROFILES = { 'plain': 1 << TYPE_PLAIN }
+    PROFILES['lz4'] = PROFILES['plain'] | 1 << TYPE_LZ4
+    PROFILES['delta'] = PROFILES['lz4'] | 1 << TYPE_LZ4DELTA | 1 << TYPE_LZ4DELTAX | 1 << TYPE_LZ4DELTA2 | 1 << TYPE_LZ4SIGDELTA
+    PROFILES['full'] = PROFILES['delta'] | 1 << TYPE_CHAIN
+
+    cache:Optional[BlockCache] = None
 
     def __init__(self, fwsize:int, fwcrc:int, hwid:int, uptype:int, data:bytes, sigblob:bytes, be:bool) -> None:
         self.fwsize = fwsize
@@ -223,6 +649,19 @@ class Update:
             enc = self.data[:-pad]
             plain = lz4.block.decompress(enc, uncompressed_size=2*self.fwsize)
             fw = Firmware(plain)
+        elif self.uptype == Update.TYPE_LZ4DICT:
+            ref.verify()
+            (dictcrc, dictsize) = struct.unpack(self.ep + 'II', self.data[0:8])
+            if dictcrc != ref.crc or dictsize != ref.size:
+                raise ValueError("referenced dictionary crc/size does not match")
+            pad = self.data[-1]
+            enc = self.data[8:-pad]
+            plain = lz4.block.decompress(enc, uncompressed_size=2*self.fwsize, dict=bytes(ref.fw[8:]))
+            fw = Firmware(plain)
+        elif self.uptype == Update.TYPE_CHAIN:
+            fw = ref
+            for link in self.links():
+                fw = link.unpack(fw)
         elif self.uptype == Update.TYPE_LZ4DELTA:
             ref.verify()
             (refcrc, refsize, blksz) = struct.unpack(self.ep + 'III', self.data[0:12])
@@ -242,50 +681,302 @@ class Update:
                 #      % (blkidx, len(b), blkhash.hex(), dictidx, dictlen, lz4len))
                 state[blkidx*blksz : blkidx*blksz + len(b)] = b
             fw = Firmware(state[:self.fwsize])
+        elif self.uptype == Update.TYPE_LZ4DELTAX:
+            ref.verify()
+            (refcrc, refsize, blksz) = struct.unpack(self.ep + 'III', self.data[0:12])
+            if refcrc != ref.crc or refsize != ref.size:
+                raise ValueError("referenced firmware crc/size does not match")
+            blockdata = self.data[12:]
+            state = bytearray(max(self.fwsize, len(ref.fw)))
+            state[:len(ref.fw)] = ref.fw
+            while len(blockdata):
+                (blkhash, blkidx, dictend, lz4len) = struct.unpack(self.ep + '8sBBH', blockdata[:12])
+                lz4data = blockdata[12 : 12 + lz4len]
+                blockdata = blockdata[(12 + lz4len + 3) & ~3:]
+                if dictend * blksz > refsize:
+                    raise ValueError("invalid dictionary rotation")
+                dict = bytes(state[dictend*blksz : refsize] + state[:dictend*blksz]) # rotated to end at dictend
+                b = lz4ext.decompress(lz4data, dict=dict, maxsize=blksz)
+                if sha256(b).digest()[:8] != blkhash:
+                    raise ValueError("bad block hash")
+                state[blkidx*blksz : blkidx*blksz + len(b)] = b
+            fw = Firmware(state[:self.fwsize])
+        elif self.uptype == Update.TYPE_LZ4DELTA2:
+            ref.verify()
+            (refcrc, refsize, blksz) = struct.unpack(self.ep + 'III', self.data[0:12])
+            if refcrc != ref.crc or refsize != ref.size:
+                raise ValueError("referenced firmware crc/size does not match")
+            fw = Firmware(self._unpack_blocks2(self.data[12:], ref, blksz, window=True))
+        elif self.uptype == Update.TYPE_LZ4SIGDELTA:
+            # ref only needs to contain the blocks listed in the signatures
+            (refsize, blksz, nsigs) = struct.unpack(self.ep + 'III', self.data[0:12])
+            if refsize != ref.size:
+                raise ValueError("referenced firmware size does not match")
+            for i in range(nsigs):
+                (blkhash, blkidx) = struct.unpack_from(self.ep + '8sI', self.data, 12 + 12*i)
+                if blkidx * blksz >= refsize or sha256(ref.fw[blkidx*blksz : (blkidx+1)*blksz]).digest()[:8] != blkhash:
+                    raise ValueError("referenced firmware block signature does not match")
+            fw = Firmware(self._unpack_blocks2(self.data[12 + 12*nsigs:], ref, blksz, window=False))
         else:
             raise ValueError("unknown update type")
         fw.verify()
         return fw
 
+    def _unpack_blocks2(self, blockdata:bytes, ref:Firmware, blksz:int, window:bool) -> bytearray:
+        state = bytearray(max(self.fwsize, len(ref.fw)))
+        state[:len(ref.fw)] = ref.fw
+        while len(blockdata):
+            (blkhash, blkidx, nsegs, flags, lz4len) = struct.unpack(self.ep + '8sHBBH', blockdata[:14])
+            if nsegs > Update.DELTA_MAXSEGS:
+                raise ValueError("too many dictionary segments")
+            segs = [struct.unpack_from(self.ep + 'HH', blockdata, 14 + 4*i) for i in range(nsegs)]
+            if flags & Update.DELTA_F_WINDOW:
+                if not window or nsegs:
+                    raise ValueError("invalid dictionary window")
+                segs = [Update.deltawindow(len(ref.fw), blksz, blkidx)]
+            hlen = 14 + 4*nsegs
+            lz4data = blockdata[hlen : hlen + lz4len]
+            blockdata = blockdata[(hlen + lz4len + 3) & ~3:]
+            dict = b''.join(state[dictidx*blksz : dictidx*blksz + dictlen] for dictidx, dictlen in segs)
+            b = lz4.block.decompress(lz4data, uncompressed_size=blksz, dict=dict)
+            if sha256(b).digest()[:8] != blkhash:
+                raise ValueError("bad block hash")
+            state[blkidx*blksz : blkidx*blksz + len(b)] = b
+        return state[:self.fwsize]
+
+    def _deltablocks(self) -> Tuple[int,List[int]]:
+        """Return block size and block numbers of a delta update."""
+        data = self.data
+        if self.uptype == Update.TYPE_LZ4SIGDELTA:
+            (refsize, blksz, nsigs) = struct.unpack_from(self.ep + 'III', data, 0)
+            off = 12 + 12*nsigs
+        else:
+            (refcrc, refsize, blksz) = struct.unpack_from(self.ep + 'III', data, 0)
+            off = 12
+        blocks = []
+        while off < len(data):
+            if self.uptype == Update.TYPE_LZ4DELTA:
+                (blkidx, dictidx, dictlen, lz4len) = struct.unpack_from(self.ep + 'BBHH', data, off + 8)
+                hlen = 14
+            elif self.uptype == Update.TYPE_LZ4DELTAX:
+                (blkidx, dictend, lz4len) = struct.unpack_from(self.ep + 'BBH', data, off + 8)
+                hlen = 12
+            else:
+                (blkidx, nsegs, flags, lz4len) = struct.unpack_from(self.ep + 'HBBH', data, off + 8)
+                hlen = 14 + 4*nsegs
+            blocks.append(blkidx)
+            off = (off + hlen + lz4len + 3) & ~3
+        return blksz, blocks
+
+    def replay(self, cost:InstallCost, dictsize:int=0) -> None:
+        """Replay install algorithm of bootloader (update.c) and account its cost."""
+        if self.uptype == Update.TYPE_PLAIN:
+            cost.write(self.fwsize)
+            cost.copybytes += self.fwsize
+        elif self.uptype in (Update.TYPE_LZ4, Update.TYPE_LZ4DICT):
+            cost.write(self.fwsize)
+            cost.lz4bytes += self.fwsize
+            if self.uptype == Update.TYPE_LZ4DICT:
+                (dictcrc, dictsize) = struct.unpack_from(self.ep + 'II', self.data, 0)
+                cost.crcbytes += dictsize - 8 # dictionary check (up_dict)
+        elif self.uptype == Update.TYPE_CHAIN:
+            for link in self.links():
+                link.replay(cost)
+        else:
+            blksz, blocks = self._deltablocks()
+            cost.tempsize = max(cost.tempsize, blksz)
+            for blkidx in blocks:
+                bsz = min(blksz, self.fwsize - blkidx * blksz)
+                cost.sha256(bsz) # check target block
+                cost.sha256(bsz) # check temp block
+                cost.lz4bytes += bsz
+                cost.write(bsz) # uncompress to temp block
+                cost.sha256(bsz) # verify temp block
+                cost.write(bsz) # copy to target block
+                cost.copybytes += bsz
+
+    def estimate(self, model:Optional[FlashModel]=None) -> InstallCost:
+        """Estimate cost of installing update at boot (update CRC check, install, firmware CRC check)."""
+        cost = InstallCost()
+        cost.crcbytes += 24 + len(self.data) - 8
+        self.replay(cost)
+        cost.crcbytes += self.fwsize - 8
+        return cost
+
+    def reference(self) -> Optional[Tuple[int,int]]:
+        """Return crc and size of referenced firmware (delta updates), or None."""
+        if self.uptype in (Update.TYPE_LZ4DELTA, Update.TYPE_LZ4DELTAX, Update.TYPE_LZ4DELTA2):
+            return struct.unpack(self.ep + 'II', self.data[0:8])
+        if self.uptype == Update.TYPE_CHAIN:
+            return self.links()[0].reference()
+        return None
+
+    def links(self) -> List['Update']:
+        links = []
+        data = self.data
+        while len(data):
+            (lsize,) = struct.unpack_from(self.ep + 'I', data, 4)
+            links.append(Update.fromfile(bytes(data[:lsize]), be=(self.ep == '>')))
+            data = data[lsize:]
+        return links
+
+    def typemask(self) -> int:
+        """Return update types required by bootloader to install this update (mask of 1 << TYPE_*)."""
+        mask = 1 << self.uptype
+        if self.uptype == Update.TYPE_CHAIN:
+            for link in self.links():
+                mask |= link.typemask()
+        return mask
+
+    @staticmethod
+    def typenames(mask:int) -> List[str]:
+        names = { v:k[5:].lower() for k, v in vars(Update).items() if k.startswith('TYPE_') }
+        return [names[t] for t in sorted(names) if mask & (1 << t)]
+
+    def scratch(self) -> int:
+        """Return size of temp block required for installation."""
+        if self.uptype == Update.TYPE_CHAIN:
+            return max(link.scratch() for link in self.links())
+        if self.uptype in (Update.TYPE_LZ4DELTA, Update.TYPE_LZ4DELTAX, Update.TYPE_LZ4DELTA2, Update.TYPE_LZ4SIGDELTA):
+            return self._deltablocks()[0]
+        return 0
+
+    def install(self, ref:Firmware=None) -> bytes:
+        """Check and install update with bootloader code (bootupdate extension), return new firmware."""
+        if self.uptype == Update.TYPE_LZ4DICT:
+            kw = { 'dict': bytes(ref.fw) }
+        elif self.uptype == Update.TYPE_LZ4SIGDELTA:
+            # reference only contains the listed blocks, the device firmware header holds its size
+            rf = bytearray(ref.fw)
+            struct.pack_into('<I', rf, 4, struct.unpack_from('<I', self.data, 0)[0])
+            kw = { 'ref': bytes(rf) }
+        else:
+            kw = { 'ref': bytes(ref.fw) if ref else None }
+        return bootupdate.install(self.tobytes(include_sigblob=False), tmpsize=self.scratch(), **kw)
+
     def verify(self, fw:Firmware, ref:Firmware=None) -> None:
         fw.verify()
         if self.fwcrc != fw.crc or self.fwsize != fw.size:
             raise ValueError("firmware mismatch")
+        if bootupdate and self.ep == '<':
+            if self.install(ref) != bytes(fw.fw):
+                raise ValueError("firmware content mismatch")
+            return
         sfw = self.unpack(ref)
         if sfw.fw != fw.fw:
             raise ValueError("firmware content mismatch")
 
     @staticmethod
     def lz4enc(fw:bytes, wordpad=False, **kwargs) -> bytes:
-        enc = lz4.block.compress(fw, mode='high_compression', compression=12, store_size=False, return_bytearray=True, **kwargs)
+        def compress() -> bytes:
+            return lz4.block.compress(fw, mode='high_compression', compression=12, store_size=False, return_bytearray=True, **kwargs)
+        if Update.cache:
+            enc = bytearray(Update.cache.compress('lz4hc-12-' + lz4.library_version_string(), bytes(fw), bytes(kwargs.get('dict', b'')), compress))
+        else:
+            enc = compress()
         if wordpad:
             pad = 4 - (len(enc) & 3)
             enc += bytearray([pad] * pad)
         return enc
 
+    @staticmethod
+    def lz4ext(fw:bytes, dict:bytes) -> bytes:
+        """Compress with the optimal parser of mkupdate (bootupdate extension), matches may
+        reach into the entire dictionary with escaped 24-bit offsets."""
+        if Update.cache:
+            return Update.cache.compress('lz4ext-opt-64', fw, dict, lambda: bootupdate.lz4compress(fw, dict, ext=True))
+        return bootupdate.lz4compress(fw, dict, ext=True)
+
     @staticmethod
     def createPlain(fw:Firmware) -> 'Update':
         fw.verify()
         return Update(fw.size, fw.crc, 0, Update.TYPE_PLAIN, bytes(fw.fw), b'', fw.be)
 
     @staticmethod
-    def createCompressed(fw:Firmware) -> 'Update':
+    def createCompressed(fw:Firmware, dict:Optional[Firmware]=None) -> 'Update':
         fw.verify()
-        return Update(fw.size, fw.crc, 0, Update.TYPE_LZ4, Update.lz4enc(bytes(fw.fw), wordpad=True), b'', fw.be)
+        if dict is None:
+            return Update(fw.size, fw.crc, 0, Update.TYPE_LZ4, Update.lz4enc(bytes(fw.fw), wordpad=True), b'', fw.be)
+        dict.verify()
+        updata = struct.pack(fw.ep + 'II', dict.crc, dict.size) # dictionary header
+        updata += Update.lz4enc(bytes(fw.fw), wordpad=True, dict=bytes(dict.fw[8:]))
+        return Update(fw.size, fw.crc, 0, Update.TYPE_LZ4DICT, bytes(updata), b'', fw.be)
 
     @staticmethod
-    def createDelta(fw:Firmware, ref:Firmware, blksz:int) -> 'Update':
-        fw.verify()
-        ref.verify()
+    def schedule(blocks:List[int], reads:Dict[int,Dict[int,int]]) -> List[int]:
+        """Order blocks such that each reference block is overwritten only after all blocks
+        reading it have been installed. blocks is the default order, reads maps a block to
+        the reference blocks it reads and their weights (e.g. match votes). Cycles are broken
+        by installing the block whose pending readers lose the least, their dictionaries are
+        narrowed to what is left of the reference."""
+        pending = { b: 0 for b in blocks }
+        for t in blocks:
+            for r, w in reads.get(t, {}).items():
+                if r != t and r in pending:
+                    pending[r] += w
+        order:List[int] = []
+        todo = list(blocks)
+        while todo:
+            b = next((b for b in todo if pending[b] == 0), None)
+            if b is None:
+                b = min(todo, key=lambda b: pending[b]) # break cycle (first in default order on ties)
+            todo.remove(b)
+            order.append(b)
+            for r, w in reads.get(b, {}).items():
+                if r != b and r in pending:
+                    pending[r] -= w
+        return order
+
+    @staticmethod
+    def changedblocks(fw:Firmware, ref:Firmware, blksz:int) -> List[int]:
+        """Return the changed blocks of an in-place delta update in default install order
+        (forwards if firmware shrinks, else backwards)."""
         nblocks = (len(fw.fw) + blksz - 1) // blksz
         state = bytearray(max(len(fw.fw), len(ref.fw)))
         state[:len(ref.fw)] = ref.fw
-        updata = struct.pack(fw.ep + 'III', ref.crc, ref.size, blksz) # delta header
         if len(fw.fw) < len(ref.fw):
             blockrange = range(nblocks) # forwards
         else:
             blockrange = reversed(range(nblocks)) # backwards
-        for blkidx in blockrange:
+        return [b for b in blockrange if fw.fw[b*blksz : (b+1)*blksz] != state[b*blksz : b*blksz + len(fw.fw[b*blksz : (b+1)*blksz])]]
+
+    @staticmethod
+    def blockorder(fw:Firmware, ref:Firmware, blksz:int, window:Optional[Callable[[RefIndex,int,bytes],set]]=None) -> List[int]:
+        """Return install order of the changed blocks of an in-place delta update, where
+        window(index, blkidx, data) restricts the reference blocks a block can read."""
+        state = bytearray(max(len(fw.fw), len(ref.fw)))
+        state[:len(ref.fw)] = ref.fw
+        blocks = Update.changedblocks(fw, ref, blksz)
+        index = RefIndex(state, len(ref.fw))
+        reads:Dict[int,Dict[int,int]] = {}
+        for b in blocks:
+            data = bytes(fw.fw[b*blksz : (b+1)*blksz])
+            votes = index.votes(data, blksz)
+            allowed = window(index, b, data) if window else None
+            reads[b] = { r: n for r, n in votes.items() if allowed is None or r in allowed }
+        return Update.schedule(blocks, reads)
+
+    @staticmethod
+    def deltawindow(refsize:int, blksz:int, blkidx:int) -> Tuple[int,int]:
+        """Return dictionary window (block number, length) of a delta block: up to 64K-blksz
+        of the reference firmware, centered on the block (as update.c)."""
+        dictlen = min(refsize, 64*1024 - blksz)
+        dictidx = max(0, min(blkidx - ((dictlen + blksz - 1) // blksz - 1) // 2, (refsize - dictlen + blksz - 1) // blksz))
+        return (dictidx, min(refsize - dictidx * blksz, dictlen))
+
+    @staticmethod
+    def createDelta(fw:Firmware, ref:Firmware, blksz:int) -> 'Update':
+        fw.verify()
+        ref.verify()
+        nblocks = (len(fw.fw) + blksz - 1) // blksz
+        state = bytearray(max(len(fw.fw), len(ref.fw)))
+        state[:len(ref.fw)] = ref.fw
+        updata = struct.pack(fw.ep + 'III', ref.crc, ref.size, blksz) # delta header
+        def window(index:RefIndex, blkidx:int, data:bytes) -> set:
+            dictlen = min(len(ref.fw), 64*1024 - blksz)
+            dictidx = max(0, min(blkidx - ((dictlen + blksz - 1) // blksz - 1) // 2, (len(ref.fw) - dictlen + blksz - 1) // blksz))
+            return set(range(dictidx, dictidx + (dictlen + blksz - 1) // blksz))
+        for blkidx in Update.blockorder(fw, ref, blksz, window):
             fwblock = fw.fw[blkidx*blksz : (blkidx+1)*blksz] # last block might be shorter than blksz
             if fwblock != state[blkidx*blksz : blkidx*blksz + len(fwblock)]:
                 blkhash = sha256(fwblock).digest()[:8]
@@ -301,6 +992,186 @@ class Update:
                 #      % (blkidx, len(fwblock), blkhash.hex(), dictidx, dictlen, len(lz4data)))
         return Update(fw.size, fw.crc, 0, Update.TYPE_LZ4DELTA, bytes(updata), b'', fw.be)
 
+    @staticmethod
+    def createDelta2(fw:Firmware, ref:Firmware, blksz:int) -> 'Update':
+        fw.verify()
+        ref.verify()
+        budget = min(len(ref.fw), 64*1024 - blksz)
+        def center(blkidx:int) -> Tuple[int,int]:
+            return Update.deltawindow(len(ref.fw), blksz, blkidx)
+        def blocks(segs:List[Tuple[int,int]]) -> set:
+            return set(i for di, dl in segs for i in range(di, di + (dl + blksz - 1) // blksz))
+        def window(index:RefIndex, blkidx:int, data:bytes) -> set:
+            # reference blocks of all candidates tried when encoding the block
+            return blocks([center(blkidx)] + index.segments(data, blksz, budget, Update.DELTA_MAXSEGS))
+        def centered(index:RefIndex, blkidx:int, data:bytes) -> set:
+            return blocks([center(blkidx)])
+        def encode(order:List[int]) -> bytes:
+            state = bytearray(max(len(fw.fw), len(ref.fw)))
+            state[:len(ref.fw)] = ref.fw
+            index = RefIndex(state, len(ref.fw))
+            updata = struct.pack(fw.ep + 'III', ref.crc, ref.size, blksz) # delta header
+            for blkidx in order:
+                fwblock = fw.fw[blkidx*blksz : (blkidx+1)*blksz] # last block might be shorter than blksz
+                if fwblock != state[blkidx*blksz : blkidx*blksz + len(fwblock)]:
+                    blkhash = sha256(fwblock).digest()[:8]
+                    # candidates: centered window (flag only, no segment listed), segments where the
+                    # block's content is found in the reference; keep the smallest
+                    candidates = [([center(blkidx)], [], Update.DELTA_F_WINDOW)]
+                    segs = index.segments(bytes(fwblock), blksz, budget, Update.DELTA_MAXSEGS)
+                    if segs:
+                        candidates.append((segs, segs, 0))
+                    best = None
+                    for dictsegs, segs, flags in candidates:
+                        dict = b''.join(state[di*blksz : di*blksz + dl] for di, dl in dictsegs)
+                        lz4data = Update.lz4enc(fwblock, dict=bytes(dict))
+                        if best is None or len(lz4data) + 4*len(segs) < len(best[2]) + 4*len(best[0]):
+                            best = (segs, flags, lz4data)
+                    segs, flags, lz4data = best
+                    updata += struct.pack(fw.ep + '8sHBBH', blkhash, blkidx, len(segs), flags, len(lz4data))
+                    for di, dl in segs:
+                        updata += struct.pack(fw.ep + 'HH', di, dl)
+                    updata += lz4data
+                    updata += bytearray((4 - (len(updata) & 3)) & 3) # align to word boundary
+                    state[blkidx*blksz : blkidx*blksz + len(fwblock)] = fwblock
+                    index.insert(blkidx*blksz, blkidx*blksz + len(fwblock))
+            return bytes(updata)
+        # the read graph is only an estimate of what the chosen dictionaries use, so also try the
+        # order of the centered windows (as v1) and the default order, and keep the smallest
+        orders:List[List[int]] = []
+        for order in (Update.blockorder(fw, ref, blksz, window), Update.blockorder(fw, ref, blksz, centered),
+                Update.changedblocks(fw, ref, blksz)):
+            if order not in orders:
+                orders.append(order)
+        updata = min((encode(order) for order in orders), key=len)
+        return Update(fw.size, fw.crc, 0, Update.TYPE_LZ4DELTA2, updata, b'', fw.be)
+
+    @staticmethod
+    def createSigDelta(fw:Firmware, sigs:BlockSignatures, known:List[Firmware]) -> Tuple['Update',Firmware]:
+        """Create delta update against device firmware described by its block signatures.
+        Only blocks found in the known firmware builds are used as dictionary, and only
+        those are verified by the bootloader. Returns the update and a reference firmware
+        with the known blocks filled in (for verification)."""
+        fw.verify()
+        blksz = sigs.blksz
+        refsize = sigs.fwsize
+        blocks = sigs.resolve(known)
+        nblocks = (len(fw.fw) + blksz - 1) // blksz
+        state = bytearray(max(len(fw.fw), refsize))
+        for blkidx, b in blocks.items():
+            state[blkidx*blksz : blkidx*blksz + len(b)] = b
+        ref = Firmware(bytes(state[:refsize]), be=fw.be)
+        index = RefIndex(state, refsize, populate=False)
+        for blkidx in blocks:
+            index.insert(blkidx*blksz, blkidx*blksz + sigs.blocksize(blkidx))
+        original = set(blocks)  # blocks still holding device content
+        avail = set(blocks)     # blocks with known content
+        refsigs = set()         # blocks the update depends on
+        updata = b''
+        if len(fw.fw) < refsize:
+            blockrange = range(nblocks) # forwards
+        else:
+            blockrange = reversed(range(nblocks)) # backwards
+        for blkidx in blockrange:
+            fwblock = fw.fw[blkidx*blksz : (blkidx+1)*blksz] # last block might be shorter than blksz
+            if blkidx in avail and blkidx*blksz + len(fwblock) <= refsize and fwblock == state[blkidx*blksz : blkidx*blksz + len(fwblock)]:
+                if blkidx in original:
+                    refsigs.add(blkidx)
+                continue
+            blkhash = sha256(fwblock).digest()[:8]
+            budget = min(refsize, 64*1024 - blksz)
+            segs = index.segments(bytes(fwblock), blksz, budget, Update.DELTA_MAXSEGS, avail)
+            dict = b''.join(state[di*blksz : di*blksz + dl] for di, dl in segs)
+            lz4data = Update.lz4enc(fwblock, dict=bytes(dict))
+            for di, dl in segs:
+                refsigs.update(original.intersection(range(di, di + (dl + blksz - 1) // blksz)))
+            updata += struct.pack(fw.ep + '8sHBBH', blkhash, blkidx, len(segs), 0, len(lz4data))
+            for di, dl in segs:
+                updata += struct.pack(fw.ep + 'HH', di, dl)
+            updata += lz4data
+            updata += bytearray((4 - (len(updata) & 3)) & 3) # align to word boundary
+            state[blkidx*blksz : blkidx*blksz + len(fwblock)] = fwblock
+            original.discard(blkidx)
+            if blkidx*blksz < refsize:
+                avail.add(blkidx)
+                index.insert(blkidx*blksz, blkidx*blksz + len(fwblock))
+        hdr = struct.pack(fw.ep + 'III', refsize, blksz, len(refsigs)) # signature-delta header
+        for blkidx in sorted(refsigs):
+            hdr += struct.pack(fw.ep + '8sI', sigs.sigs[blkidx], blkidx)
+        return Update(fw.size, fw.crc, 0, Update.TYPE_LZ4SIGDELTA, hdr + updata, b'', fw.be), ref
+
+    @staticmethod
+    def createDeltaX(fw:Firmware, ref:Firmware, blksz:int) -> 'Update':
+        fw.verify()
+        ref.verify()
+        reflen = len(ref.fw)
+        window = min(reflen, 64*1024 - blksz)
+        def center(blkidx:int) -> int:
+            # start of window centered on block (as v1)
+            return max(0, min(blkidx - ((window + blksz - 1) // blksz - 1) // 2, (reflen - window + blksz - 1) // blksz))
+        def centered(index:RefIndex, blkidx:int, data:bytes) -> set:
+            return set(range(center(blkidx), center(blkidx) + (window + blksz - 1) // blksz))
+        def encode(order:List[int]) -> bytes:
+            state = bytearray(max(len(fw.fw), reflen))
+            state[:reflen] = ref.fw
+            index = RefIndex(state, reflen)
+            updata = struct.pack(fw.ep + 'III', ref.crc, ref.size, blksz) # delta header
+            for blkidx in order:
+                fwblock = bytes(fw.fw[blkidx*blksz : (blkidx+1)*blksz]) # last block might be shorter than blksz
+                if fwblock != state[blkidx*blksz : blkidx*blksz + len(fwblock)]:
+                    blkhash = sha256(fwblock).digest()[:8]
+                    # rotate the reference to end after the centered window (as v1) or after the
+                    # blocks where the block's content is found, so these are in 16-bit reach
+                    ends = [min(center(blkidx) * blksz + window, reflen)]
+                    segs = index.segments(fwblock, blksz, window, 1)
+                    if segs and segs[-1][0] * blksz + segs[-1][1] not in ends:
+                        ends.append(segs[-1][0] * blksz + segs[-1][1])
+                    best = None
+                    for end in ends:
+                        dictend = end // blksz if end < reflen else 0
+                        dict = bytes(state[dictend*blksz : reflen] + state[:dictend*blksz])
+                        candidates = [Update.lz4enc(fwblock, dict=dict[-64*1024:])] # standard LZ4 (16-bit window)
+                        if bootupdate:
+                            candidates.append(Update.lz4ext(fwblock, dict))
+                        for lz4data in candidates:
+                            if best is None or len(lz4data) < len(best[1]):
+                                best = (dictend, lz4data)
+                    dictend, lz4data = best
+                    updata += struct.pack(fw.ep + '8sBBH', blkhash, blkidx, dictend, len(lz4data))
+                    updata += lz4data
+                    updata += bytearray((4 - (len(updata) & 3)) & 3) # align to word boundary
+                    state[blkidx*blksz : blkidx*blksz + len(fwblock)] = fwblock
+                    index.insert(blkidx*blksz, blkidx*blksz + len(fwblock))
+            return bytes(updata)
+        # any block can read the entire reference, so also try the order of the centered
+        # windows (as v1) and the default order, and keep the smallest
+        orders:List[List[int]] = []
+        for order in (Update.blockorder(fw, ref, blksz), Update.blockorder(fw, ref, blksz, centered),
+                Update.changedblocks(fw, ref, blksz)):
+            if order not in orders:
+                orders.append(order)
+        updata = min((encode(order) for order in orders), key=len)
+        return Update(fw.size, fw.crc, 0, Update.TYPE_LZ4DELTAX, updata, b'', fw.be)
+
+    @staticmethod
+    def createChain(links:List['Update']) -> 'Update':
+        if not links:
+            raise ValueError('empty update chain')
+        for i, link in enumerate(links):
+            if link.uptype == Update.TYPE_CHAIN:
+                raise ValueError('nested update chain')
+            if not Update.typenames(1 << link.uptype):
+                raise ValueError('unknown update type %d in chain' % link.uptype)
+            if i == 0:
+                continue # first link references current firmware
+            if link.uptype == Update.TYPE_LZ4SIGDELTA:
+                raise ValueError('signature-delta update can only be the first link of a chain')
+            ref = link.reference()
+            if ref is not None and ref != (links[i-1].fwcrc, links[i-1].fwsize):
+                raise ValueError('update chain link does not reference output of previous link')
+        updata = b''.join(link.tobytes(include_sigblob=False) for link in links)
+        return Update(links[-1].fwsize, links[-1].fwcrc, 0, Update.TYPE_CHAIN, updata, b'', links[-1].ep == '>')
+
     @staticmethod
     def fromfile(upf:Union[bytes,str,BinaryIO], be:Optional[bool]=None) -> 'Update':
         if isinstance(upf, str):
@@ -342,6 +1213,7 @@ class Update:
 @click.option('--base', type=IntParam(), help='base address')
 @click.option('--patch', is_flag=True, help='patch firmware size and CRC')
 @click.option('--meta', type=click.Tuple([str,str]), multiple=True, help='add metadata')
+@click.option('--index', is_flag=True, help='add block digest index and precompressed LZ4 update (archive v2)')
 @click.argument('FIRMWARE', type=click.File(mode='rb'))
 @click.argument('ZFWFILE', type=click.File(mode='wb'))
 def create(firmware:IO, zfwfile:IO, **kwargs:Any) -> None:
@@ -352,8 +1224,30 @@ def create(firmware:IO, zfwfile:IO, **kwargs:Any) -> None:
     if kwargs['meta']:
         meta.update({ k:v for k,v in kwargs['meta'] })
     zfw = ZFWArchive(fw, meta=meta)
+    if kwargs['index']:
+        fw.verify()
+        zfw.mkindex()
     zfw.write(zfwfile)
 
+@click.command(help='Add block digest index and precompressed LZ4 update to a ZFW archive (archive v2), where ZFWFILE is the input file and OUTFILE is the output file')
+@click.argument('ZFWFILE', type=click.File(mode='rb'))
+@click.argument('OUTFILE', type=click.File(mode='wb'))
+def index(zfwfile:IO, outfile:IO) -> None:
+    zfw = ZFWArchive.fromfile(zfwfile)
+    zfw.fw.verify()
+    zfw.mkindex()
+    zfw.write(outfile)
+
+@click.command(help='List blocks that differ between two ZFW archives')
+@click.argument('ZFWFILE1', type=click.File(mode='rb'))
+@click.argument('ZFWFILE2', type=click.File(mode='rb'))
+@click.option('-b', '--blksz', type=int, help='block size', default=4096)
+def diff(zfwfile1:IO, zfwfile2:IO, **kwargs:Any) -> None:
+    a = ZFWArchive.fromfile(zfwfile1)
+    b = ZFWArchive.fromfile(zfwfile2)
+    blks = a.diff(b, kwargs['blksz'])
+    print(' %d of %d blocks differ: %s' % (len(blks), len(a.blockhashes(kwargs['blksz'])), ' '.join(str(i) for i in blks)))
+
 @click.command(help='Export a firmeare file from a ZFW archive, where ZFWFILE is the input file and FIRMWARE is the output file')
 @click.argument('ZFWFILE', type=click.File(mode='rb'))
 @click.argument('FIRMWARE', type=click.File(mode='wb'))
@@ -370,6 +1264,22 @@ def info(zfwfile:IO) -> None:
     print(' Size: 0x%08x: %d bytes (%s)' % (fw.hsize, fw.hsize, 'ok' if fw.hsize == fw.size else 'invalid'))
     print(' Base: %s' % ('0x%08x' % fw.base) if fw.base is not None else 'not specified')
     print(' Meta: %s' % ', '.join('%s=%r' % (k,v) for k,v in zfw.meta.items()))
+    print('Index: %s' % (', '.join('%d' % bs for bs in sorted(zfw.index)) or 'none'))
+    if zfw.lz4update:
+        print('  LZ4: %d bytes' % len(zfw.lz4update))
+
+def check_uptypes(up:Update, uptypes:Optional[int]) -> None:
+    if uptypes is not None and up.typemask() & ~uptypes:
+        raise click.ClickException('update type %s not supported by bootloader (uptypes 0x%02x: %s)'
+                % ('+'.join(Update.typenames(up.typemask() & ~uptypes)), uptypes, ', '.join(Update.typenames(uptypes))))
+
+def sign(up:Update, signkey:Optional[IO], passphrase:Optional[str]) -> None:
+    if signkey:
+        pp = passphrase
+        if pp is not None and len(pp) == 0:
+            pp = click.prompt(f"Enter passphrase for key {signkey.name}", hide_input=True)
+        eckey = ECC.import_key(signkey.read(), pp)
+        up.sign(eckey)
 
 @click.command(help='Create a firmware update file, where ZFWFILE is the input file and UPFILE is the output file')
 @click.argument('ZFWFILE', type=click.File(mode='rb'))
@@ -377,39 +1287,189 @@ def info(zfwfile:IO) -> None:
 @click.option('-p', '--plain', is_flag=True, help='create plain uncompressed update')
 @click.option('-d', '--deltafile', type=click.File(mode='rb'), help='create delta update using this firmware file as reference')
 @click.option('-b', '--blksz', type=int, help='block size for delta update', default=4096)
+@click.option('-x', '--extended', is_flag=True, help='use extended dictionary window for delta update (entire reference firmware)')
+@click.option('-2', '--v2', is_flag=True, help='use v2 block header for delta update (16-bit block numbers, multiple dictionary segments)')
+@click.option('--dict', 'dictfile', type=click.File(mode='rb'), help='create compressed update using this preset dictionary file')
+@click.option('--sigfile', type=click.File(mode='rb'), help='create signature-delta update against the device firmware described by this block signature file')
+@click.option('-k', '--known', type=click.File(mode='rb'), multiple=True, help='known firmware build (ZFW archive) to resolve block signatures')
+@click.option('--cache', type=click.Path(file_okay=False), help='directory of persistent compressed-block cache')
+@click.option('-u', '--uptypes', type=UptypesParam(), help='refuse update if bootloader does not support its type (build profile or boottab uptypes mask)')
 @click.option('-s', '--signkey', type=click.File(mode='rb'), help='sign update with this key')
 @click.option('--passphrase', help='passphrase for signing key')
 def mkupdate(zfwfile:IO, upfile:IO, **kwargs:Any) -> None:
-    fw = ZFWArchive.fromfile(zfwfile).fw
+    if kwargs['cache']:
+        Update.cache = BlockCache(kwargs['cache'])
+    zfw = ZFWArchive.fromfile(zfwfile)
+    fw = zfw.fw
     if kwargs['plain']:
         up = Update.createPlain(fw)
         up.verify(fw)
     elif kwargs['deltafile']:
         rf = ZFWArchive.fromfile(kwargs['deltafile']).fw
-        up = Update.createDelta(fw, rf, kwargs['blksz'])
+        if kwargs['extended'] and kwargs['v2']:
+            raise click.UsageError('options --extended and --v2 are mutually exclusive')
+        if kwargs['extended']:
+            up = Update.createDeltaX(fw, rf, kwargs['blksz'])
+        elif kwargs['v2']:
+            up = Update.createDelta2(fw, rf, kwargs['blksz'])
+        else:
+            up = Update.createDelta(fw, rf, kwargs['blksz'])
+        up.verify(fw, rf)
+    elif kwargs['sigfile']:
+        sigs = BlockSignatures.fromfile(kwargs['sigfile'])
+        up, rf = Update.createSigDelta(fw, sigs, [ZFWArchive.fromfile(f).fw for f in kwargs['known']])
         up.verify(fw, rf)
+    elif kwargs['dictfile']:
+        df = Firmware(kwargs['dictfile'])
+        up = Update.createCompressed(fw, df)
+        up.verify(fw, df)
     else:
-        up = Update.createCompressed(fw)
+        up = Update.fromfile(zfw.lz4update) if zfw.lz4update else Update.createCompressed(fw)
         up.verify(fw)
+    check_uptypes(up, kwargs['uptypes'])
 
-    if kwargs['signkey']:
-        pp = kwargs['passphrase']
-        if pp is not None and len(pp) == 0:
-            pp = click.prompt(f"Enter passphrase for key {kwargs['signkey'].name}", hide_input=True)
-        eckey = ECC.import_key(kwargs['signkey'].read(), pp)
-        up.sign(eckey)
+    sign(up, kwargs['signkey'], kwargs['passphrase'])
 
     up.tofile(upfile)
     print(' firmware size %d, update size %d, ratio %d%%'
             % (len(fw.fw), len(up.data), len(up.data) * 100 / len(fw.fw)))
+    if Update.cache:
+        print(' block cache: %d hits, %d misses' % (Update.cache.hits, Update.cache.misses))
+
+@click.command(help='Create a chained update applying the update files UPFILES in order, where CHAINFILE is the output file')
+@click.argument('UPFILES', type=click.File(mode='rb'), nargs=-1, required=True)
+@click.argument('CHAINFILE', type=click.File(mode='wb'))
+@click.option('-d', '--deltafile', type=click.File(mode='rb'), help='verify chain using this firmware file as reference')
+@click.option('-z', '--zfwfile', type=click.File(mode='rb'), help='verify chain output against this firmware file')
+@click.option('-u', '--uptypes', type=UptypesParam(), help='refuse update if bootloader does not support its type (build profile or boottab uptypes mask)')
+@click.option('-s', '--signkey', type=click.File(mode='rb'), help='sign update with this key')
+@click.option('--passphrase', help='passphrase for signing key')
+def mkchain(upfiles:List[IO], chainfile:IO, **kwargs:Any) -> None:
+    up = Update.createChain([Update.fromfile(f) for f in upfiles])
+    if kwargs['zfwfile']:
+        fw = ZFWArchive.fromfile(kwargs['zfwfile']).fw
+        rf = ZFWArchive.fromfile(kwargs['deltafile']).fw if kwargs['deltafile'] else None
+        up.verify(fw, rf)
+    check_uptypes(up, kwargs['uptypes'])
+
+    sign(up, kwargs['signkey'], kwargs['passphrase'])
+
+    up.tofile(chainfile)
+    print(' %d links, update size %d' % (len(upfiles), len(up.data)))
+
+@click.command(help='Create a block signature file, where ZFWFILE is the input file and SIGFILE is the output file')
+@click.argument('ZFWFILE', type=click.File(mode='rb'))
+@click.argument('SIGFILE', type=click.File(mode='wb'))
+@click.option('-b', '--blksz', type=int, help='block size', default=4096)
+def mksigs(zfwfile:IO, sigfile:IO, **kwargs:Any) -> None:
+    fw = ZFWArchive.fromfile(zfwfile).fw
+    BlockSignatures.create(fw, kwargs['blksz']).tofile(sigfile)
+
+@click.command(help='Train a preset dictionary from a firmware corpus, where ZFWFILES are the input files and DICTFILE is the output file')
+@click.argument('ZFWFILES', type=click.File(mode='rb'), nargs=-1, required=True)
+@click.argument('DICTFILE', type=click.File(mode='wb'))
+@click.option('-s', '--size', type=IntParam(), default=32*1024, help='dictionary size (including 8-byte header, must fit reserved region)')
+@click.option('--base', type=IntParam(), help='base address of preset dictionary region (required for hex output)')
+def mkdict(zfwfiles:List[IO], dictfile:IO, **kwargs:Any) -> None:
+    if Firmware._ishex(dictfile) and kwargs['base'] is None:
+        raise click.UsageError('hex output requires --base (address of dictionary region)')
+    fws = [ZFWArchive.fromfile(f).fw for f in zfwfiles]
+    dict = Dictionary.train(fws, kwargs['size'] - 8)
+    dict.base = kwargs['base']
+    dict.tofile(dictfile)
+    print(' dictionary size %d, crc 0x%08x' % (dict.size, dict.crc))
+    for fw in fws:
+        plain = len(Update.lz4enc(bytes(fw.fw)))
+        withdict = len(Update.lz4enc(bytes(fw.fw), dict=bytes(dict.fw[8:])))
+        print(' firmware size %d, lz4 size %d, with dictionary %d (%d%%)'
+                % (fw.size, plain, withdict, withdict * 100 / plain))
+
+@click.command(help='Estimate install cost of updates for a ZFW archive, where ZFWFILE is the target firmware')
+@click.argument('ZFWFILE', type=click.File(mode='rb'))
+@click.option('-d', '--deltafile', type=click.File(mode='rb'), help='estimate delta updates using this firmware file as reference')
+@click.option('-b', '--blksz', type=int, multiple=True, help='block size for delta updates (repeatable)')
+@click.option('-u', '--upfile', type=click.File(mode='rb'), multiple=True, help='also estimate this update file (repeatable)')
+@click.option('--clock', type=float, default=32, help='CPU clock in MHz')
+@click.option('--vdd', type=float, default=3.0, help='supply voltage in V')
+@click.option('--run-current', type=float, default=110, help='run current in uA/MHz')
+@click.option('--flash-current', type=float, default=3, help='additional current during flash erase/program in mA')
+def estimate(zfwfile:IO, **kwargs:Any) -> None:
+    model = FlashModel(clock=kwargs['clock'] * 1e6, vdd=kwargs['vdd'],
+            run_current=kwargs['run_current'] * 1e-6, flash_current=kwargs['flash_current'] * 1e-3)
+    fw = ZFWArchive.fromfile(zfwfile).fw
+    ups:List[Tuple[str,Update]] = [('plain', Update.createPlain(fw)), ('lz4', Update.createCompressed(fw))]
+    if kwargs['deltafile']:
+        rf = ZFWArchive.fromfile(kwargs['deltafile']).fw
+        for blksz in kwargs['blksz'] or [4096]:
+            ups.append(('delta/%d' % blksz, Update.createDelta(fw, rf, blksz)))
+            ups.append(('delta-x/%d' % blksz, Update.createDeltaX(fw, rf, blksz)))
+            ups.append(('delta-v2/%d' % blksz, Update.createDelta2(fw, rf, blksz)))
+    for f in kwargs['upfile']:
+        ups.append((f.name, Update.fromfile(f)))
+    print(' %-16s %8s %7s %8s %7s %7s %9s %8s %8s' % ('update', 'size', 'erases', 'halfpgs', 'temp', 'sha256', 'sha-bytes', 'time[s]', 'E[mJ]'))
+    for name, up in ups:
+        c = up.estimate(model)
+        print(' %-16s %8d %7d %8d %7d %7d %9d %8.2f %8.1f' % (name, 24 + len(up.data), c.erases, c.halfpages,
+            c.tempsize, c.shacalls, c.shabytes, c.flashtime(model) + c.cputime(model), c.energy(model) * 1e3))
+
+@click.command(help='Split update into fragments with parity for multicast transport, where UPFILE is the input file and FRAGFILE is the output file')
+@click.argument('UPFILE', type=click.File(mode='rb'))
+@click.argument('FRAGFILE', type=click.File(mode='wb'))
+@click.option('-r', '--datarate', type=click.IntRange(0, 5), default=3, help='data rate (EU868 DR0-5)')
+@click.option('-f', '--fragsz', type=int, help='fragment size (default: balanced within max. payload of data rate)')
+@click.option('-p', '--parity', type=int, help='number of parity fragments (default: tuned for loss rate)')
+@click.option('--loss', type=float, default=0.1, help='expected fragment loss rate for tuning')
+@click.option('--target', type=float, default=0.99, help='target probability of reassembly without retransmission')
+@click.option('--trials', type=int, default=100, help='number of simulated transmissions')
+def mkfrags(upfile:IO, fragfile:IO, **kwargs:Any) -> None:
+    data = upfile.read()
+    sf, maxpl = Fragments.DATARATES[kwargs['datarate']]
+    maxfs = maxpl - Fragments.HDR_SZ
+    fragsz = kwargs['fragsz']
+    if fragsz is None:
+        # spread data evenly to minimize padding of last fragment
+        nfrags = (len(data) + maxfs - 1) // maxfs
+        fragsz = (len(data) + nfrags - 1) // nfrags
+    if fragsz < 1 or fragsz > maxfs:
+        raise click.UsageError('fragment size must be between 1 and %d for DR%d' % (maxfs, kwargs['datarate']))
+    nfrags = (len(data) + fragsz - 1) // fragsz
+    if nfrags >= 1 << 14:
+        raise click.UsageError('too many fragments, increase fragment size')
+    nparity = kwargs['parity'] if kwargs['parity'] is not None else Fragments.tune(nfrags, kwargs['loss'], kwargs['target'])
+    if nfrags + nparity >= 1 << 14:
+        # fragment index (1..nfrags+nparity) is limited to 14 bits of FragIndexAndN
+        raise click.UsageError('too many fragments, increase fragment size or reduce parity')
+    frags = Fragments(data, fragsz, nparity)
+    fragfile.write(frags.tobytes())
+
+    ok = 0
+    for t in range(kwargs['trials']):
+        rx = [(n, frags.fragment(n)) for n in range(1, nfrags + nparity + 1) if random.random() >= kwargs['loss']]
+        rdata = Fragments.reassemble(nfrags, fragsz, rx)
+        ok += 1 if rdata is not None and rdata[:len(data)] == data else 0
+    t = Fragments.airtime(sf, Fragments.MAC_SZ + Fragments.HDR_SZ + fragsz)
+    print(' update size %d, %d fragments of %d bytes, %d parity fragments (%d%% redundancy)'
+            % (len(data), nfrags, fragsz, nparity, nparity * 100 // nfrags))
+    print(' DR%d (SF%d/125kHz): %.1f ms per fragment, total airtime %.1f s'
+            % (kwargs['datarate'], sf, t * 1e3, t * (nfrags + nparity)))
+    if kwargs['trials']:
+        print(' reassembled in %d of %d simulated transmissions at %d%% loss'
+                % (ok, kwargs['trials'], kwargs['loss'] * 100))
 
 @click.group()
 def cli() -> None:
     pass
 cli.add_command(create)
 cli.add_command(export)
+cli.add_command(index)
+cli.add_command(diff)
 cli.add_command(info)
 cli.add_command(mkupdate)
+cli.add_command(mkdict)
+cli.add_command(mkchain)
+cli.add_command(mksigs)
+cli.add_command(estimate)
+cli.add_command(mkfrags)
 
 #    @staticmethod
 #    def patch_value_options(p:AP) -> None:
@@ -0,0 +1,398 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+// LZ4 block compressor (hash chains, lazy matching or cost-driven optimal
+// parsing) for the mkupdate tool
+// The output is standard LZ4 with 16-bit offsets and can be decoded by
+// lz4_decompress() as well as by liblz4, except for lz4_compress_ext(), which
+// escapes far offsets as lz4_decompress_segs() expects (offset 0, then 24 bits).
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lz4enc.h"
+
+#define MINMATCH	4
+#define MFLIMIT		12	// last match must start at least 12 bytes before end of block
+#define LASTLITERALS	5	// last 5 bytes are always literals
+#define MAXOFFSET	0xffff
+#define MAXOFFSET_EXT	0xffffff
+#define HASHBITS	16
+#define OPT_MAXLEN	36	// longest match length tried individually by optimal parser
+#define OPT_SUFFICIENT	256	// match length taken without further search by optimal parser
+
+#ifndef LZ4_PAGEBUFFER_SZ
+#define LZ4_PAGEBUFFER_SZ	128
+#endif
+
+// decoder cost model: CPU cycles of lz4_decompress_segs() with page buffer
+// (Cortex-M0+, one flash wait state; page flushes are the same for any parse)
+#define CYC_SEQ		40	// token, offset and loop overhead per sequence
+#define CYC_LENEXT	8	// per length extension byte
+#define CYC_LIT		20	// per literal byte
+#define CYC_MATCHBUF	22	// per match byte referencing the page buffer
+#define CYC_MATCHOUT	26	// per match byte referencing previous output in flash
+#define CYC_MATCHDICT	40	// per match byte referencing the dictionary (segment walk)
+
+typedef struct {
+    const unsigned char* buf;	// dictionary followed by source
+    int start;			// start of source in buf
+    int end;			// end of source in buf
+    int depth;
+    int maxoff;			// max. match offset
+    int32_t* head;		// hash table
+    int32_t* prev;		// hash chains
+} lz4ctx;
+
+static uint32_t hash4 (const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - HASHBITS);
+}
+
+static void insert (lz4ctx* c, int pos) {
+    uint32_t h = hash4(c->buf + pos);
+    c->prev[pos] = c->head[h];
+    c->head[h] = pos;
+}
+
+// find longest match for position pos (offset returned via poff)
+static int findmatch (lz4ctx* c, int pos, int* poff) {
+    const unsigned char* buf = c->buf;
+    int limit = c->end - LASTLITERALS - pos;
+    int best = 0;
+    int n = c->depth;
+    for (int p = c->head[hash4(buf + pos)]; p >= 0 && n-- > 0 && pos - p <= c->maxoff; p = c->prev[p]) {
+	if (buf[p + best] != buf[pos + best] || memcmp(buf + p, buf + pos, MINMATCH) != 0) {
+	    continue;
+	}
+	int l = MINMATCH;
+	while (l < limit && buf[p + l] == buf[pos + l]) {
+	    l++;
+	}
+	if (l > best) {
+	    best = l;
+	    *poff = pos - p;
+	    if (l == limit) {
+		break;
+	    }
+	}
+    }
+    return (best >= MINMATCH) ? best : 0;
+}
+
+// find match candidates for position pos with increasing length, return number of candidates
+static int findmatches (lz4ctx* c, int pos, int* lens, int* offs, int max) {
+    const unsigned char* buf = c->buf;
+    int limit = c->end - LASTLITERALS - pos;
+    int best = MINMATCH - 1;
+    int n = c->depth, m = 0;
+    for (int p = c->head[hash4(buf + pos)]; p >= 0 && n-- > 0 && pos - p <= c->maxoff && m < max; p = c->prev[p]) {
+	if (buf[p + best] != buf[pos + best] || memcmp(buf + p, buf + pos, MINMATCH) != 0) {
+	    continue;
+	}
+	int l = MINMATCH;
+	while (l < limit && buf[p + l] == buf[pos + l]) {
+	    l++;
+	}
+	if (l > best) {
+	    best = l;
+	    lens[m] = l;
+	    offs[m++] = pos - p;
+	    if (l == limit) {
+		break;
+	    }
+	}
+    }
+    return m;
+}
+
+// number of extension bytes for length field value
+static int extlen (int len) {
+    return (len < 15) ? 0 : 1 + (len - 15) / 255;
+}
+
+// decode cycles for match byte at output position pos (relative to start of block)
+static int matchbytecycles (int pos, int offset) {
+    if (pos < offset) {
+	return CYC_MATCHDICT;
+    }
+    return ((pos & (LZ4_PAGEBUFFER_SZ - 1)) >= offset) ? CYC_MATCHBUF : CYC_MATCHOUT;
+}
+
+static unsigned char* putlen (unsigned char* dst, int len) {
+    for (; len >= 255; len -= 255) {
+	*dst++ = 255;
+    }
+    *dst++ = len;
+    return dst;
+}
+
+// bytes of match offset (offsets beyond 16 bits are escaped)
+static int offlen (int offset) {
+    return (offset > MAXOFFSET) ? 5 : 2;
+}
+
+// emit sequence (mlen 0 for last literals)
+static unsigned char* emit (unsigned char* dst, const unsigned char* lit, int llen, int mlen, int offset) {
+    int ml = mlen ? mlen - MINMATCH : 0;
+    *dst++ = ((llen < 15 ? llen : 15) << 4) | (ml < 15 ? ml : 15);
+    if (llen >= 15) {
+	dst = putlen(dst, llen - 15);
+    }
+    memcpy(dst, lit, llen);
+    dst += llen;
+    if (mlen) {
+	if (offset > MAXOFFSET) {
+	    *dst++ = 0;
+	    *dst++ = 0;
+	    *dst++ = offset & 0xff;
+	    *dst++ = (offset >> 8) & 0xff;
+	    *dst++ = offset >> 16;
+	} else {
+	    *dst++ = offset & 0xff;
+	    *dst++ = offset >> 8;
+	}
+	if (ml >= 15) {
+	    dst = putlen(dst, ml - 15);
+	}
+    }
+    return dst;
+}
+
+int lz4_compress (const unsigned char* src, int srclen, const unsigned char* dict, int dictlen,
+	unsigned char* dst, int dstcap, int depth) {
+    lz4ctx c;
+    unsigned char* buf;
+    unsigned char* out = dst;
+    int rv = -1;
+
+    if (dstcap < LZ4_COMPRESSBOUND(srclen)) {
+	return -1;
+    }
+    if (dictlen > MAXOFFSET) { // only the last 64K of the dictionary are reachable
+	dict += dictlen - MAXOFFSET;
+	dictlen = MAXOFFSET;
+    }
+    buf = malloc(dictlen + srclen + MINMATCH);
+    c.head = malloc((1 << HASHBITS) * sizeof(int32_t));
+    c.prev = malloc((dictlen + srclen) * sizeof(int32_t));
+    if (buf == NULL || c.head == NULL || c.prev == NULL) {
+	goto done;
+    }
+    if (dictlen) {
+	memcpy(buf, dict, dictlen);
+    }
+    memcpy(buf + dictlen, src, srclen);
+    memset(buf + dictlen + srclen, 0, MINMATCH);
+    memset(c.head, 0xff, (1 << HASHBITS) * sizeof(int32_t));
+    c.buf = buf;
+    c.start = dictlen;
+    c.end = dictlen + srclen;
+    c.depth = depth;
+    c.maxoff = MAXOFFSET;
+
+    for (int p = 0; p + MINMATCH <= dictlen; p++) {
+	insert(&c, p);
+    }
+
+    int mlimit = c.end - MFLIMIT;
+    int i = c.start, anchor = c.start;
+    while (i < mlimit) {
+	int moff, mlen = findmatch(&c, i, &moff);
+	insert(&c, i);
+	if (mlen == 0) {
+	    i++;
+	    continue;
+	}
+	// lazy evaluation: prefer a longer match at the next position
+	if (i + 1 < mlimit) {
+	    int noff, nlen = findmatch(&c, i + 1, &noff);
+	    if (nlen > mlen + 1) {
+		insert(&c, ++i);
+		mlen = nlen;
+		moff = noff;
+	    }
+	}
+	out = emit(out, buf + anchor, i - anchor, mlen, moff);
+	for (int j = i + 1; j < i + mlen; j++) {
+	    insert(&c, j);
+	}
+	i += mlen;
+	anchor = i;
+    }
+    out = emit(out, buf + anchor, c.end - anchor, 0, 0);
+    rv = out - dst;
+
+ done:
+    free(buf);
+    free(c.head);
+    free(c.prev);
+    return rv;
+}
+
+static int compress_opt (const unsigned char* src, int srclen, const unsigned char* dict, int dictlen,
+	unsigned char* dst, int dstcap, int depth, double weight, int maxoff) {
+    lz4ctx c;
+    unsigned char* buf;
+    unsigned char* out = dst;
+    int rv = -1;
+
+    if (dstcap < LZ4_COMPRESSBOUND(srclen)) {
+	return -1;
+    }
+    if (dictlen > maxoff) {
+	dict += dictlen - maxoff;
+	dictlen = maxoff;
+    }
+    buf = malloc(dictlen + srclen + MINMATCH);
+    c.head = malloc((1 << HASHBITS) * sizeof(int32_t));
+    c.prev = malloc((dictlen + srclen) * sizeof(int32_t));
+    // per output position: cost of cheapest parse reaching it, trailing literals, and last step
+    double* price = malloc((srclen + 1) * sizeof(double));
+    int* nlit = malloc((srclen + 1) * sizeof(int));
+    int* steplen = malloc((srclen + 1) * sizeof(int));
+    int* stepoff = malloc((srclen + 1) * sizeof(int));
+    if (buf == NULL || c.head == NULL || c.prev == NULL
+	    || price == NULL || nlit == NULL || steplen == NULL || stepoff == NULL) {
+	goto done;
+    }
+    if (dictlen) {
+	memcpy(buf, dict, dictlen);
+    }
+    memcpy(buf + dictlen, src, srclen);
+    memset(buf + dictlen + srclen, 0, MINMATCH);
+    memset(c.head, 0xff, (1 << HASHBITS) * sizeof(int32_t));
+    c.buf = buf;
+    c.start = dictlen;
+    c.end = dictlen + srclen;
+    c.depth = depth;
+    c.maxoff = maxoff;
+
+    for (int p = 0; p + MINMATCH <= dictlen; p++) {
+	insert(&c, p);
+    }
+
+    // forward pass: relax literal and match steps, cost is size + weight * decode cycles
+    price[0] = 0;
+    nlit[0] = 0;
+    for (int i = 1; i <= srclen; i++) {
+	price[i] = 1e300;
+    }
+    int mlimit = srclen - MFLIMIT, skip = 0;
+    for (int i = 0; i < srclen; i++) {
+	int l = nlit[i];
+	double lp = price[i] + 1 + extlen(l + 1) - extlen(l)
+	    + weight * (CYC_LIT + CYC_LENEXT * (extlen(l + 1) - extlen(l)));
+	if (lp < price[i + 1]) {
+	    price[i + 1] = lp;
+	    nlit[i + 1] = l + 1;
+	    steplen[i + 1] = 1;
+	    stepoff[i + 1] = 0;
+	}
+	if (i >= mlimit) {
+	    continue;
+	}
+	int lens[64], offs[64], m = 0;
+	if (i >= skip) {
+	    m = findmatches(&c, c.start + i, lens, offs, 64);
+	}
+	insert(&c, c.start + i);
+	for (int k = 0, len = MINMATCH; k < m; k++) {
+	    // bytes of the sequence besides the literals (token, offset); cycles of the match bytes
+	    int cyc = 0;
+	    for (int j = 0; j < len - 1; j++) {
+		cyc += matchbytecycles(i + j, offs[k]);
+	    }
+	    for (; len <= lens[k]; len++) {
+		cyc += matchbytecycles(i + len - 1, offs[k]);
+		if (len > OPT_MAXLEN && len < lens[k]) {
+		    continue;
+		}
+		int ext = extlen(len - MINMATCH);
+		double mp = price[i] + 1 + offlen(offs[k]) + ext + weight * (CYC_SEQ + CYC_LENEXT * ext + cyc);
+		if (mp < price[i + len]) {
+		    price[i + len] = mp;
+		    nlit[i + len] = 0;
+		    steplen[i + len] = len;
+		    stepoff[i + len] = offs[k];
+		}
+	    }
+	}
+	if (m > 0 && lens[m - 1] >= OPT_SUFFICIENT) {
+	    skip = i + lens[m - 1];
+	}
+    }
+
+    // backward pass: link steps of cheapest parse (reusing nlit as next-step length)
+    for (int i = srclen; i > 0; i -= steplen[i]) {
+	nlit[i - steplen[i]] = steplen[i];
+    }
+    nlit[srclen] = 0;
+
+    // emit sequences
+    int anchor = 0;
+    for (int i = 0; i < srclen; ) {
+	int n = nlit[i];
+	if (n == 1 && stepoff[i + 1] == 0) {
+	    i++;
+	    continue;
+	}
+	out = emit(out, buf + c.start + anchor, i - anchor, n, stepoff[i + n]);
+	i += n;
+	anchor = i;
+    }
+    out = emit(out, buf + c.start + anchor, srclen - anchor, 0, 0);
+    rv = out - dst;
+
+ done:
+    free(buf);
+    free(c.head);
+    free(c.prev);
+    free(price);
+    free(nlit);
+    free(steplen);
+    free(stepoff);
+    return rv;
+}
+
+int lz4_compress_opt (const unsigned char* src, int srclen, const unsigned char* dict, int dictlen,
+	unsigned char* dst, int dstcap, int depth, double weight) {
+    return compress_opt(src, srclen, dict, dictlen, dst, dstcap, depth, weight, MAXOFFSET);
+}
+
+int lz4_compress_ext (const unsigned char* src, int srclen, const unsigned char* dict, int dictlen,
+	unsigned char* dst, int dstcap, int depth, double weight) {
+    return compress_opt(src, srclen, dict, dictlen, dst, dstcap, depth, weight, MAXOFFSET_EXT);
+}
+
+long lz4_cycles (const unsigned char* lz4, int lz4len) {
+    const unsigned char* end = lz4 + lz4len;
+    long cyc = 0;
+    int pos = 0;
+    while (lz4 < end) {
+	unsigned char token = *lz4++;
+	int l, len = token >> 4;
+	cyc += CYC_SEQ;
+	if (len == 15) do { l = *lz4++; len += l; cyc += CYC_LENEXT; } while (l == 255);
+	cyc += len * CYC_LIT;
+	lz4 += len;
+	pos += len;
+	if (lz4 < end) {
+	    int offset = lz4[0] | (lz4[1] << 8);
+	    lz4 += 2;
+	    if (offset == 0) {
+		offset = lz4[0] | (lz4[1] << 8) | (lz4[2] << 16);
+		lz4 += 3;
+	    }
+	    len = token & 0x0F;
+	    if (len == 15) do { l = *lz4++; len += l; cyc += CYC_LENEXT; } while (l == 255);
+	    for (len += MINMATCH; len-- > 0; pos++) {
+		cyc += matchbytecycles(pos, offset);
+	    }
+	}
+    }
+    return cyc;
+}
@@ -0,0 +1,31 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+#ifndef _lz4enc_h_
+#define _lz4enc_h_
+
+// compress src to dst (LZ4 block format) using dict as prefix, return compressed size or -1
+// depth limits the number of match candidates searched per position
+int lz4_compress (const unsigned char* src, int srclen, const unsigned char* dict, int dictlen,
+	unsigned char* dst, int dstcap, int depth);
+
+// compress src to dst like lz4_compress(), but choose the parse minimizing
+// size + weight * estimated decode cycles of lz4_decompress() on the device
+// (weight in bytes per cycle, 0 gives the smallest output)
+int lz4_compress_opt (const unsigned char* src, int srclen, const unsigned char* dict, int dictlen,
+	unsigned char* dst, int dstcap, int depth, double weight);
+
+// compress src to dst like lz4_compress_opt(), but with matches up to 16M back (the
+// entire dict), escaping offsets beyond 16 bits (offset 0 followed by 24-bit offset)
+int lz4_compress_ext (const unsigned char* src, int srclen, const unsigned char* dict, int dictlen,
+	unsigned char* dst, int dstcap, int depth, double weight);
+
+// estimate decode cycles of compressed block on the device (cost model of lz4_compress_opt())
+long lz4_cycles (const unsigned char* lz4, int lz4len);
+
+// worst-case compressed size
+#define LZ4_COMPRESSBOUND(n)	((n) + ((n) / 255) + 16)
+
+#endif
@@ -0,0 +1,833 @@
+// Copyright (C) 2016-2019 Semtech (International) AG. All rights reserved.
+//
+// This file is subject to the terms and conditions defined in file 'LICENSE',
+// which is part of this source code package.
+
+// Native firmware update encoder
+//
+// Creates plain, LZ4 and LZ4 in-place delta updates (v1 and v2 block header)
+// with the same layout as zfwtool.py. Candidate dictionary windows of delta
+// blocks are compressed in parallel, and every update is verified by
+// installing it into a simulated flash using the bootloader's own update
+// code (update.c, lz4.c, sha2.c).
+//
+// In optimizer mode (-O) all block sizes fitting the flash scratch budget
+// and all dictionary window positions are tried, the smallest valid update
+// is kept, and the gain over the zfwtool.py heuristic (fixed block size,
+// window centered on block) is reported.
+//
+// Input firmware files are binary images with patched header (see
+// 'zfwtool.py export'). The output is unsigned, use signtool.py to sign.
+
+#define _GNU_SOURCE // qsort_r
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootloader.h"
+#include "update.h"
+#include "sha2.h"
+#include "lz4enc.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "mkupdate only supports little-endian hosts and targets"
+#endif
+
+#define MAXCANDS	32	// max. number of single-window candidates per delta block
+#define MAXBEST		8	// number of best-scoring windows compressed in optimizer mode
+#define MAXHITS		32	// ignore uninformative sequences when voting (e.g. fill patterns)
+
+
+// ------------------------------------------------
+// Utilities
+
+static void fatal (const char* fmt, const char* arg) {
+    fprintf(stderr, "mkupdate: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void* xmalloc (size_t sz) {
+    void* p = malloc(sz ? sz : 1);
+    if (p == NULL) {
+	fatal("out of memory%s", "");
+    }
+    return p;
+}
+
+static void* xcalloc (size_t n, size_t sz) {
+    void* p = calloc(n ? n : 1, sz ? sz : 1);
+    if (p == NULL) {
+	fatal("out of memory%s", "");
+    }
+    return p;
+}
+
+// CRC-32 (same as zlib/binascii)
+static uint32_t crctab[256];
+
+static void crc32_init (void) {
+    for (uint32_t i = 0; i < 256; i++) {
+	uint32_t c = i;
+	for (int k = 0; k < 8; k++) {
+	    c = (c & 1) ? (c >> 1) ^ 0xedb88320 : (c >> 1);
+	}
+	crctab[i] = c;
+    }
+}
+
+static uint32_t crc32 (uint32_t crc, const uint8_t* p, uint32_t n) {
+    crc = ~crc;
+    while (n--) {
+	crc = crctab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// growable byte buffer
+typedef struct {
+    uint8_t* p;
+    uint32_t len;
+    uint32_t cap;
+} buffer;
+
+static void buf_put (buffer* b, const void* data, uint32_t len) {
+    if (b->len + len > b->cap) {
+	b->cap = (b->len + len) * 2;
+	if ((b->p = realloc(b->p, b->cap)) == NULL) {
+	    fatal("out of memory%s", "");
+	}
+    }
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+}
+
+// align to word boundary
+static void buf_align (buffer* b) {
+    static const uint8_t zero[3];
+    buf_put(b, zero, (4 - (b->len & 3)) & 3);
+}
+
+
+// ------------------------------------------------
+// Thread pool
+
+typedef void (*taskfn) (void* arg, int i);
+
+typedef struct {
+    taskfn fn;
+    void* arg;
+    int n;
+    int next;
+} pool;
+
+static void* pool_worker (void* arg) {
+    pool* p = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n) {
+	p->fn(p->arg, i);
+    }
+    return NULL;
+}
+
+// run fn(arg, 0..n-1) on up to nthreads threads (including the caller)
+static void pool_run (int nthreads, int n, taskfn fn, void* arg) {
+    pool p = { .fn = fn, .arg = arg, .n = n, .next = 0 };
+    int nt = (nthreads < n) ? nthreads : n;
+    pthread_t tid[nt > 1 ? nt - 1 : 1];
+    int started = 0;
+    for (; started < nt - 1; started++) {
+	if (pthread_create(&tid[started], NULL, pool_worker, &p) != 0) {
+	    break; // continue with fewer threads
+	}
+    }
+    pool_worker(&p);
+    for (int i = 0; i < started; i++) {
+	pthread_join(tid[i], NULL);
+    }
+}
+
+
+// ------------------------------------------------
+// Firmware images
+
+typedef struct {
+    const char* name;
+    uint8_t* data;
+    uint32_t size;
+    uint32_t crc;
+} fwimage;
+
+static void fw_load (fwimage* fw, const char* fn) {
+    FILE* fp;
+    long sz;
+    if ((fp = fopen(fn, "rb")) == NULL || fseek(fp, 0, SEEK_END) != 0 || (sz = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+	fatal("cannot read firmware file '%s'", fn);
+    }
+    fw->name = fn;
+    fw->size = sz;
+    fw->data = xmalloc(sz);
+    if (fread(fw->data, 1, sz, fp) != (size_t) sz) {
+	fatal("cannot read firmware file '%s'", fn);
+    }
+    fclose(fp);
+    boot_fwhdr* hdr = (boot_fwhdr*) fw->data;
+    if (sz < (long) sizeof(boot_fwhdr) || (sz & 3) != 0 || hdr->size != sz
+	    || (fw->crc = crc32(0, fw->data + 8, sz - 8)) != hdr->crc) {
+	fatal("invalid firmware file '%s' (not patched?)", fn);
+    }
+}
+
+
+// ------------------------------------------------
+// Verification in simulated flash
+
+typedef struct {
+    uint8_t* flash;
+    boot_uphdr* fwup;
+} up_ctx;
+
+uint32_t up_install_init (void* ctx, uint32_t fwsize, void** pfwdst, uint32_t tmpsize, void** ptmpdst, boot_fwhdr** pcurrentfw) {
+    up_ctx* uc = ctx;
+    if ((fwsize & (FLASH_PAGE_SZ - 1)) != 0 || fwsize > (uint8_t*) uc->fwup - uc->flash) {
+	return BOOT_E_SIZE;
+    }
+    if (tmpsize) {
+	boot_fwhdr* fwhdr = (boot_fwhdr*) uc->flash;
+	uint32_t fwmax = (fwsize > fwhdr->size) ? fwsize : fwhdr->size;
+	if ((tmpsize & (FLASH_PAGE_SZ - 1)) != 0 || fwmax + tmpsize > (uint8_t*) uc->fwup - uc->flash) {
+	    return BOOT_E_SIZE;
+	}
+    }
+    *pfwdst = uc->flash;
+    if (tmpsize && ptmpdst) {
+	*ptmpdst = (uint8_t*) uc->fwup - tmpsize;
+    }
+    if (pcurrentfw) {
+	*pcurrentfw = (boot_fwhdr*) uc->flash;
+    }
+    return BOOT_OK;
+}
+
+void up_flash_wr_page (void* ctx, void* dst, void* src) {
+    memcpy(dst, src, FLASH_PAGE_SZ);
+}
+
+void up_flash_unlock (void* ctx) {
+}
+
+void up_flash_lock (void* ctx) {
+}
+
+uint32_t up_dict (void* ctx, uint32_t dictcrc, uint32_t dictsize, uint8_t** pdict) {
+    return BOOT_E_NOIMPL;
+}
+
+uint32_t up_progress_get (void* ctx) {
+    return 0;
+}
+
+void up_progress_set (void* ctx, uint32_t progress) {
+}
+
+// install update on top of reference firmware (or empty flash) and compare with firmware
+static int verify (const buffer* up, const fwimage* fw, const fwimage* ref, uint32_t tmpsize) {
+    uint32_t fwmax = (ref && ref->size > fw->size) ? ref->size : fw->size;
+    uint32_t upsz = (up->len + FLASH_PAGE_SZ - 1) & ~(FLASH_PAGE_SZ - 1);
+    uint32_t flashsz = ((fwmax + FLASH_PAGE_SZ - 1) & ~(FLASH_PAGE_SZ - 1)) + tmpsize + upsz;
+    uint8_t* flash = aligned_alloc(FLASH_PAGE_SZ, flashsz);
+    int ok;
+
+    if (flash == NULL) {
+	fatal("out of memory%s", "");
+    }
+    memset(flash, 0xff, flashsz);
+    if (ref) {
+	memcpy(flash, ref->data, ref->size);
+    }
+    up_ctx uc = { .flash = flash, .fwup = (boot_uphdr*) (flash + flashsz - upsz) };
+    memcpy(uc.fwup, up->p, up->len);
+    ok = update(&uc, uc.fwup, false) == BOOT_OK
+	&& update(&uc, uc.fwup, true) == BOOT_OK
+	&& memcmp(flash, fw->data, fw->size) == 0;
+    free(flash);
+    return ok;
+}
+
+
+// ------------------------------------------------
+// Update creation
+
+typedef struct {
+    uint8_t uptype;
+    const fwimage* fw;
+    const fwimage* ref;		// reference firmware (delta updates)
+    const char* outfn;
+    uint32_t blksz;
+    int depth;			// match finder depth
+    double weight;		// decode-cost weight of optimal parser (bytes per cycle, <0 for lazy matching)
+    long cycles;		// estimated decode cycles of update
+    int nthreads;		// threads for candidate compressions
+    int search;			// window search (0=centered only, 1=sampled, 2=exhaustive)
+    buffer data;		// update data
+    buffer up;			// update file
+    int ok;
+} upjob;
+
+typedef struct {
+    int nsegs;
+    int window;			// centered window (v2: implied by flag, no segment listed)
+    boot_updeltaseg segs[BOOT_UPDELTA_MAXSEGS];
+    uint8_t* lz4;
+    int lz4len;
+    double cost;		// size and weighted decode cycles
+} candidate;
+
+typedef struct {
+    upjob* job;
+    const uint8_t* state;
+    const uint8_t* blk;
+    uint32_t bsz;
+    candidate* cands;
+} blkctx;
+
+static int compress (upjob* job, const uint8_t* src, uint32_t srclen, const uint8_t* dict, uint32_t dictlen, uint8_t* dst) {
+    if (job->weight < 0) {
+	return lz4_compress(src, srclen, dict, dictlen, dst, LZ4_COMPRESSBOUND(srclen), job->depth);
+    }
+    return lz4_compress_opt(src, srclen, dict, dictlen, dst, LZ4_COMPRESSBOUND(srclen), job->depth, job->weight);
+}
+
+static void compress_candidate (void* arg, int i) {
+    blkctx* bc = arg;
+    candidate* c = &bc->cands[i];
+    uint32_t dictlen = 0;
+    for (int s = 0; s < c->nsegs; s++) {
+	dictlen += c->segs[s].dictlen;
+    }
+    uint8_t* dict = xmalloc(dictlen);
+    for (int s = 0, off = 0; s < c->nsegs; off += c->segs[s++].dictlen) {
+	memcpy(dict + off, bc->state + c->segs[s].dictidx * bc->job->blksz, c->segs[s].dictlen);
+    }
+    c->lz4 = xmalloc(LZ4_COMPRESSBOUND(bc->bsz));
+    c->lz4len = compress(bc->job, bc->blk, bc->bsz, dict, dictlen, c->lz4);
+    c->cost = c->lz4len + (c->window ? 0 : 4 * c->nsegs);
+    if (c->lz4len >= 0 && bc->job->weight > 0) {
+	c->cost += bc->job->weight * lz4_cycles(c->lz4, c->lz4len);
+    }
+    free(dict);
+}
+
+// 64-bit key hash table for voting
+typedef struct {
+    uint64_t key;
+    uint32_t hits;
+    uint8_t used;
+} votekey;
+
+static votekey* vk_find (votekey* t, uint32_t mask, uint64_t key, int add) {
+    uint32_t h = (uint32_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    while (t[h].used) {
+	if (t[h].key == key) {
+	    return &t[h];
+	}
+	h = (h + 1) & mask;
+    }
+    if (add) {
+	t[h].used = 1;
+	t[h].key = key;
+	return &t[h];
+    }
+    return NULL;
+}
+
+// count occurrences of the block's content in the reference blocks (as RefIndex.votes in zfwtool.py)
+static uint32_t* vote_blocks (const uint8_t* state, uint32_t reflen, const uint8_t* blk, uint32_t bsz, uint32_t blksz) {
+    uint32_t nkeys = bsz / 4, tsz = 16, nblks = (reflen + blksz - 1) / blksz;
+    while (tsz < nkeys * 2) {
+	tsz <<= 1;
+    }
+    votekey* t = xcalloc(tsz, sizeof(votekey));
+    uint32_t* votes = xcalloc(nblks + 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i + 8 <= bsz; i += 4) {
+	uint64_t k;
+	memcpy(&k, blk + i, 8);
+	vk_find(t, tsz - 1, k, 1);
+    }
+    // count hits per key, then vote with informative keys only
+    for (int pass = 0; pass < 2; pass++) {
+	for (uint32_t p = 0; p + 8 <= reflen; p++) {
+	    uint64_t k;
+	    memcpy(&k, state + p, 8);
+	    votekey* v = vk_find(t, tsz - 1, k, 0);
+	    if (v) {
+		if (pass == 0) {
+		    v->hits++;
+		} else if (v->hits <= MAXHITS) {
+		    votes[p / blksz]++;
+		}
+	    }
+	}
+    }
+    free(t);
+    return votes;
+}
+
+// sort by votes (descending), then by index
+static int cmp_votes (const void* a, const void* b, void* arg) {
+    const uint32_t* votes = arg;
+    uint32_t ia = *(const uint32_t*) a, ib = *(const uint32_t*) b;
+    return (votes[ia] != votes[ib]) ? ((votes[ia] > votes[ib]) ? -1 : 1) : ((ia < ib) ? -1 : 1);
+}
+
+// choose reference blocks with most votes (as RefIndex.segments in zfwtool.py)
+static int vote_segments (const uint32_t* votes, uint32_t reflen, uint32_t blksz, uint32_t budget, boot_updeltaseg* segs) {
+    uint32_t nblks = (reflen + blksz - 1) / blksz;
+    uint32_t* order = xmalloc(nblks * sizeof(uint32_t));
+    uint8_t* chosen = xcalloc(nblks + 2, 1); // guard entries before and after
+    uint32_t nchosen = 0, n = 0;
+    int runs = 0, nsegs = 0;
+    for (uint32_t b = 0; b < nblks; b++) {
+	if (votes[b]) {
+	    order[n++] = b;
+	}
+    }
+    qsort_r(order, n, sizeof(uint32_t), cmp_votes, (void*) votes);
+    // greedily add blocks with most votes while within budget and segment limit
+    for (uint32_t i = 0; i < n && (nchosen + 1) * blksz <= budget; i++) {
+	uint8_t* c = &chosen[order[i] + 1];
+	int r = runs + 1 - c[-1] - c[1];
+	if (r <= BOOT_UPDELTA_MAXSEGS) {
+	    *c = 1;
+	    runs = r;
+	    nchosen++;
+	}
+    }
+    for (uint32_t b = 0; b < nblks; b++) {
+	if (chosen[b + 1] && !chosen[b]) {
+	    uint32_t e = b;
+	    while (e < nblks && chosen[e + 1]) {
+		e++;
+	    }
+	    uint32_t len = (e - b) * blksz;
+	    segs[nsegs].dictidx = b;
+	    segs[nsegs].dictlen = (len < reflen - b * blksz) ? len : reflen - b * blksz;
+	    nsegs++;
+	}
+    }
+    free(order);
+    free(chosen);
+    return nsegs;
+}
+
+// dictionary budget and first block of single window centered on block (as zfwtool.py)
+static int32_t center_window (const fwimage* ref, uint32_t blksz, uint32_t blkidx, uint32_t* pbudget) {
+    uint32_t budget = (ref->size < 64*1024 - blksz) ? ref->size : 64*1024 - blksz;
+    uint32_t nwin = (budget + blksz - 1) / blksz;
+    int32_t maxidx = (ref->size - budget + blksz - 1) / blksz;
+    int32_t center = (int32_t) blkidx - (int32_t) ((nwin - 1) / 2);
+    *pbudget = budget;
+    return (center < 0) ? 0 : (center > maxidx) ? maxidx : center;
+}
+
+// order changed blocks such that each reference block is overwritten only after all blocks
+// reading it have been installed (as Update.schedule in zfwtool.py), return number of blocks
+// cycles are broken by installing the block whose pending readers lose the fewest votes
+// (without window search only the centered window is tried, so only its blocks are read)
+static uint32_t schedule (const upjob* job, const uint8_t* state, uint32_t* order) {
+    const fwimage* fw = job->fw;
+    const fwimage* ref = job->ref;
+    uint32_t blksz = job->blksz;
+    uint32_t nblocks = (fw->size + blksz - 1) / blksz;
+    uint32_t nref = (ref->size + blksz - 1) / blksz;
+    uint32_t n = 0;
+
+    // default order: forwards if firmware shrinks, else backwards
+    for (uint32_t k = 0; k < nblocks; k++) {
+	uint32_t blkidx = (fw->size < ref->size) ? k : nblocks - 1 - k;
+	uint32_t boff = blkidx * blksz;
+	uint32_t bsz = (fw->size - boff < blksz) ? fw->size - boff : blksz;
+	if (memcmp(fw->data + boff, state + boff, bsz) != 0) {
+	    order[n++] = blkidx;
+	}
+    }
+
+    uint32_t** reads = xmalloc(n * sizeof(uint32_t*));
+    uint64_t* pending = xcalloc(nblocks + nref, sizeof(uint64_t));
+    uint8_t* done = xcalloc(n, 1);
+    uint32_t* sched = xmalloc(n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+	uint32_t boff = order[i] * blksz;
+	reads[i] = vote_blocks(state, ref->size, fw->data + boff, (fw->size - boff < blksz) ? fw->size - boff : blksz, blksz);
+	if (job->search == 0) {
+	    uint32_t budget;
+	    uint32_t wb = center_window(ref, blksz, order[i], &budget);
+	    uint32_t we = wb + (budget + blksz - 1) / blksz;
+	    for (uint32_t r = 0; r < nref; r++) {
+		if (r < wb || r >= we) {
+		    reads[i][r] = 0;
+		}
+	    }
+	}
+	for (uint32_t r = 0; r < nref; r++) {
+	    if (r != order[i]) {
+		pending[r] += reads[i][r];
+	    }
+	}
+    }
+    for (uint32_t k = 0; k < n; k++) {
+	uint32_t best = n;
+	for (uint32_t i = 0; i < n; i++) {
+	    if (!done[i] && (best == n || pending[order[i]] < pending[order[best]])) {
+		best = i;
+		if (pending[order[i]] == 0) {
+		    break;
+		}
+	    }
+	}
+	done[best] = 1;
+	sched[k] = order[best];
+	for (uint32_t r = 0; r < nref; r++) {
+	    if (r != order[best]) {
+		pending[r] -= reads[best][r];
+	    }
+	}
+    }
+    memcpy(order, sched, n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+	free(reads[i]);
+    }
+    free(reads);
+    free(pending);
+    free(done);
+    free(sched);
+    return n;
+}
+
+static int create_delta (upjob* job) {
+    const fwimage* fw = job->fw;
+    const fwimage* ref = job->ref;
+    uint32_t blksz = job->blksz;
+    uint32_t nblocks = (fw->size + blksz - 1) / blksz;
+    uint32_t statesz = (fw->size > ref->size) ? fw->size : ref->size;
+    uint8_t* state = xmalloc(statesz);
+    bool v2 = (job->uptype == BOOT_UPTYPE_LZ4DELTA2);
+
+    if (!v2 && statesz > 256 * blksz) {
+	free(state);
+	return 0; // firmware too large for v1 block header (8-bit block numbers)
+    }
+    memset(state, 0, statesz);
+    memcpy(state, ref->data, ref->size);
+
+    boot_updeltahdr dhdr = { .refcrc = ref->crc, .refsize = ref->size, .blksize = blksz };
+    buf_put(&job->data, &dhdr, sizeof(dhdr));
+
+    uint32_t* order = xmalloc(nblocks * sizeof(uint32_t));
+    uint32_t norder = schedule(job, state, order);
+    for (uint32_t n = 0; n < norder; n++) {
+	uint32_t blkidx = order[n];
+	uint32_t boff = blkidx * blksz;
+	uint32_t bsz = (fw->size - boff < blksz) ? fw->size - boff : blksz; // last block might be shorter than blksz
+	if (memcmp(fw->data + boff, state + boff, bsz) == 0) {
+	    continue;
+	}
+
+	// candidates: single dictionary windows (centered window first, as zfwtool.py)
+	uint32_t budget;
+	int32_t center = center_window(ref, blksz, blkidx, &budget);
+	uint32_t nwin = (budget + blksz - 1) / blksz;
+	int32_t maxidx = (ref->size - budget + blksz - 1) / blksz;
+	uint32_t* votes = (job->search == 2 || (job->search && v2)) ? vote_blocks(state, ref->size, fw->data + boff, bsz, blksz) : NULL;
+	int32_t windows[MAXCANDS + 1];
+	int nwindows = 0;
+	windows[nwindows++] = center;
+	if (job->search == 1) {
+	    // sample window positions
+	    for (int32_t di = 0, step = (maxidx + MAXCANDS) / MAXCANDS; di <= maxidx; di += step) {
+		if (di != center) {
+		    windows[nwindows++] = di;
+		}
+	    }
+	} else if (job->search == 2) {
+	    // score all window positions by votes, keep best
+	    uint32_t* scores = xmalloc((maxidx + 1) * sizeof(uint32_t));
+	    uint32_t* order = xmalloc((maxidx + 1) * sizeof(uint32_t));
+	    for (int32_t di = 0; di <= maxidx; di++) {
+		scores[di] = 0;
+		for (uint32_t b = di; b < di + nwin && b * blksz < ref->size; b++) {
+		    scores[di] += votes[b];
+		}
+		order[di] = di;
+	    }
+	    qsort_r(order, maxidx + 1, sizeof(uint32_t), cmp_votes, scores);
+	    for (int32_t i = 0; i <= maxidx && nwindows <= MAXBEST; i++) {
+		if (order[i] != center && scores[order[i]] > 0) {
+		    windows[nwindows++] = order[i];
+		}
+	    }
+	    free(scores);
+	    free(order);
+	}
+	candidate cands[MAXCANDS + 2];
+	int ncands = 0;
+	for (int i = 0; i < nwindows; i++) {
+	    cands[ncands].nsegs = 1;
+	    cands[ncands].window = (windows[i] == center);
+	    cands[ncands].segs[0].dictidx = windows[i];
+	    cands[ncands].segs[0].dictlen = (ref->size - windows[i] * blksz < budget) ? ref->size - windows[i] * blksz : budget;
+	    ncands++;
+	}
+	// candidate: segments where the block's content is found in the reference (v2 only)
+	cands[ncands].window = 0;
+	if (v2 && votes && (cands[ncands].nsegs = vote_segments(votes, ref->size, blksz, budget, cands[ncands].segs)) > 0) {
+	    ncands++;
+	}
+	free(votes);
+
+	blkctx bc = { .job = job, .state = state, .blk = fw->data + boff, .bsz = bsz, .cands = cands };
+	pool_run(job->nthreads, ncands, compress_candidate, &bc);
+
+	candidate* best = NULL;
+	for (int i = 0; i < ncands; i++) {
+	    if (cands[i].lz4len < 0) {
+		fatal("compression failed for '%s'", fw->name);
+	    }
+	    if (best == NULL || cands[i].cost < best->cost) {
+		best = &cands[i];
+	    }
+	}
+
+	uint32_t hash[8];
+	sha256(hash, fw->data + boff, bsz);
+	if (v2) {
+	    boot_updeltablk2 b = { .hash = { hash[0], hash[1] }, .blkidx = blkidx, .lz4len = best->lz4len };
+	    if (best->window) {
+		b.flags = BOOT_UPDELTA_F_WINDOW;
+	    } else {
+		b.nsegs = best->nsegs;
+	    }
+	    buf_put(&job->data, &b, sizeof(b));
+	    buf_put(&job->data, best->segs, b.nsegs * sizeof(boot_updeltaseg));
+	} else {
+	    boot_updeltablk b = { .hash = { hash[0], hash[1] }, .blkidx = blkidx,
+		.dictidx = best->segs[0].dictidx, .dictlen = best->segs[0].dictlen, .lz4len = best->lz4len };
+	    buf_put(&job->data, &b, sizeof(b));
+	}
+	buf_put(&job->data, best->lz4, best->lz4len);
+	buf_align(&job->data);
+	job->cycles += lz4_cycles(best->lz4, best->lz4len);
+	for (int i = 0; i < ncands; i++) {
+	    free(cands[i].lz4);
+	}
+	memcpy(state + boff, fw->data + boff, bsz);
+    }
+    free(order);
+    free(state);
+    return 1;
+}
+
+static int create_update (upjob* job) {
+    const fwimage* fw = job->fw;
+
+    switch (job->uptype) {
+	case BOOT_UPTYPE_PLAIN:
+	    buf_put(&job->data, fw->data, fw->size);
+	    return 1;
+	case BOOT_UPTYPE_LZ4: {
+	    uint8_t* lz4 = xmalloc(LZ4_COMPRESSBOUND(fw->size));
+	    int lz4len = compress(job, fw->data, fw->size, NULL, 0, lz4);
+	    if (lz4len < 0) {
+		fatal("compression failed for '%s'", fw->name);
+	    }
+	    job->cycles = lz4_cycles(lz4, lz4len);
+	    buf_put(&job->data, lz4, lz4len);
+	    // pad with pad length
+	    uint8_t pad[4], npad = 4 - (lz4len & 3);
+	    memset(pad, npad, sizeof(pad));
+	    buf_put(&job->data, pad, npad);
+	    free(lz4);
+	    return 1;
+	}
+	default:
+	    return create_delta(job);
+    }
+}
+
+// write update file (same layout as Update.tobytes() in zfwtool.py)
+static void write_update (upjob* job, buffer* up) {
+    boot_uphdr hdr = {
+	.size = sizeof(boot_uphdr) + job->data.len,
+	.fwcrc = job->fw->crc,
+	.fwsize = job->fw->size,
+	.uptype = job->uptype,
+    };
+    buf_put(up, &hdr, sizeof(hdr));
+    buf_put(up, job->data.p, job->data.len);
+    ((boot_uphdr*) up->p)->crc = crc32(0, up->p + 8, up->len - 8);
+}
+
+// create and verify update
+static void run_job (void* arg, int i) {
+    upjob* job = (upjob*) arg + i;
+
+    if (create_update(job)) {
+	write_update(job, &job->up);
+	job->ok = verify(&job->up, job->fw, job->ref, job->ref ? job->blksz : 0);
+    }
+    free(job->data.p);
+}
+
+static int save_job (upjob* job) {
+    FILE* fp;
+    if (!job->ok) {
+	fprintf(stderr, "mkupdate: cannot create update '%s' (verification failed or block size too small)\n", job->outfn);
+	return 0;
+    }
+    if ((fp = fopen(job->outfn, "wb")) == NULL || fwrite(job->up.p, job->up.len, 1, fp) != 1 || fclose(fp) != 0) {
+	fprintf(stderr, "mkupdate: cannot write update file '%s': %s\n", job->outfn, strerror(errno));
+	return 0;
+    }
+    printf("%s: firmware size %u, update size %u, ratio %u%%\n", job->outfn, job->fw->size,
+	    job->up.len - (uint32_t) sizeof(boot_uphdr), (uint32_t) ((uint64_t) (job->up.len - sizeof(boot_uphdr)) * 100 / job->fw->size));
+    if (job->weight >= 0) {
+	printf("%s: estimated decode cycles %ld\n", job->outfn, job->cycles);
+    }
+    return 1;
+}
+
+
+// ------------------------------------------------
+// Main
+
+static void usage (void) {
+    fprintf(stderr,
+	    "usage: mkupdate [options] FIRMWARE UPFILE\n"
+	    "  -p          create plain uncompressed update\n"
+	    "  -d REFFILE  create delta update using this firmware file as reference (repeatable,\n"
+	    "              with more than one reference UPFILE is a directory and updates are\n"
+	    "              named after the reference firmware CRC)\n"
+	    "  -b BLKSZ    block size for delta update (default 4096)\n"
+	    "  -2          use v2 block header for delta update\n"
+	    "  -O SCRATCH  optimize delta update: try all block sizes up to the flash scratch\n"
+	    "              budget (temp block) and all dictionary windows, keep the smallest\n"
+	    "  -l DEPTH    match finder depth (default 64)\n"
+	    "  -w WEIGHT   use optimal parser minimizing size + WEIGHT * estimated decode cycles\n"
+	    "              on the device (bytes per cycle, 0 for smallest size)\n"
+	    "  -j THREADS  number of threads (default number of CPUs)\n");
+    exit(2);
+}
+
+int main (int argc, char** argv) {
+    const char** refs = xmalloc(argc * sizeof(char*));
+    int nrefs = 0, plain = 0, v2 = 0, depth = 64, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t blksz = 4096, scratch = 0;
+    double weight = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "pd:b:2O:l:w:j:h")) != -1) {
+	switch (opt) {
+	    case 'p': plain = 1; break;
+	    case 'd': refs[nrefs++] = optarg; break;
+	    case 'b': blksz = strtoul(optarg, NULL, 0); break;
+	    case '2': v2 = 1; break;
+	    case 'O': scratch = strtoul(optarg, NULL, 0); break;
+	    case 'l': depth = atoi(optarg); break;
+	    case 'w': weight = atof(optarg); if (weight < 0) usage(); break;
+	    case 'j': nthreads = atoi(optarg); break;
+	    default: usage();
+	}
+    }
+    if (argc - optind != 2 || (plain && nrefs) || depth < 1 || nthreads < 1
+	    || blksz == 0 || (blksz & (FLASH_PAGE_SZ - 1)) != 0 || blksz > 32*1024
+	    || (scratch && (!nrefs || scratch < FLASH_PAGE_SZ))) {
+	usage();
+    }
+
+    crc32_init();
+
+    fwimage fw;
+    fw_load(&fw, argv[optind]);
+
+    // block sizes to try per reference (optimizer: heuristic first, then all powers of 2 within budget)
+    uint32_t blkszs[16];
+    int nblkszs = 0;
+    if (scratch) {
+	blkszs[nblkszs++] = (blksz <= scratch) ? blksz : scratch & ~(FLASH_PAGE_SZ - 1);
+	for (uint32_t bs = FLASH_PAGE_SZ; bs <= scratch && bs <= 32*1024; bs <<= 1) {
+	    blkszs[nblkszs++] = bs;
+	}
+    } else {
+	blkszs[nblkszs++] = blksz;
+    }
+
+    int ngroups = nrefs ? nrefs : 1;
+    int njobs = ngroups * nblkszs;
+    upjob* jobs = xcalloc(njobs, sizeof(upjob));
+    fwimage* reffws = xcalloc(ngroups, sizeof(fwimage));
+    for (int g = 0; g < ngroups; g++) {
+	const char* outfn = argv[optind + 1];
+	if (nrefs) {
+	    fw_load(&reffws[g], refs[g]);
+	    if (nrefs > 1) {
+		char* fn = xmalloc(strlen(argv[optind + 1]) + 16);
+		sprintf(fn, "%s/%08x.up", argv[optind + 1], reffws[g].crc);
+		outfn = fn;
+	    }
+	}
+	for (int b = 0; b < nblkszs; b++) {
+	    upjob* job = &jobs[g * nblkszs + b];
+	    job->fw = &fw;
+	    job->blksz = blkszs[b];
+	    job->depth = depth;
+	    job->weight = weight;
+	    job->uptype = plain ? BOOT_UPTYPE_PLAIN : BOOT_UPTYPE_LZ4;
+	    job->outfn = outfn;
+	    job->search = (scratch == 0) ? 1 : (b == 0) ? 0 : 2;
+	    if (nrefs) {
+		job->ref = &reffws[g];
+		job->uptype = v2 ? BOOT_UPTYPE_LZ4DELTA2 : BOOT_UPTYPE_LZ4DELTA;
+	    }
+	}
+    }
+
+    // run jobs in parallel, or candidate compressions of a single job
+    int jthreads = (njobs > 1) ? nthreads : 1;
+    for (int i = 0; i < njobs; i++) {
+	jobs[i].nthreads = (njobs > 1) ? 1 : nthreads;
+    }
+    pool_run(jthreads, njobs, run_job, jobs);
+
+    // save smallest valid update per reference
+    int rv = 0;
+    for (int g = 0; g < ngroups; g++) {
+	upjob* group = &jobs[g * nblkszs];
+	upjob* best = group;
+	for (int b = 1; b < nblkszs; b++) {
+	    if (group[b].ok && (!best->ok || group[b].up.len < best->up.len)) {
+		best = &group[b];
+	    }
+	}
+	if (!save_job(best)) {
+	    rv = 1;
+	} else if (scratch) {
+	    if (group->ok) {
+		printf("%s: block size %u, heuristic (block size %u) %u, gain %d bytes (%d%%)\n", best->outfn,
+			best->blksz, group->blksz, group->up.len - (uint32_t) sizeof(boot_uphdr),
+			(int) (group->up.len - best->up.len), (int) ((group->up.len - best->up.len) * 100 / group->up.len));
+	    } else {
+		printf("%s: block size %u, heuristic (block size %u) failed\n", best->outfn, best->blksz, group->blksz);
+	    }
+	}
+	for (int b = 0; b < nblkszs; b++) {
+	    free(group[b].up.p);
+	}
+    }
+    return rv;
+}
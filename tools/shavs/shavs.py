@@ -3,6 +3,7 @@ import pathlib
 import re
 import struct
 import subprocess
+import sys
 import tqdm
 import zipfile as zip
 
@@ -116,4 +117,5 @@ class SHAVS:
         print('All tests passed.')
 
 #SHAVS('shabytetestvectors.zip', 'SHA256', HashlibHash(hashlib.sha256)).run()
-SHAVS('shabytetestvectors.zip', 'SHA256', ProcessHash('../../src/common/sha2test')).run()
+# optional argument selects kernel of x86 build (auto, scalar, shani, avx2)
+SHAVS('shabytetestvectors.zip', 'SHA256', ProcessHash(['../../src/common/sha2test'] + sys.argv[1:2])).run()